@@ -0,0 +1,90 @@
+/**
+ * @file admission.c
+ * @brief Admission control and overload shedding for aesdsocket
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "admission.h"
+#include "log-ring.h"
+#include "metrics.h"
+
+static struct admission_limits limits;
+static unsigned int connections;
+static size_t inflight;
+
+
+void admission_configure(const struct admission_limits *l) {
+    limits = *l;
+}
+
+
+const struct admission_limits *admission_limits(void) {
+    return &limits;
+}
+
+
+// reset rather than close, the client learns at once and no TIME_WAIT is left behind
+static void reject(int fd) {
+    struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+    log_ring_post(LOG_MSG_REJECTED, 0, NULL);
+    metrics_count(M_REJECTED);
+}
+
+
+int admission_admit(int fd) {
+    unsigned int open = __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+
+    if ((limits.max_connections && open > limits.max_connections) ||
+        (limits.max_inflight && __atomic_load_n(&inflight, __ATOMIC_RELAXED) >= limits.max_inflight)) {
+        __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+        reject(fd);
+        return -1;
+    }
+    return 0;
+}
+
+
+void admission_leave(size_t charged) {
+    if (charged) __atomic_sub_fetch(&inflight, charged, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+}
+
+
+unsigned int admission_connections(void) {
+    return __atomic_load_n(&connections, __ATOMIC_RELAXED);
+}
+
+
+void admission_charge(size_t *charged, size_t buffered) {
+    if (buffered == *charged) return;
+    if (buffered > *charged) {
+        __atomic_add_fetch(&inflight, buffered - *charged, __ATOMIC_RELAXED);
+    } else {
+        __atomic_sub_fetch(&inflight, *charged - buffered, __ATOMIC_RELAXED);
+    }
+    *charged = buffered;
+}
+
+
+static int set_timeout(int fd, int option, long ms) {
+    struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+
+    if (ms > 0 && setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv)) == -1) {
+        syslog(LOG_ERR, "Failed to set socket timeout: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+int admission_set_timeouts(int fd) {
+    if (set_timeout(fd, SO_RCVTIMEO, limits.idle_timeout_ms) == -1) return -1;
+    return set_timeout(fd, SO_SNDTIMEO, limits.slow_timeout_ms);
+}
@@ -0,0 +1,78 @@
+/**
+ * @file admission.h
+ * @brief Admission control and overload shedding for aesdsocket
+ *
+ * A client is only admitted while fewer than the maximum number of connections are open
+ * and the bytes buffered by all connections but not handled yet stay below the in-flight
+ * limit.  Otherwise it is accepted and reset right away, so it fails fast instead of
+ * waiting in the listen backlog or slowing down the clients already served.
+ *
+ * Admitted connections are closed when they send nothing for the idle timeout, and when a
+ * response makes no progress for the slow reader timeout.  Subscribers are expected to be
+ * quiet and only have the slow reader timeout.
+ */
+
+#ifndef AESDSOCKET_ADMISSION_H
+#define AESDSOCKET_ADMISSION_H
+
+#include <stddef.h>
+
+struct admission_limits {
+    /**
+     * Most connections open at once, 0 for no limit
+     */
+    unsigned int max_connections;
+    /**
+     * Most bytes received but not handled yet over all connections, 0 for no limit
+     */
+    size_t max_inflight;
+    /**
+     * Close a connection that sent nothing for this long, 0 to never
+     */
+    long idle_timeout_ms;
+    /**
+     * Close a connection whose response could not be sent for this long, 0 to never
+     */
+    long slow_timeout_ms;
+};
+
+/**
+ * Set the limits.  Call before any client is accepted.
+ */
+void admission_configure(const struct admission_limits *limits);
+
+/**
+ * @return the limits set by admission_configure()
+ */
+const struct admission_limits *admission_limits(void);
+
+/**
+ * Decide on the client just accepted on @param fd.  A rejected client is reset and its
+ * descriptor closed.
+ * @return 0 if the client was admitted and counts against the limits, -1 if it was rejected
+ */
+int admission_admit(int fd);
+
+/**
+ * Account for an admitted connection being closed, with the bytes it was charged for.
+ */
+void admission_leave(size_t charged);
+
+/**
+ * @return the number of admitted connections still open
+ */
+unsigned int admission_connections(void);
+
+/**
+ * Update the bytes a connection is charged for to the @param buffered bytes it holds now.
+ * @param charged the bytes the connection was charged for so far, updated
+ */
+void admission_charge(size_t *charged, size_t buffered);
+
+/**
+ * Apply the idle and slow reader timeouts to the blocking socket @param fd.
+ * @return 0 on success, -1 on error
+ */
+int admission_set_timeouts(int fd);
+
+#endif /* AESDSOCKET_ADMISSION_H */
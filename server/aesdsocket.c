@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,54 +12,151 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <sys/queue.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
-#include <sys/ioctl.h>
 #include <sys/stat.h>
-#include "../aesd-char-driver/aesd_ioctl.h"
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include "aesdsocket.h"
+#include "event-loop.h"
+#include "worker-pool.h"
+#include "readback.h"
+#include "store-cache.h"
+#include "commit-queue.h"
+#include "store-backend.h"
+#include "binary-proto.h"
+#include "line-stream.h"
+#include "broadcast.h"
+#include "conn-table.h"
+#include "timestamp.h"
+#include "metrics.h"
+#include "probes.h"
+#include "log-ring.h"
+#include "admission.h"
+#include "fair-queue.h"
+#include "handoff.h"
+#include "datagram.h"
 
 
 #define PORT "9000"  // the port users will be connecting to
-#define BACKLOG 10   // how many pending connections queue will hold
-#define BUFFER_SIZE 512
-#define TS_BUFFER_SIZE 128
-#define TS_INTERVAL_IN_S 10 // the interval in seconds for the timer to append timestamps to the file
+#define BACKLOG 10   // default for how many pending connections queue will hold
+
+// long options without a short form
+enum {
+    OPT_BATCH_SIZE = 256,
+    OPT_LINGER_US,
+    OPT_DURABILITY,
+    OPT_SYNC_INTERVAL_MS,
+    OPT_SYNC_INTERVAL_BYTES,
+    OPT_SEGMENT_BYTES,
+    OPT_RETAIN_BYTES,
+    OPT_RETAIN_SECS,
+    OPT_SUBSCRIBE_RING,
+    OPT_SLOW_SUBSCRIBER,
+    OPT_ACCEPTORS,
+    OPT_IO_URING,
+    OPT_CONN_SLOTS,
+    OPT_TS_INTERVAL,
+    OPT_TS_FORMAT,
+    OPT_METRICS_SOCKET,
+    OPT_MAX_CONNECTIONS,
+    OPT_MAX_INFLIGHT,
+    OPT_IDLE_TIMEOUT_MS,
+    OPT_SLOW_TIMEOUT_MS,
+    OPT_BACKLOG,
+    OPT_FAIR_QUEUE,
+    OPT_FAIR_QUANTUM,
+    OPT_CLIENT_BYTE_RATE,
+    OPT_CLIENT_PACKET_RATE,
+    OPT_CLIENT_BURST_MS,
+    OPT_HANDOFF_SOCKET,
+    OPT_DRAIN_TIMEOUT_MS,
+    OPT_UDP,
+    OPT_UDP_BATCH,
+    OPT_UNIX_SOCKET,
+};
+
+#define KNOCK_INTERVAL_NS 10000000
 
+// selects the default backend, -s picks another one at runtime
 #define USE_AESD_CHAR_DEVICE 1
 #ifdef USE_AESD_CHAR_DEVICE
-    #define DATA_FILE "/dev/aesdchar"
+    #define DEFAULT_STORE "device"
 #else
-    #define DATA_FILE "/var/tmp/aesdsocketdata"
+    #define DEFAULT_STORE "file"
 #endif
 
 
-struct list_data_s {
-    pthread_t thread_connection;
-    int client_fd;
-    LIST_ENTRY(list_data_s) entries;
-};
-
-LIST_HEAD(listhead, list_data_s) head;
-
-pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-#if !USE_AESD_CHAR_DEVICE
-pthread_t thread_timer;
-#endif
-
-int server_fd = -1;
-int running = 1;
+static const struct store_backend *store;
+
+/**
+ * Listening sockets, one per acceptor when SO_REUSEPORT shards the port
+ */
+static int *listen_fds;
+static int num_listeners;
+static int datagram_fd = -1;    // the UDP socket for datagram ingest, owned by the receiver once started
+
+/**
+ * Stream socket for clients on this host, they skip the TCP stack
+ */
+static const char *unix_path;
+static int unix_fd = -1;
+static struct stat unix_stat;   // the socket file at unix_path
+volatile int running = 1;
+static volatile sig_atomic_t shutdown_requested;
+
+static pthread_t main_thread;
+static int accept_done;     // the main thread stopped accepting
+
+
+// wake every acceptor blocked in accept(), the descriptors are closed once they are done
+static void stop_listeners(void) {
+    // shutting down the sockets would stop the process they were passed on to as well
+    if (handoff_done()) return;
+    for (int i = 0; i < num_listeners; i++) {
+        shutdown(listen_fds[i], SHUT_RDWR);
+    }
+    if (unix_fd != -1) shutdown(unix_fd, SHUT_RDWR);
+}
 
 
 void signal_handler(int signo) {
     syslog(LOG_INFO, "Caught signal, exiting");
 
     running = 0;
-    if (server_fd != -1) {
-        close(server_fd);
-        server_fd = -1;
+    shutdown_requested = 1;
+    stop_listeners();
+}
+
+
+// only interrupts accept() or sigsuspend() so the thread sees running cleared
+static void wake_handler(int signo) {
+}
+
+
+static void knock_pause(void) {
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = KNOCK_INTERVAL_NS };
+    nanosleep(&ts, NULL);
+}
+
+
+// called on the handoff thread once the new process accepts on the listening sockets
+static void stop_accepting(void) {
+    running = 0;
+    event_loop_stop_accepting();
+    // datagrams queued from here on are the new process's
+    datagram_stop();
+    // a signal arriving just before the main thread blocks in accept() is lost, keep knocking
+    while (!__atomic_load_n(&accept_done, __ATOMIC_ACQUIRE)) {
+        pthread_kill(main_thread, SIGUSR1);
+        knock_pause();
     }
 }
 
@@ -91,160 +189,1243 @@ int daemonize() {
 
 
 void cleanup_handler(void *arg) {
-    struct list_data_s *datap = (struct list_data_s *)arg;
-    if (datap->client_fd != -1) close(datap->client_fd);
+    // once the slot is free it belongs to the next client, a cancel must not cut this short
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    struct conn_slot *slot = (struct conn_slot *)arg;
+    AESD_PROBE1(conn_close, slot->client_fd);
+    metrics_count(M_DISCONNECTS);
+    // leave only once the slot is free, an admitted client always finds one
+    size_t charged = slot->charged;
+    conn_table_put(slot);
+    admission_leave(charged);
+}
+
 
-    pthread_mutex_lock(&list_mutex);
-    LIST_REMOVE(datap, entries);
-    pthread_mutex_unlock(&list_mutex);
-    free(datap);
+// write the buffers to the store and mirror them in the cache, file_mutex must be held
+static int store_write_locked(const struct iovec *iov, int iovcnt) {
+    off_t size = 0;
+    size_t trimmed;
+    uint64_t start = metrics_now();
+    AESD_PROBE3(write_start, iov, iovcnt, start);
+    int ret = store->append(iov, iovcnt, &size, &trimmed);
+    uint64_t end = metrics_now();
+    metrics_observe(H_WRITE, end - start);
+    AESD_PROBE4(write_done, ret, size, start, end);
+    if (ret != 0) metrics_count(M_ERRORS);
+
+    if (cache_enabled() && !store->in_cache) {
+        if (trimmed) cache_trim(trimmed);
+        int synced = ret == 0;
+        for (int i = 0; synced && i < iovcnt; i++) {
+            synced = cache_append(iov[i].iov_base, iov[i].iov_len, i == iovcnt - 1 ? size : -1) == 0;
+        }
+        if (!synced) store->rebuild_cache();
+    }
+    if (ret == 0) bcast_publish(iov, iovcnt);
+    return ret;
 }
 
 
-void *handle_connection(void *arg) {
-    struct list_data_s *datap = (struct list_data_s *)arg;
-    int client_fd = datap->client_fd;
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
+static uint64_t lock_acquired_at;   // protected by file_mutex
+
+
+static void lock_store(void) {
+    uint64_t start = metrics_now();
+    pthread_mutex_lock(&file_mutex);
+    lock_acquired_at = metrics_now();
+    metrics_observe(H_LOCK_WAIT, lock_acquired_at - start);
+    AESD_PROBE2(lock_acquired, start, lock_acquired_at);
+}
 
-    pthread_cleanup_push(cleanup_handler, datap);
 
-    int file_fd = open(DATA_FILE, O_CREAT | O_APPEND | O_RDWR, S_IRWXU | S_IRGRP | S_IROTH);
-    if (file_fd == -1) {
-        syslog(LOG_ERR, "Failed to open device file %s: %s", DATA_FILE, strerror(errno));
+static void unlock_store(void) {
+    AESD_PROBE1(lock_released, lock_acquired_at);
+    pthread_mutex_unlock(&file_mutex);
+}
+
+
+// commit thread callback, writes a whole batch with one writev()
+static int store_commit_batch(struct commit_req *batch, int count) {
+    struct iovec iov[COMMIT_MAX_BATCH];
+    int n = 0;
+
+    for (struct commit_req *req = batch; req; req = req->next) {
+        iov[n].iov_base = (void *)req->buf;
+        iov[n].iov_len = req->len;
+        n++;
     }
 
-    //receive data
-    while (1) {
-        bytes_received = recv(client_fd, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            if (bytes_received < 0) {
-                syslog(LOG_ERR, "Failed to receive data: %s", strerror(errno));
-            } else {
-                syslog(LOG_INFO, "Client disconnected");
-            }
-            break;
+    lock_store();
+    int ret = store_write_locked(iov, n);
+    unlock_store();
+    return ret;
+}
+
+
+// commit thread callback, makes everything written to the store durable
+static int store_datasync(void) {
+    lock_store();
+    int ret = store->sync();
+    unlock_store();
+    return ret;
+}
+
+
+int store_append_records(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+
+    // written right away also with group commit, nobody waits for these records
+    fair_queue_enter(len);
+    lock_store();
+    int ret = store_write_locked(iov, iovcnt);
+    unlock_store();
+    fair_queue_leave();
+    if (metrics_received()) metrics_since(H_RECV_COMMIT, metrics_received());
+    return ret;
+}
+
+
+int store_append(const char *buf, size_t len) {
+    int ret;
+
+    // a client over its rate waits here, where it can still be cancelled
+    fair_queue_pay();
+
+    // a cancelled connection thread must not leave file_mutex locked or a commit request behind
+    int cancel_state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+
+    fair_queue_charge(len);
+    if (commit_queue_enabled()) {
+        ret = commit_queue_commit(buf, len);
+    } else {
+        struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+        fair_queue_enter(len);
+        lock_store();
+        ret = store_write_locked(&iov, 1);
+        unlock_store();
+        fair_queue_leave();
+    }
+    if (metrics_received()) metrics_since(H_RECV_COMMIT, metrics_received());
+
+    pthread_setcancelstate(cancel_state, NULL);
+    return ret;
+}
+
+
+static int has_prefix(const char *packet, size_t len, const char *prefix, size_t prefix_len) {
+    return len >= prefix_len && strncmp(packet, prefix, prefix_len) == 0;
+}
+
+
+int packet_is_command(const char *packet, size_t len) {
+    return has_prefix(packet, len, SEEKTO_CMD, SEEKTO_CMD_LEN) ||
+           has_prefix(packet, len, TAIL_CMD, TAIL_CMD_LEN) ||
+           has_prefix(packet, len, RANGE_CMD, RANGE_CMD_LEN) ||
+           has_prefix(packet, len, SINCE_CMD, SINCE_CMD_LEN) ||
+           (len == STATS_CMD_LEN && memcmp(packet, STATS_CMD, len) == 0);
+}
+
+
+int packet_is_subscribe(const char *packet, size_t len) {
+    return len == SUBSCRIBE_CMD_LEN && memcmp(packet, SUBSCRIBE_CMD, len) == 0;
+}
+
+
+int store_readback(struct readback *rb) {
+    return store_read_range(rb, 0, -1);
+}
+
+
+off_t store_size(void) {
+    if (cache_enabled()) {
+        // sized like the snapshot store_read_range() is going to send
+        off_t size = cache_size();
+        if (size >= 0) return size;
+    }
+    return store->size();
+}
+
+
+int store_read_range(struct readback *rb, off_t start, off_t len) {
+    struct cache_snapshot snap;
+    uint64_t started = metrics_now();
+    int ret;
+
+    AESD_PROBE3(readback_start, start, len, started);
+    if (cache_enabled() && cache_snapshot_from(&snap, start) == 0) {
+        readback_start_snapshot(rb, &snap);
+        if (len >= 0) readback_limit(rb, len);
+        ret = 0;
+    } else {
+        ret = store->read_range(rb, start, len);
+    }
+    metrics_since(H_READBACK, started);
+    return ret;
+}
+
+
+off_t store_locate(unsigned int write_cmd, unsigned int write_cmd_offset) {
+    if (cache_enabled()) {
+        off_t pos = cache_locate(write_cmd, write_cmd_offset);
+        if (pos >= 0) return pos;
+    }
+    return store->locate(write_cmd, write_cmd_offset);
+}
+
+
+int64_t store_records(void) {
+    if (cache_enabled()) {
+        int64_t count = cache_records();
+        if (count >= 0) return count;
+    }
+    if (store->records) {
+        int64_t count = store->records();
+        if (count >= 0) return count;
+    }
+
+    // without a count the store holds at most max_records, find the first one missing
+    int64_t lo = 0;
+    int64_t hi = store->max_records;
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        if (store_locate(mid, 0) >= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
+    return lo;
+}
 
-        buffer[bytes_received] = '\0';
 
-        // Check for AESDCHAR_IOCSEEKTO:X,Y pattern
-        if (strncmp(buffer, "AESDCHAR_IOCSEEKTO:", 19) == 0) {
-            unsigned int write_cmd, write_cmd_offset;
-            if (sscanf(buffer + 19, "%u,%u", &write_cmd, &write_cmd_offset) == 2) {
-                if (file_fd < 0) {
-                    syslog(LOG_ERR, "Failed to open file for ioctl: %s", strerror(errno));
-                } else {
-                    struct aesd_seekto seekto;
-                    seekto.write_cmd = write_cmd;
-                    seekto.write_cmd_offset = write_cmd_offset;
-                    if (ioctl(file_fd, AESDCHAR_IOCSEEKTO, &seekto) < 0) {
-                        syslog(LOG_ERR, "Failed to perform ioctl: %s", strerror(errno));
-                    }
-
-                    char read_buf[BUFFER_SIZE];
-                    ssize_t n;
-                    while ((n = read(file_fd, read_buf, BUFFER_SIZE)) > 0) {
-                        send(datap->client_fd, read_buf, n, 0);
-                    }
-                    close(file_fd);
-                }
+// start sending records @param from up to but not including @param to
+static int read_records(struct readback *rb, int64_t from, int64_t to) {
+    int64_t count = store_records();
+    if (to > count) to = count;
+    if (from >= to) return -1;
+
+    off_t start = store_locate(from, 0);
+    if (start < 0) return -1;
+    if (to == count) return store_read_range(rb, start, -1);
+
+    off_t end = store_locate(to, 0);
+    if (end < 0) return store_read_range(rb, start, -1);
+    return store_read_range(rb, start, end - start);
+}
+
+
+static int handle_seekto(const char *args, struct readback *rb) {
+    unsigned int write_cmd, write_cmd_offset;
+    if (sscanf(args, "%u,%u", &write_cmd, &write_cmd_offset) != 2) {
+        log_ring_post(LOG_MSG_BAD_COMMAND, 0, "ioctl");
+        return -1;
+    }
+
+    off_t pos = store_locate(write_cmd, write_cmd_offset);
+    if (pos >= 0) return store_read_range(rb, pos, -1);
+
+    // like the driver, an invalid seek leaves the read-back at the start
+    char where[LOG_RING_STR_MAX];
+    snprintf(where, sizeof(where), "%u,%u", write_cmd, write_cmd_offset);
+    log_ring_post(LOG_MSG_BAD_SEEK, 0, where);
+    return store_readback(rb);
+}
+
+
+static int handle_tail(const char *args, struct readback *rb) {
+    unsigned int n;
+    if (sscanf(args, "%u", &n) != 1) {
+        log_ring_post(LOG_MSG_BAD_COMMAND, 0, "TAIL");
+        return -1;
+    }
+
+    int64_t count = store_records();
+    return read_records(rb, count > n ? count - n : 0, count);
+}
+
+
+static int handle_range(const char *args, struct readback *rb) {
+    unsigned int from, to;
+    if (sscanf(args, "%u,%u", &from, &to) != 2 || to < from) {
+        log_ring_post(LOG_MSG_BAD_COMMAND, 0, "RANGE");
+        return -1;
+    }
+    return read_records(rb, from, (int64_t)to + 1);
+}
+
+
+static int handle_since(const char *args, struct readback *rb) {
+    unsigned long long offset;
+    if (sscanf(args, "%llu", &offset) != 1) {
+        log_ring_post(LOG_MSG_BAD_COMMAND, 0, "SINCE");
+        return -1;
+    }
+
+    off_t size = store_size();
+    if (size < 0 || offset >= (unsigned long long)size) return -1;
+    return store_read_range(rb, offset, -1);
+}
+
+
+// answer with the metrics, written to a memfd so they are sent like the store
+static int handle_stats(struct readback *rb) {
+    int fd = memfd_create("aesdsocket-stats", MFD_CLOEXEC);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to create memfd: %s", strerror(errno));
+        return -1;
+    }
+    if (metrics_write(fd) == -1 || lseek(fd, 0, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    readback_start(rb, fd);
+    return 0;
+}
+
+
+int handle_packet(const char *packet, size_t len, struct readback *rb) {
+    if (packet_is_command(packet, len)) {
+        char cmd[BUFFER_SIZE];
+        size_t cmd_len = len < sizeof(cmd) ? len : sizeof(cmd) - 1;
+        memcpy(cmd, packet, cmd_len);
+        cmd[cmd_len] = '\0';
+
+        if (has_prefix(cmd, cmd_len, SEEKTO_CMD, SEEKTO_CMD_LEN)) return handle_seekto(cmd + SEEKTO_CMD_LEN, rb);
+        if (has_prefix(cmd, cmd_len, TAIL_CMD, TAIL_CMD_LEN)) return handle_tail(cmd + TAIL_CMD_LEN, rb);
+        if (has_prefix(cmd, cmd_len, RANGE_CMD, RANGE_CMD_LEN)) return handle_range(cmd + RANGE_CMD_LEN, rb);
+        if (has_prefix(cmd, cmd_len, STATS_CMD, STATS_CMD_LEN)) return handle_stats(rb);
+        return handle_since(cmd + SINCE_CMD_LEN, rb);
+    }
+
+    if (store_append(packet, len) == -1) return -1;
+    return store_readback(rb);
+}
+
+
+struct packet_job {
+    struct work_item work;
+    const char *packet;
+    size_t len;
+    const struct bin_frame *frame;  // set for a binary request instead of a text packet
+    struct conn_slot *datap;
+    uint64_t received;      // when the packet was received, for the worker's commit
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+
+/**
+ * Send the pending response of @param datap.  A client that does not take it within the
+ * slow reader timeout is cut off, whatever it still sends is not answered.
+ * @return 0 when the response was sent or failed, -1 for a slow reader
+ */
+static int respond(struct conn_slot *datap) {
+    if (readback_send(&datap->rb, datap->client_fd) != 0) return 0;
+
+    log_ring_post(LOG_MSG_SLOW_READER, 0, NULL);
+    metrics_count(M_TIMEOUTS);
+    readback_release(&datap->rb);
+    shutdown(datap->client_fd, SHUT_RDWR);
+    return -1;
+}
+
+
+static void run_packet_job(struct work_item *work) {
+    struct packet_job *job = (struct packet_job *)work;
+
+    metrics_mark_received(job->received);
+    fair_queue_set_flow(&job->datap->flow);
+    if (job->frame) {
+        bin_handle(job->frame, &job->datap->rb);
+        respond(job->datap);
+    } else if (handle_packet(job->packet, job->len, &job->datap->rb) == 0) {
+        respond(job->datap);
+    }
+    fair_queue_set_flow(NULL);
+
+    pthread_mutex_lock(&job->lock);
+    job->done = 1;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+
+// let a pool worker handle the packet and wait for it, so responses stay in order
+static void process_on_pool(struct conn_slot *datap, const char *packet, size_t len,
+                            const struct bin_frame *frame) {
+    struct packet_job job = {
+        .work.fn = run_packet_job,
+        .packet = packet,
+        .len = len,
+        .frame = frame,
+        .datap = datap,
+        .received = metrics_received(),
+        .done = 0,
+    };
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    // the job lives on this stack, shutdown must not cancel us while a worker uses it
+    int cancel_state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+
+    if (worker_pool_submit(&job.work) == 0) {
+        pthread_mutex_lock(&job.lock);
+        while (!job.done) pthread_cond_wait(&job.cond, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+    } else {
+        run_packet_job(&job.work);
+    }
+
+    pthread_setcancelstate(cancel_state, NULL);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+}
+
+
+// receive into the connection's stream, @return as recv() with a message logged for 0 and -1
+static ssize_t receive_some(struct conn_slot *datap, char *space, size_t room) {
+    ssize_t received = recv(datap->client_fd, space, room, 0);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // SO_RCVTIMEO ran out
+        log_ring_post(LOG_MSG_IDLE_TIMEOUT, 0, NULL);
+        metrics_count(M_TIMEOUTS);
+    } else if (received < 0) {
+        log_ring_post(LOG_MSG_RECV_FAILED, errno, NULL);
+        metrics_count(M_ERRORS);
+    } else if (received == 0) {
+        log_ring_post(LOG_MSG_DISCONNECTED, 0, NULL);
+    } else {
+        line_stream_received(&datap->rx, received);
+        metrics_add(M_BYTES_IN, received);
+        metrics_mark_received(metrics_now());
+    }
+    return received;
+}
+
+
+// serve a client speaking the binary protocol, the stream holds the bytes received so far
+static void serve_binary(struct conn_slot *datap) {
+    struct line_stream *rx = &datap->rx;
+
+    for (;;) {
+        struct bin_frame frame;
+        size_t avail;
+        ssize_t n;
+        for (;;) {
+            const char *data = line_stream_data(rx, &avail);
+            if ((n = bin_frame_parse(data, avail, &frame)) <= 0) break;
+            line_stream_consume(rx, n);
+            metrics_count(M_PACKETS);
+            AESD_PROBE2(packet_framed, datap->client_fd, n);
+            if (worker_pool_enabled()) {
+                process_on_pool(datap, NULL, 0, &frame);
             } else {
-                syslog(LOG_ERR, "Invalid ioctl command format from client");
+                bin_handle(&frame, &datap->rb);
+                if (respond(datap) == -1) return;
             }
-            continue;
+        }
+        admission_charge(&datap->charged, avail);
+        if (n < 0) {
+            log_ring_post(LOG_MSG_MALFORMED_FRAME, 0, NULL);
+            metrics_count(M_ERRORS);
+            return;
         }
 
-        pthread_mutex_lock(&file_mutex);
+        size_t room;
+        char *space = line_stream_space(rx, BIN_MAX_FRAME, &room);
+        if (!space) {
+            if (avail >= BIN_MAX_FRAME) log_ring_post(LOG_MSG_FRAME_TOO_LARGE, 0, NULL);
+            return;
+        }
+        if (receive_some(datap, space, room) <= 0) return;
+    }
+}
+
+
+static void unsubscribe(void *arg) {
+    struct bcast_waker *waker = arg;
+    bcast_remove_waker(waker);
+    close(waker->fd);
+    bcast_unsubscribe();
+}
 
-        if (file_fd == -1) {
-            syslog(LOG_ERR, "Failed to open file for writing: %s", strerror(errno));
-            pthread_mutex_unlock(&file_mutex);
+
+// stream every record committed from now on to the client until it hangs up
+static void serve_subscriber(struct conn_slot *datap) {
+    struct bcast_waker waker;
+    waker.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (waker.fd == -1) {
+        syslog(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+        return;
+    }
+    bcast_add_waker(&waker);
+    uint64_t pos = bcast_subscribe();
+    long slow_timeout_ms = admission_limits()->slow_timeout_ms;
+
+    pthread_cleanup_push(unsubscribe, &waker);
+    for (;;) {
+        int sent = bcast_send(&pos, datap->client_fd);
+        if (sent < 0) break;
+
+        // wait for the socket to drain or for more records, and notice the client leaving
+        struct pollfd fds[2] = {
+            { .fd = datap->client_fd, .events = sent ? POLLIN : POLLIN | POLLOUT },
+            { .fd = waker.fd, .events = POLLIN },
+        };
+        int ready = poll(fds, 2, !sent && slow_timeout_ms > 0 ? slow_timeout_ms : -1);
+        if (ready == -1 && errno != EINTR) {
+            syslog(LOG_ERR, "poll failed: %s", strerror(errno));
             break;
         }
-        if (write(file_fd, buffer, bytes_received) == -1) {
-            syslog(LOG_ERR, "Failed to write to file: %s", strerror(errno));
-            close(file_fd);
-            pthread_mutex_unlock(&file_mutex);
+        if (ready == 0) {
+            // the socket stayed full for the whole slow reader timeout
+            log_ring_post(LOG_MSG_SLOW_READER, 0, NULL);
+            metrics_count(M_TIMEOUTS);
             break;
         }
-        close(file_fd);
-        pthread_mutex_unlock(&file_mutex);
-
-        if (buffer[bytes_received - 1] == '\n') {
-            int file_fd_read = open(DATA_FILE, O_RDONLY);
-            if (file_fd_read == -1) {
-                syslog(LOG_ERR, "Failed to open file for reading: %s", strerror(errno));
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(waker.fd, &count, sizeof(count)) == -1 && errno != EAGAIN) break;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            // anything a subscriber sends is ignored, it only ends the subscription by hanging up
+            char discard[BUFFER_SIZE];
+            ssize_t n = recv(datap->client_fd, discard, sizeof(discard), MSG_DONTWAIT);
+            if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                log_ring_post(LOG_MSG_SUBSCRIBER_LEFT, 0, NULL);
                 break;
             }
-            ssize_t read_bytes;
-            while ((read_bytes = read(file_fd_read, buffer, BUFFER_SIZE)) > 0) {
-                if (send(client_fd, buffer, read_bytes, 0) == -1) {
-                    perror("send");
-                    break;
-                }
+        }
+    }
+    pthread_cleanup_pop(1);
+}
+
+
+void *handle_connection(void *arg) {
+    struct conn_slot *datap = (struct conn_slot *)arg;
+    struct line_stream *rx = &datap->rx;
+
+    pthread_cleanup_push(cleanup_handler, datap);
+    fair_queue_set_flow(&datap->flow);
+
+    //receive data
+    while (1) {
+        size_t avail;
+        size_t room;
+        char *space = line_stream_space(rx, RX_MAX, &room);
+        if (!space) {
+            const char *data = line_stream_data(rx, &avail);
+            if (avail < RX_MAX) break;
+            // no newline in sight, store what we have as a partial packet
+            if (store_append(data, avail) == -1) break;
+            line_stream_consume(rx, avail);
+            continue;
+        }
+
+        if (receive_some(datap, space, room) <= 0) {
+            // an unfinished command is still answered, other unfinished text is stored
+            const char *tail = line_stream_data(rx, &avail);
+            if (packet_is_command(tail, avail)) {
+                if (handle_packet(tail, avail, &datap->rb) == 0) respond(datap);
+            } else if (avail > 0) {
+                store_append(tail, avail);
+            }
+            break;
+        }
+
+        // the first byte picks the protocol for the whole connection
+        if (!datap->negotiated && (unsigned char)*space == BIN_MAGIC) {
+            serve_binary(datap);
+            break;
+        }
+        datap->negotiated = 1;
+
+        // answer every complete packet in order, pipelined ones included
+        const char *packet;
+        size_t len;
+        while (line_stream_next(rx, &packet, &len)) {
+            metrics_count(M_PACKETS);
+            AESD_PROBE2(packet_framed, datap->client_fd, len);
+            if (packet_is_subscribe(packet, len)) {
+                serve_subscriber(datap);
+                goto done;
+            }
+            if (worker_pool_enabled()) {
+                process_on_pool(datap, packet, len, NULL);
+            } else if (handle_packet(packet, len, &datap->rb) == 0 && respond(datap) == -1) {
+                goto done;
             }
-            close(file_fd_read);
         }
+        line_stream_data(rx, &avail);
+        admission_charge(&datap->charged, avail);
     }
 
+done:
     pthread_cleanup_pop(1);
     return NULL;
 }
 
 
-#if !USE_AESD_CHAR_DEVICE
-void *append_timestamp(void *arg) {
-    while (running) {
+void pin_thread(pthread_t thread, int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        syslog(LOG_ERR, "Failed to get CPU affinity: %s", strerror(errno));
+        return;
+    }
 
-        sleep(TS_INTERVAL_IN_S);
+    // spread the threads over the CPUs we may run on, wrapping around if there are more threads
+    int nth = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || nth-- > 0) continue;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if (err != 0) {
+            syslog(LOG_ERR, "Failed to pin thread to CPU %d: %s", cpu, strerror(err));
+        }
+        return;
+    }
+}
 
-        if (!running) break;
 
-        char timestamp[TS_BUFFER_SIZE];
-        time_t now;
-        time(&now);
-        struct tm *tm_info = localtime(&now);
-        strftime(timestamp, TS_BUFFER_SIZE, "timestamp:%a, %d %b %Y %T %z\n", tm_info);
-        
-        pthread_mutex_lock(&file_mutex);
+// make a socket bound to @param ai, @param reuseport lets several sockets share the port
+static int open_listener(const struct addrinfo *ai, int reuseport) {
+    // make a socket - get the file descriptor
+    int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    // lose the pesky "Address already in use" error message
+    // set SO_REUSEADDR on a socket to true (1) to allow reuse of address and port
+    int optval = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
+        perror("setsockopt");
+        close(fd);
+        return -1;
+    }
+    // the kernel spreads new connections over all sockets bound with SO_REUSEPORT
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1) {
+        perror("setsockopt SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
+
+    // bind the socket to the IP address and the port we passed into getaddrinfo()
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static void close_listeners(void) {
+    for (int i = 0; i < num_listeners; i++) {
+        close(listen_fds[i]);
+    }
+    free(listen_fds);
+    listen_fds = NULL;
+    num_listeners = 0;
+    if (datagram_fd != -1) close(datagram_fd);
+    datagram_fd = -1;
+
+    if (unix_fd == -1) return;
+    close(unix_fd);
+    unix_fd = -1;
+    // the path stays with a process the socket was passed on to, or one that bound it anew
+    struct stat st;
+    if (!handoff_done() && stat(unix_path, &st) == 0 && st.st_dev == unix_stat.st_dev &&
+        st.st_ino == unix_stat.st_ino) {
+        unlink(unix_path);
+    }
+}
+
 
-        int file_fd = open(DATA_FILE, O_WRONLY | O_APPEND | O_CREAT, 0644);
-        if (file_fd == -1) {
-            syslog(LOG_ERR, "Failed to open file to append timestamp: %s", strerror(errno));
-            pthread_mutex_unlock(&file_mutex);
+// bind the stream socket for local clients at unix_path
+static int open_unix_listener(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(unix_path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "Unix socket path too long: %s", unix_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, unix_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    // a socket left behind by an earlier run would make bind() fail
+    unlink(unix_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// @return nonzero if the Unix socket @param fd is bound to unix_path
+static int bound_to_unix_path(int fd) {
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr);
+
+    if (!unix_path || getsockname(fd, (struct sockaddr *)&addr, &len) == -1) return 0;
+    return len > offsetof(struct sockaddr_un, sun_path) &&
+           strncmp(addr.sun_path, unix_path, sizeof(addr.sun_path)) == 0;
+}
+
+
+// bind the UDP socket for datagram ingest to the TCP port
+static int open_datagram_socket(void) {
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo *info;
+
+    int status = getaddrinfo(NULL, PORT, &hints, &info);
+    if (status != 0) {
+        syslog(LOG_ERR, "getaddrinfo error: %s", gai_strerror(status));
+        return -1;
+    }
+    int fd = open_listener(info, 0);
+    freeaddrinfo(info);
+    // room for bursts, and for what arrives while a hot restart hands the store over
+    int rcvbuf = DGRAM_RCVBUF;
+    if (fd != -1 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1) {
+        syslog(LOG_ERR, "Failed to size datagram receive buffer: %s", strerror(errno));
+    }
+    return fd;
+}
+
+
+/**
+ * Sort the @param n sockets taken over from another process into the listening sockets,
+ * the datagram socket and the Unix socket.  The datagram socket is kept only if @param udp
+ * is set, the Unix socket only if it is bound where ours is to be.
+ * @return the number of listening TCP sockets
+ */
+static int adopt_sockets(const int *fds, int n, int udp) {
+    for (int i = 0; i < n; i++) {
+        int type, domain;
+        socklen_t len = sizeof(type);
+        getsockopt(fds[i], SOL_SOCKET, SO_TYPE, &type, &len);
+        len = sizeof(domain);
+        getsockopt(fds[i], SOL_SOCKET, SO_DOMAIN, &domain, &len);
+        if (domain == AF_UNIX) {
+            if (unix_fd == -1 && bound_to_unix_path(fds[i])) {
+                unix_fd = fds[i];
+            } else {
+                close(fds[i]);
+            }
+        } else if (type == SOCK_DGRAM) {
+            if (udp && datagram_fd == -1) {
+                datagram_fd = fds[i];
+            } else {
+                close(fds[i]);
+            }
+        } else {
+            listen_fds[num_listeners++] = fds[i];
+        }
+    }
+    return num_listeners;
+}
+
+
+// accept clients on @param listen_fd until shutdown, each gets a thread or an event loop
+static void accept_clients(int listen_fd, int event_loops) {
+    struct sockaddr_storage client_addr;    // connector's address information
+    struct sockaddr_in *client_in = (struct sockaddr_in *)&client_addr;
+    char addr_str[INET_ADDRSTRLEN];
+
+    while (running) { // main accept() loop
+        socklen_t addr_size = sizeof(client_addr);
+        int client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &addr_size);
+        if (client_fd == -1) {
+            if (!running) break;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // the socket is shared with event loops of another process, which made it nonblocking
+                struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            perror("accept");
             continue;
         }
+        // ready to communicate on socket descriptor client_fd
+        metrics_count(M_CONNECTIONS);
+        AESD_PROBE1(conn_accept, client_fd);
 
-        ssize_t r = write(file_fd, timestamp, strlen(timestamp));
-        if(r < 0) syslog(LOG_ERR, "Failed to append timestamp: %s", strerror(errno));
+        if (client_addr.ss_family == AF_UNIX) {
+            strcpy(addr_str, "local");
+        } else {
+            inet_ntop(AF_INET, &client_in->sin_addr, addr_str, sizeof(addr_str));
+        }
+        log_ring_post(LOG_MSG_ACCEPTED, 0, addr_str);
 
-        close(file_fd);
+        // shed load before the client costs a slot or a thread
+        if (admission_admit(client_fd) == -1) continue;
 
-        pthread_mutex_unlock(&file_mutex);
+        if (event_loops > 0) {
+            event_loop_add_client(client_fd);
+            continue;
+        }
+
+        struct conn_slot *datap = conn_table_get(client_fd);
+        if (!datap) {
+            log_ring_post(LOG_MSG_REJECTED, 0, NULL);
+            metrics_count(M_REJECTED);
+            close(client_fd);
+            admission_leave(0);
+            continue;
+        }
+        admission_set_timeouts(client_fd);
+        fair_queue_flow_init(&datap->flow, client_fd);
+
+        pthread_t thread;
+        datap->joinable = CONN_THREAD_STARTING;
+        if (pthread_create(&thread, NULL, handle_connection, datap) != 0) {
+            syslog(LOG_ERR, "Failed to create thread for handling connection");
+            datap->joinable = 0;
+            conn_table_put(datap);
+            admission_leave(0);
+            continue;
+        }
+        conn_table_started(datap, thread);
     }
+}
 
+
+static void *acceptor_thread(void *arg) {
+    accept_clients(listen_fds[(intptr_t)arg], 0);
     return NULL;
 }
-#endif
+
+
+// local clients are handed to the event loops like TCP clients, @param arg is their number
+static void *unix_acceptor_thread(void *arg) {
+    accept_clients(unix_fd, (intptr_t)arg);
+    return NULL;
+}
+
+
+/**
+ * Start an acceptor thread pinned to its own CPU for every listening socket.
+ * @return the number of threads started
+ */
+static int start_acceptors(pthread_t *threads) {
+    int started;
+    for (started = 0; started < num_listeners; started++) {
+        if (pthread_create(&threads[started], NULL, acceptor_thread, (void *)(intptr_t)started) != 0) {
+            syslog(LOG_ERR, "Failed to create acceptor thread");
+            break;
+        }
+        pin_thread(threads[started], started);
+    }
+    return started;
+}
+
+
+// acceptors blocked in accept() on sockets passed on to another process are woken by a signal
+static void join_acceptors(pthread_t *threads, int started) {
+    for (int i = 0; i < started; i++) {
+        for (;;) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += KNOCK_INTERVAL_NS;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            if (pthread_timedjoin_np(threads[i], NULL, &deadline) != ETIMEDOUT) break;
+            pthread_kill(threads[i], SIGUSR1);
+        }
+    }
+}
+
+
+// let the connections finish on their own while the new process takes the clients
+static void drain_connections(long timeout_ms) {
+    uint64_t deadline = metrics_now() + (uint64_t)timeout_ms * 1000000;
+
+    syslog(LOG_INFO, "Draining %u connections", admission_connections());
+    while (admission_connections() > 0 && !shutdown_requested && metrics_now() < deadline) {
+        knock_pause();
+    }
+    if (admission_connections() > 0) {
+        syslog(LOG_INFO, "Closing %u connections left after draining", admission_connections());
+    }
+}
+
+
+// sleep until SIGINT or SIGTERM clears running, they must be blocked outside of @param wait_mask
+static void wait_for_shutdown(const sigset_t *wait_mask) {
+    while (running) sigsuspend(wait_mask);
+}
 
 
 int main(int argc, char *argv[]) {
     openlog("aesdsocket", LOG_PID | LOG_PERROR, LOG_USER);
+    line_scan_init();
 
     int daemon_mode = 0;
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-d") == 0) {
-            daemon_mode = 1;
+    int event_loops = 0;    // 0 keeps the thread per connection model
+    int io_uring = 0;       // run the event loops on io_uring
+    int acceptors = 0;      // 0 accepts on the main thread, otherwise one SO_REUSEPORT socket each
+    int workers = -1;       // -1 handles packets on the connection's own thread, 0 sizes the pool by CPU count
+    int use_cache = 0;
+    int group_commit = 0;
+    int batch_size = 64;
+    unsigned int conn_slots = CONN_DEFAULT_SLOTS;
+    long ts_interval = TS_DEFAULT_INTERVAL_S;   // 0 adds no timestamps
+    const char *ts_format = TS_DEFAULT_FORMAT;
+    const char *metrics_socket = NULL;
+    struct admission_limits limits = { .max_connections = 0 };
+    int backlog = BACKLOG;
+    struct fair_queue_config fair = { .quantum = FQ_DEFAULT_QUANTUM, .burst_ms = 1000 };
+    const char *handoff_socket = NULL;
+    long drain_timeout_ms = 5000;
+    int udp = 0;
+    int udp_batch = DGRAM_DEFAULT_BATCH;
+    long linger_us = 0;
+    enum commit_durability durability = COMMIT_DURABILITY_NONE;
+    long sync_interval_ms = 100;
+    long sync_interval_bytes = 1024 * 1024;
+    const char *store_name = NULL;
+    size_t subscribe_ring = BCAST_DEFAULT_RING;
+    enum bcast_slow_policy slow_subscriber = BCAST_SLOW_RESYNC;
+    struct store_config store_cfg = { .path = NULL };
+
+    static const struct option long_options[] = {
+        {"daemon",     no_argument,       NULL, 'd'},
+        {"store",      required_argument, NULL, 's'},
+        {"event-loop", required_argument, NULL, 'e'},
+        {"workers",    optional_argument, NULL, 'w'},
+        {"cache",      no_argument,       NULL, 'c'},
+        {"group-commit", no_argument,     NULL, 'g'},
+        {"batch-size", required_argument, NULL, OPT_BATCH_SIZE},
+        {"linger-us",  required_argument, NULL, OPT_LINGER_US},
+        {"durability", required_argument, NULL, OPT_DURABILITY},
+        {"sync-interval-ms", required_argument, NULL, OPT_SYNC_INTERVAL_MS},
+        {"sync-interval-bytes", required_argument, NULL, OPT_SYNC_INTERVAL_BYTES},
+        {"segment-bytes", required_argument, NULL, OPT_SEGMENT_BYTES},
+        {"retain-bytes", required_argument, NULL, OPT_RETAIN_BYTES},
+        {"retain-secs", required_argument, NULL, OPT_RETAIN_SECS},
+        {"subscribe-ring", required_argument, NULL, OPT_SUBSCRIBE_RING},
+        {"slow-subscriber", required_argument, NULL, OPT_SLOW_SUBSCRIBER},
+        {"acceptors", required_argument, NULL, OPT_ACCEPTORS},
+        {"io-uring",   no_argument,       NULL, OPT_IO_URING},
+        {"conn-slots", required_argument, NULL, OPT_CONN_SLOTS},
+        {"ts-interval", required_argument, NULL, OPT_TS_INTERVAL},
+        {"ts-format",  required_argument, NULL, OPT_TS_FORMAT},
+        {"metrics-socket", required_argument, NULL, OPT_METRICS_SOCKET},
+        {"max-connections", required_argument, NULL, OPT_MAX_CONNECTIONS},
+        {"max-inflight", required_argument, NULL, OPT_MAX_INFLIGHT},
+        {"idle-timeout-ms", required_argument, NULL, OPT_IDLE_TIMEOUT_MS},
+        {"slow-timeout-ms", required_argument, NULL, OPT_SLOW_TIMEOUT_MS},
+        {"backlog",    required_argument, NULL, OPT_BACKLOG},
+        {"fair-queue", no_argument,       NULL, OPT_FAIR_QUEUE},
+        {"fair-quantum", required_argument, NULL, OPT_FAIR_QUANTUM},
+        {"client-byte-rate", required_argument, NULL, OPT_CLIENT_BYTE_RATE},
+        {"client-packet-rate", required_argument, NULL, OPT_CLIENT_PACKET_RATE},
+        {"client-burst-ms", required_argument, NULL, OPT_CLIENT_BURST_MS},
+        {"handoff-socket", required_argument, NULL, OPT_HANDOFF_SOCKET},
+        {"drain-timeout-ms", required_argument, NULL, OPT_DRAIN_TIMEOUT_MS},
+        {"udp",        no_argument,       NULL, OPT_UDP},
+        {"udp-batch",  required_argument, NULL, OPT_UDP_BATCH},
+        {"unix-socket", required_argument, NULL, OPT_UNIX_SOCKET},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "ds:e:w::cg", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd':
+                daemon_mode = 1;
+                break;
+            case 's':
+                store_name = optarg;
+                break;
+            case 'e':
+                event_loops = atoi(optarg);
+                if (event_loops < 1) {
+                    fprintf(stderr, "Invalid number of event loops: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'c':
+                use_cache = 1;
+                break;
+            case 'g':
+                group_commit = 1;
+                break;
+            case OPT_BATCH_SIZE:
+                batch_size = atoi(optarg);
+                if (batch_size < 1 || batch_size > COMMIT_MAX_BATCH) {
+                    fprintf(stderr, "Batch size must be between 1 and %d\n", COMMIT_MAX_BATCH);
+                    return -1;
+                }
+                break;
+            case OPT_LINGER_US:
+                linger_us = atol(optarg);
+                if (linger_us < 0) {
+                    fprintf(stderr, "Invalid linger time: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_DURABILITY:
+                if (strcmp(optarg, "none") == 0) {
+                    durability = COMMIT_DURABILITY_NONE;
+                } else if (strcmp(optarg, "interval") == 0) {
+                    durability = COMMIT_DURABILITY_INTERVAL;
+                } else if (strcmp(optarg, "per-batch") == 0) {
+                    durability = COMMIT_DURABILITY_PER_BATCH;
+                } else {
+                    fprintf(stderr, "Durability must be none, interval or per-batch\n");
+                    return -1;
+                }
+                break;
+            case OPT_SYNC_INTERVAL_MS:
+                sync_interval_ms = atol(optarg);
+                if (sync_interval_ms < 1) {
+                    fprintf(stderr, "Invalid sync interval: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_SYNC_INTERVAL_BYTES:
+                sync_interval_bytes = atol(optarg);
+                if (sync_interval_bytes < 1) {
+                    fprintf(stderr, "Invalid sync interval: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_SEGMENT_BYTES:
+                if (atol(optarg) < 1 || atol(optarg) > UINT32_MAX) {
+                    fprintf(stderr, "Segment size must be between 1 and %u\n", UINT32_MAX);
+                    return -1;
+                }
+                store_cfg.segment_bytes = atol(optarg);
+                break;
+            case OPT_RETAIN_BYTES:
+                if (atol(optarg) < 0) {
+                    fprintf(stderr, "Invalid retention size: %s\n", optarg);
+                    return -1;
+                }
+                store_cfg.retain_bytes = atol(optarg);
+                break;
+            case OPT_RETAIN_SECS:
+                store_cfg.retain_secs = atol(optarg);
+                if (store_cfg.retain_secs < 0) {
+                    fprintf(stderr, "Invalid retention time: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_SUBSCRIBE_RING:
+                if (atol(optarg) < 1) {
+                    fprintf(stderr, "Invalid subscribe ring size: %s\n", optarg);
+                    return -1;
+                }
+                subscribe_ring = atol(optarg);
+                break;
+            case OPT_SLOW_SUBSCRIBER:
+                if (strcmp(optarg, "resync") == 0) {
+                    slow_subscriber = BCAST_SLOW_RESYNC;
+                } else if (strcmp(optarg, "drop") == 0) {
+                    slow_subscriber = BCAST_SLOW_DROP;
+                } else {
+                    fprintf(stderr, "Slow subscriber policy must be resync or drop\n");
+                    return -1;
+                }
+                break;
+            case OPT_ACCEPTORS:
+                acceptors = atoi(optarg);
+                if (acceptors < 1) {
+                    fprintf(stderr, "Invalid number of acceptors: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_IO_URING:
+                io_uring = 1;
+                break;
+            case OPT_CONN_SLOTS:
+                if (atol(optarg) < 1 || atol(optarg) > INT32_MAX) {
+                    fprintf(stderr, "Invalid number of connection slots: %s\n", optarg);
+                    return -1;
+                }
+                conn_slots = atol(optarg);
+                break;
+            case OPT_TS_INTERVAL:
+                ts_interval = atol(optarg);
+                if (ts_interval < 0) {
+                    fprintf(stderr, "Invalid timestamp interval: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_TS_FORMAT:
+                if (strlen(optarg) == 0 || strlen(optarg) >= TS_BUFFER_SIZE / 2) {
+                    fprintf(stderr, "Timestamp format must be 1 to %d characters\n", TS_BUFFER_SIZE / 2 - 1);
+                    return -1;
+                }
+                ts_format = optarg;
+                break;
+            case OPT_METRICS_SOCKET:
+                metrics_socket = optarg;
+                break;
+            case OPT_MAX_CONNECTIONS:
+                if (atol(optarg) < 1 || atol(optarg) > INT32_MAX) {
+                    fprintf(stderr, "Invalid connection limit: %s\n", optarg);
+                    return -1;
+                }
+                limits.max_connections = atol(optarg);
+                break;
+            case OPT_MAX_INFLIGHT:
+                if (atol(optarg) < 1) {
+                    fprintf(stderr, "Invalid in-flight limit: %s\n", optarg);
+                    return -1;
+                }
+                limits.max_inflight = atol(optarg);
+                break;
+            case OPT_IDLE_TIMEOUT_MS:
+                limits.idle_timeout_ms = atol(optarg);
+                if (limits.idle_timeout_ms < 0) {
+                    fprintf(stderr, "Invalid idle timeout: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_SLOW_TIMEOUT_MS:
+                limits.slow_timeout_ms = atol(optarg);
+                if (limits.slow_timeout_ms < 0) {
+                    fprintf(stderr, "Invalid slow reader timeout: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_BACKLOG:
+                backlog = atoi(optarg);
+                if (backlog < 1) {
+                    fprintf(stderr, "Invalid listen backlog: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_FAIR_QUEUE:
+                fair.fair = 1;
+                break;
+            case OPT_FAIR_QUANTUM:
+                if (atol(optarg) < 1) {
+                    fprintf(stderr, "Invalid fair queuing quantum: %s\n", optarg);
+                    return -1;
+                }
+                fair.quantum = atol(optarg);
+                fair.fair = 1;
+                break;
+            case OPT_CLIENT_BYTE_RATE:
+                fair.byte_rate = atof(optarg);
+                if (fair.byte_rate <= 0) {
+                    fprintf(stderr, "Invalid client byte rate: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_CLIENT_PACKET_RATE:
+                fair.packet_rate = atof(optarg);
+                if (fair.packet_rate <= 0) {
+                    fprintf(stderr, "Invalid client packet rate: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_CLIENT_BURST_MS:
+                fair.burst_ms = atol(optarg);
+                if (fair.burst_ms < 1) {
+                    fprintf(stderr, "Invalid client burst: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_HANDOFF_SOCKET:
+                handoff_socket = optarg;
+                break;
+            case OPT_DRAIN_TIMEOUT_MS:
+                drain_timeout_ms = atol(optarg);
+                if (drain_timeout_ms < 0) {
+                    fprintf(stderr, "Invalid drain timeout: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_UDP:
+                udp = 1;
+                break;
+            case OPT_UDP_BATCH:
+                udp_batch = atoi(optarg);
+                if (udp_batch < 1 || udp_batch > DGRAM_MAX_BATCH) {
+                    fprintf(stderr, "UDP batch size must be between 1 and %d\n", DGRAM_MAX_BATCH);
+                    return -1;
+                }
+                udp = 1;
+                break;
+            case OPT_UNIX_SOCKET:
+                unix_path = optarg;
+                break;
+            case 'w':
+                workers = optarg ? atoi(optarg) : 0;
+                if (workers < 0) {
+                    fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d] [-s device|file|segments|memory] [-e loops [--io-uring]] [-w[workers]] [-c] [-g [--batch-size n] [--linger-us us]]\n"
+                        "       [--durability none|interval|per-batch [--sync-interval-ms ms] [--sync-interval-bytes n]]\n"
+                        "       [--segment-bytes n [--retain-bytes n] [--retain-secs s]]\n"
+                        "       [--subscribe-ring n] [--slow-subscriber resync|drop] [--acceptors n] [--conn-slots n]\n"
+                        "       [--ts-interval s] [--ts-format strftime-format] [--metrics-socket path]\n"
+                        "       [--max-connections n] [--max-inflight bytes] [--idle-timeout-ms ms] [--slow-timeout-ms ms] [--backlog n]\n"
+                        "       [--fair-queue [--fair-quantum bytes]] [--client-byte-rate n] [--client-packet-rate n] [--client-burst-ms ms]\n"
+                        "       [--handoff-socket path [--drain-timeout-ms ms]] [--udp [--udp-batch n]]\n"
+                        "       [--unix-socket path]\n", argv[0]);
+                return -1;
         }
     }
     
+    // io_uring drives event loops, one per acceptor or a single one
+    if (io_uring && event_loops == 0) event_loops = acceptors > 0 ? acceptors : 1;
+    if (event_loops > 0 && acceptors > 0 && event_loops != acceptors) {
+        // every loop accepts on its own socket
+        fprintf(stderr, "With -e the number of acceptors must match the number of loops\n");
+        return -1;
+    }
+    // every admitted connection needs a slot, more would only be turned away later
+    if (limits.max_connections && event_loops == 0) conn_slots = limits.max_connections;
+    admission_configure(&limits);
+    fair_queue_configure(&fair);
+
+    // segment options alone select the segmented log
+    if (!store_name) store_name = store_cfg.segment_bytes > 0 ? "segments" : DEFAULT_STORE;
+    store = store_backend_find(store_name);
+    if (!store) {
+        fprintf(stderr, "Unknown store: %s\n", store_name);
+        return -1;
+    }
+    if (store == &segment_backend && store_cfg.segment_bytes == 0) {
+        store_cfg.segment_bytes = 64 * 1024 * 1024;
+    }
+    if (durability != COMMIT_DURABILITY_NONE && !store->sync) {
+        fprintf(stderr, "The %s store has nothing to sync, ignoring durability\n", store->name);
+        durability = COMMIT_DURABILITY_NONE;
+    }
+    if (durability != COMMIT_DURABILITY_NONE) {
+        // the commit thread holds completions back until their data is synced
+        group_commit = 1;
+        commit_queue_set_durability(durability, store_datasync, sync_interval_ms, sync_interval_bytes);
+    }
+
     int status;
     struct addrinfo hints;
     struct addrinfo *servinfo;  // will point to the results
-    struct sockaddr_storage client_addr;    // connector's address information
-    socklen_t addr_size = sizeof(client_addr);
-    struct sockaddr_in *client_in = (struct sockaddr_in *)&client_addr;
 
     // prepare socket address structures: load up address structs with getaddrinfo():
     memset(&hints, 0, sizeof(hints));	// make sure the struct is empty
@@ -257,46 +1438,79 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 	// servinfo now points to a linked list of 1 or more struct addrinfos
-    
-    // make a socket - get the file descriptor
-    server_fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
-    if (server_fd == -1) {
-        perror("socket");
-        freeaddrinfo(servinfo);
-        return -1;
-    }
 
-    // lose the pesky "Address already in use" error message
-    // set SO_REUSEADDR on a socket to true (1) to allow reuse of address and port
-    int optval = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
-        perror("setsockopt");
-        close(server_fd);
+    int nlisteners = acceptors > 0 ? acceptors : 1;
+    listen_fds = malloc((handoff_socket ? HANDOFF_MAX_FDS : nlisteners) * sizeof(int));
+    if (!listen_fds) {
+        syslog(LOG_ERR, "Failed to allocate memory for listening sockets");
         freeaddrinfo(servinfo);
         return -1;
     }
-    
-    // bind the socket to the IP address and the port we passed into getaddrinfo()
-    if (bind(server_fd, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
-        perror("bind");
-        close(server_fd);
+    // a server already running passes its sockets on, the port never closes
+    int taken_fds[HANDOFF_MAX_FDS];
+    int taken = handoff_socket ? handoff_take(handoff_socket, taken_fds, HANDOFF_MAX_FDS) : 0;
+    if (taken > 0 && adopt_sockets(taken_fds, taken, udp) == 0) {
+        syslog(LOG_ERR, "No listening socket taken over");
+        taken = -1;
+    }
+    if (taken == -1) {
+        close_listeners();
         freeaddrinfo(servinfo);
         return -1;
     }
+    if (taken > 0) {
+        taken = num_listeners;
+        if (taken != nlisteners) {
+            // the sockets decide, with several every acceptor or loop takes one
+            syslog(LOG_INFO, "Accepting on the %d sockets taken over instead of %d", taken, nlisteners);
+            acceptors = taken > 1 ? taken : 0;
+            if (event_loops > 0 && acceptors > 0) event_loops = acceptors;
+        }
+        nlisteners = taken;
+    }
+    for (; num_listeners < nlisteners; num_listeners++) {
+        int fd = open_listener(servinfo, acceptors > 0);
+        if (fd == -1) {
+            close_listeners();
+            freeaddrinfo(servinfo);
+            return -1;
+        }
+        listen_fds[num_listeners] = fd;
+    }
     
     freeaddrinfo(servinfo);	// all done with this structure, free the linked-list
 
+    if (udp && datagram_fd == -1 && (datagram_fd = open_datagram_socket()) == -1) {
+        close_listeners();
+        return -1;
+    }
+    if (unix_path && unix_fd == -1 && (unix_fd = open_unix_listener()) == -1) {
+        close_listeners();
+        return -1;
+    }
+    if (unix_fd != -1) stat(unix_path, &unix_stat);
+
     if (daemon_mode) {
         if (daemonize() != 0) {
-            close(server_fd);
+            close_listeners();
             return -1;
         }
         syslog(LOG_INFO, "Running in daemon mode");
     }
+
+    // started after fork(), connection events are logged from here on without blocking
+    log_ring_start();
     
-    if (listen(server_fd, BACKLOG) == -1) {
+    for (int i = 0; i < num_listeners; i++) {
+        if (listen(listen_fds[i], backlog) == -1) {
+            perror("listen");
+            close_listeners();
+            return -1;
+        }
+    }
+    if (unix_fd != -1 && listen(unix_fd, backlog) == -1) {
         perror("listen");
-        close(server_fd);
+        close_listeners();
         return -1;
     }
 
@@ -308,80 +1522,153 @@ int main(int argc, char *argv[]) {
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
 
-	printf("Server: waiting for connections...\n");
-
-    LIST_INIT(&head);
+    // no SA_RESTART, SIGUSR1 breaks accept() off after a handoff
+    sa.sa_handler = wake_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+    main_thread = pthread_self();
 
-#if !USE_AESD_CHAR_DEVICE
-    if (pthread_create(&thread_timer, NULL, append_timestamp, NULL) != 0) {
-        syslog(LOG_ERR, "Failed to create thread for timer");
-    }
-#endif
-
-    while (running) { // main accept() loop
-        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &addr_size);
-        if (client_fd == -1) {
-            if (!running) break;
-            perror("accept");
-            continue;
-        }
-        // ready to communicate on socket descriptor client_fd
+    // sendfile and splice have no MSG_NOSIGNAL, a client hanging up must not kill us
+    signal(SIGPIPE, SIG_IGN);
 
-        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(client_in->sin_addr));
+    // the threads started from here on leave SIGINT and SIGTERM to the main thread
+    sigset_t shutdown_signals, old_mask;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, &old_mask);
 
-        struct list_data_s *datap = malloc(sizeof(struct list_data_s));
-        if (!datap) {
-            syslog(LOG_ERR, "Failed to allocate memory for connection data");
-            close(client_fd);
-            continue;
-        }
-        datap->client_fd = client_fd;
-
-        pthread_mutex_lock(&list_mutex);
-        LIST_INSERT_HEAD(&head, datap, entries);
-        pthread_mutex_unlock(&list_mutex);
+	printf("Server: waiting for connections...\n");
 
-        if (pthread_create(&datap->thread_connection, NULL, handle_connection, datap) != 0) {
-            syslog(LOG_ERR, "Failed to create thread for handling connection");
-            close(client_fd);
+    // event loops keep their own connection state
+    if (event_loops == 0 && conn_table_init(conn_slots) != 0) {
+        close_listeners();
+        return -1;
+    }
 
-            pthread_mutex_lock(&list_mutex);
-            LIST_REMOVE(datap, entries);
-            pthread_mutex_unlock(&list_mutex);
+    // the old server has to close a store only one process may have open, or that the
+    // cache is filled from, the clients wait in the listen backlog meanwhile
+    if (store->exclusive || use_cache) handoff_ready(1);
 
-            free(datap);
-            continue;
-        }
+    if (store->open(&store_cfg) != 0) {
+        conn_table_destroy();
+        close_listeners();
+        return -1;
     }
 
-    if (server_fd != -1) close(server_fd);
+    if (use_cache && !store->in_cache) {
+        cache_init(store->max_records, store->show_partial);
+        pthread_mutex_lock(&file_mutex);
+        store->rebuild_cache();
+        pthread_mutex_unlock(&file_mutex);
+    }
 
-#if !USE_AESD_CHAR_DEVICE
-    pthread_cancel(thread_timer);
-    pthread_join(thread_timer, NULL);
-#endif
+    if (bcast_init(subscribe_ring, slow_subscriber) != 0) {
+        store->close(0);
+        conn_table_destroy();
+        close_listeners();
+        return -1;
+    }
 
-    pthread_mutex_lock(&list_mutex);
+    // with group commit the commit thread ticks the timer, the record joins its batches
+    if (store->timestamps && ts_interval > 0 && timestamp_init(ts_interval, ts_format) == 0 && group_commit) {
+        commit_queue_set_timer(timestamp_fd(), timestamp_tick);
+    }
 
-    struct list_data_s *entry;
-    while (!LIST_EMPTY(&head)) {
-        entry = LIST_FIRST(&head);
-        struct list_data_s *next_entry = LIST_NEXT(entry, entries);
-        pthread_cancel(entry->thread_connection);
-        pthread_mutex_unlock(&list_mutex);
-        pthread_join(entry->thread_connection, NULL);
-        pthread_mutex_lock(&list_mutex);
-        LIST_REMOVE(entry, entries);
-        free(entry);
-        entry = next_entry;
+    if (group_commit && commit_queue_start(store_commit_batch, batch_size, linger_us) != 0) {
+        timestamp_stop();
+        bcast_destroy();
+        store->close(0);
+        conn_table_destroy();
+        close_listeners();
+        return -1;
     }
 
-    pthread_mutex_unlock(&list_mutex);
+    if (workers >= 0 && worker_pool_start(workers) != 0) {
+        commit_queue_stop();
+        timestamp_stop();
+        bcast_destroy();
+        store->close(0);
+        conn_table_destroy();
+        close_listeners();
+        return -1;
+    }
 
-#if !USE_AESD_CHAR_DEVICE
-    remove(DATA_FILE);
-#endif
+    if (event_loops > 0 && event_loop_start(event_loops, acceptors > 0 ? listen_fds : NULL, io_uring) != 0) {
+        if (worker_pool_enabled()) worker_pool_stop();
+        commit_queue_stop();
+        timestamp_stop();
+        bcast_destroy();
+        store->close(0);
+        conn_table_destroy();
+        close_listeners();
+        return -1;
+    }
 
+    if (timestamp_fd() != -1 && !commit_queue_enabled()) timestamp_start_thread();
+    // metrics are still counted without the socket, STATS reads them
+    if (metrics_socket) metrics_serve_start(metrics_socket);
+    // the datagram socket is passed on with the listening sockets
+    int handoff_fds[HANDOFF_MAX_FDS];
+    int num_handoff_fds = num_listeners;
+    memcpy(handoff_fds, listen_fds, num_listeners * sizeof(int));
+    if (datagram_fd != -1) {
+        handoff_fds[num_handoff_fds++] = datagram_fd;
+        int started = datagram_start(datagram_fd, udp_batch);
+        datagram_fd = -1;
+        if (started != 0) num_handoff_fds--;
+    }
+    if (unix_fd != -1) handoff_fds[num_handoff_fds++] = unix_fd;
+    handoff_ready(0);
+    if (handoff_socket) handoff_serve_start(handoff_socket, handoff_fds, num_handoff_fds, stop_accepting);
+
+    pthread_t unix_thread;
+    int unix_started = unix_fd != -1 &&
+        pthread_create(&unix_thread, NULL, unix_acceptor_thread, (void *)(intptr_t)event_loops) == 0;
+    if (unix_fd != -1 && !unix_started) syslog(LOG_ERR, "Failed to create Unix socket acceptor thread");
+
+    if (acceptors == 0) {
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        accept_clients(listen_fds[0], event_loops);
+    } else if (event_loops > 0) {
+        // the loops accept on their own sockets
+        wait_for_shutdown(&old_mask);
+    } else {
+        pthread_t threads[acceptors];
+        int started = start_acceptors(threads);
+        if (started == acceptors) {
+            wait_for_shutdown(&old_mask);
+        } else {
+            running = 0;
+            stop_listeners();
+        }
+        join_acceptors(threads, started);
+    }
+    if (unix_started) join_acceptors(&unix_thread, 1);
+    __atomic_store_n(&accept_done, 1, __ATOMIC_RELEASE);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (handoff_done()) drain_connections(drain_timeout_ms);
+    metrics_serve_stop();
+    handoff_serve_stop();
+    datagram_stop();
+
+    // every thread's cleanup handler returns its slot
+    conn_table_cancel_all();
+
+    // queued packets may still hand their connection back to an event loop
+    if (worker_pool_enabled()) worker_pool_stop();
+    commit_queue_stop();
+    timestamp_stop();
+    if (event_loops > 0) event_loop_stop();
+    close_listeners();
+    bcast_destroy();
+    conn_table_destroy();
+
+    if (cache_enabled() && !store->in_cache) cache_destroy();
+    // the data lives on in the process the sockets were passed on to
+    store->close(!handoff_done());
+    handoff_release();
+
+    log_ring_stop();
     closelog();
     return 0;
 }
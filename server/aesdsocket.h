@@ -0,0 +1,122 @@
+/**
+ * @file aesdsocket.h
+ * @brief Definitions shared between the aesdsocket connection handlers
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define BUFFER_SIZE 512
+#define RX_MAX (64 * 1024)  // unframed bytes kept before they are stored as a partial packet
+
+#define SEEKTO_CMD "AESDCHAR_IOCSEEKTO:"
+#define SEEKTO_CMD_LEN (sizeof(SEEKTO_CMD) - 1)
+#define TAIL_CMD "TAIL:"
+#define TAIL_CMD_LEN (sizeof(TAIL_CMD) - 1)
+#define RANGE_CMD "RANGE:"
+#define RANGE_CMD_LEN (sizeof(RANGE_CMD) - 1)
+#define SINCE_CMD "SINCE:"
+#define SINCE_CMD_LEN (sizeof(SINCE_CMD) - 1)
+#define STATS_CMD "STATS\n"
+#define STATS_CMD_LEN (sizeof(STATS_CMD) - 1)
+#define SUBSCRIBE_CMD "SUBSCRIBE\n"
+#define SUBSCRIBE_CMD_LEN (sizeof(SUBSCRIBE_CMD) - 1)
+
+/**
+ * Set to 0 by the signal handler when the server should shut down
+ */
+extern volatile int running;
+
+/**
+ * Serializes writers of the data file
+ */
+extern pthread_mutex_t file_mutex;
+
+/**
+ * Pin @param thread to the @param index th CPU the process may run on, wrapping around
+ * when there are fewer CPUs.
+ */
+void pin_thread(pthread_t thread, int index);
+
+/**
+ * Opens the part of the store following the one identified by @param cursor and advances
+ * @param cursor to it, for stores kept in more than one file.
+ * @return the descriptor, -1 when there is no further part
+ */
+typedef int (*store_next_fn)(uint64_t *cursor);
+
+/**
+ * Append @param len bytes from @param buf to the data file.
+ * @return 0 on success, -1 on error
+ */
+int store_append(const char *buf, size_t len);
+
+/**
+ * Append the @param iovcnt complete records in @param iov to the data file with one write.
+ * @return 0 on success, -1 on error
+ */
+int store_append_records(const struct iovec *iov, int iovcnt);
+
+struct readback;
+
+/**
+ * @return nonzero if @param packet is a command handled by handle_packet() rather than data to store
+ */
+int packet_is_command(const char *packet, size_t len);
+
+/**
+ * @return nonzero if @param packet turns the connection into a subscriber, which from then on
+ *         only receives the records committed after it
+ */
+int packet_is_subscribe(const char *packet, size_t len);
+
+/**
+ * Start sending the whole data store to the client through @param rb.
+ * @return 0 on success, -1 on error
+ */
+int store_readback(struct readback *rb);
+
+/**
+ * @return the number of readable bytes in the data store, -1 on error
+ */
+off_t store_size(void);
+
+/**
+ * Start sending @param len bytes from byte @param start of the data store through @param rb,
+ * @param len -1 for everything up to the end.
+ * @return 0 on success, -1 on error
+ */
+int store_read_range(struct readback *rb, off_t start, off_t len);
+
+/**
+ * Find the byte @param write_cmd_offset bytes into command @param write_cmd of the data store,
+ * counted from the oldest command like the AESDCHAR_IOCSEEKTO ioctl.
+ * @return the byte offset for store_read_range(), -1 if the position does not exist
+ */
+off_t store_locate(unsigned int write_cmd, unsigned int write_cmd_offset);
+
+/**
+ * @return the number of commands in the data store, partial ones included
+ */
+int64_t store_records(void);
+
+/**
+ * Handle one complete newline-terminated packet received from a client.
+ * Regular packets are appended to the data file.  Commands are not stored and instead select
+ * what is read back: AESDCHAR_IOCSEEKTO:X,Y everything from byte Y of command X, TAIL:N the
+ * last N commands, RANGE:A,B commands A through B and SINCE:OFF everything from byte OFF.
+ * STATS answers with the server metrics instead of the store.
+ * @param packet the packet contents, including the trailing newline
+ * @param len the number of bytes in @param packet
+ * @param rb the connection's read-back, started with the response on success
+ * @return 0 if a response was started in @param rb, -1 on error
+ */
+int handle_packet(const char *packet, size_t len, struct readback *rb);
+
+#endif /* AESDSOCKET_H */
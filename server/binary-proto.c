@@ -0,0 +1,136 @@
+/**
+ * @file binary-proto.c
+ * @brief Length-prefixed binary protocol for aesdsocket clients
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "aesdsocket.h"
+#include "binary-proto.h"
+#include "readback.h"
+#include "log-ring.h"
+
+#define VARINT_MAX 10   // bytes in the longest 64 bit LEB128 value
+
+
+// @return the bytes used by the varint at @param p, 0 if it is incomplete, -1 if it is too long
+static int varint_decode(const unsigned char *p, size_t len, uint64_t *value) {
+    uint64_t v = 0;
+
+    for (size_t i = 0; i < len && i < VARINT_MAX; i++) {
+        v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *value = v;
+            return i + 1;
+        }
+    }
+    return len >= VARINT_MAX ? -1 : 0;
+}
+
+
+static size_t varint_encode(unsigned char *p, uint64_t value) {
+    size_t n = 0;
+
+    while (value >= 0x80) {
+        p[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+
+ssize_t bin_frame_parse(const char *buf, size_t len, struct bin_frame *frame) {
+    const unsigned char *p = (const unsigned char *)buf;
+    uint64_t payload_len;
+
+    if (len > 0 && p[0] != BIN_MAGIC) return -1;
+    if (len < 2) return 0;
+
+    int n = varint_decode(p + 2, len - 2, &payload_len);
+    if (n < 0 || (n > 0 && payload_len > BIN_MAX_PAYLOAD)) return -1;
+    if (n == 0 || len - 2 - n < payload_len) return 0;
+
+    frame->opcode = p[1];
+    frame->payload = buf + 2 + n;
+    frame->len = payload_len;
+    return 2 + n + payload_len;
+}
+
+
+// parse a payload made of exactly two varints
+static int parse_pair(const struct bin_frame *frame, uint64_t *a, uint64_t *b) {
+    const unsigned char *p = (const unsigned char *)frame->payload;
+    int n = varint_decode(p, frame->len, a);
+    if (n <= 0) return -1;
+    int m = varint_decode(p + n, frame->len - n, b);
+    if (m <= 0 || (size_t)(n + m) != frame->len) return -1;
+    return 0;
+}
+
+
+static void reply(struct readback *rb, uint8_t opcode, uint64_t len) {
+    unsigned char hdr[2 + VARINT_MAX];
+
+    hdr[0] = BIN_MAGIC;
+    hdr[1] = opcode;
+    readback_prefix(rb, hdr, 2 + varint_encode(hdr + 2, len));
+}
+
+
+static int reply_error(struct readback *rb) {
+    reply(rb, BIN_OP_ERROR, 0);
+    return -1;
+}
+
+
+// reply with @param len bytes of the store from @param start, cut at its current end
+static int reply_range(struct readback *rb, uint8_t opcode, uint64_t start, uint64_t len) {
+    off_t size = store_size();
+
+    if (size < 0 || start > (uint64_t)size) return reply_error(rb);
+    if (len > (uint64_t)size - start) len = size - start;
+    if (len > 0 && store_read_range(rb, start, len) != 0) return reply_error(rb);
+    reply(rb, opcode | BIN_REPLY, len);
+    return 0;
+}
+
+
+void bin_reply_append(struct readback *rb, int status) {
+    if (status != 0) {
+        reply_error(rb);
+        return;
+    }
+    reply(rb, BIN_OP_APPEND | BIN_REPLY, 0);
+}
+
+
+int bin_handle(const struct bin_frame *frame, struct readback *rb) {
+    uint64_t a, b;
+
+    switch (frame->opcode) {
+        case BIN_OP_APPEND: {
+            int status = store_append(frame->payload, frame->len);
+            bin_reply_append(rb, status);
+            return status;
+        }
+        case BIN_OP_READ_ALL:
+            return reply_range(rb, frame->opcode, 0, UINT64_MAX);
+        case BIN_OP_READ_RANGE:
+            if (parse_pair(frame, &a, &b) != 0) return reply_error(rb);
+            return reply_range(rb, frame->opcode, a, b);
+        case BIN_OP_SEEK: {
+            if (parse_pair(frame, &a, &b) != 0 || a > UINT_MAX || b > UINT_MAX) return reply_error(rb);
+            off_t pos = store_locate(a, b);
+            if (pos < 0) return reply_error(rb);
+            return reply_range(rb, frame->opcode, pos, UINT64_MAX);
+        }
+        default: {
+            char opcode[LOG_RING_STR_MAX];
+            snprintf(opcode, sizeof(opcode), "%u", frame->opcode);
+            log_ring_post(LOG_MSG_BAD_OPCODE, 0, opcode);
+            return reply_error(rb);
+        }
+    }
+}
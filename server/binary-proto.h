@@ -0,0 +1,77 @@
+/**
+ * @file binary-proto.h
+ * @brief Length-prefixed binary protocol for aesdsocket clients
+ *
+ * A connection whose first byte is BIN_MAGIC speaks the binary protocol for its whole
+ * lifetime, the newline text protocol never starts with that byte.  Requests and replies
+ * are frames of
+ *
+ *     magic (1 byte) | opcode (1 byte) | payload length (LEB128 varint) | payload
+ *
+ * so the server never scans the payload.  A reply carries the request opcode with
+ * BIN_REPLY set, or BIN_OP_ERROR with an empty payload.  Requests are answered in order,
+ * clients may pipeline as many as they like.  If the store loses data while a reply that
+ * already announced its length is being sent, the connection is closed.
+ */
+
+#ifndef AESDSOCKET_BINARY_PROTO_H
+#define AESDSOCKET_BINARY_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BIN_MAGIC 0xAE
+#define BIN_REPLY 0x80
+#define BIN_MAX_PAYLOAD (16 * 1024 * 1024)
+#define BIN_MAX_FRAME (BIN_MAX_PAYLOAD + 12)    // magic, opcode and the longest varint
+
+enum bin_opcode {
+    /**
+     * Payload: the bytes to store.  Reply: empty, once the bytes are committed.
+     */
+    BIN_OP_APPEND = 1,
+    /**
+     * Payload: empty.  Reply: the whole store.
+     */
+    BIN_OP_READ_ALL = 2,
+    /**
+     * Payload: varint start, varint length.  Reply: those bytes of the store, cut at its end.
+     */
+    BIN_OP_READ_RANGE = 3,
+    /**
+     * Payload: varint write_cmd, varint write_cmd_offset.  Reply: the store from that
+     * position on, like the AESDCHAR_IOCSEEKTO command.
+     */
+    BIN_OP_SEEK = 4,
+    BIN_OP_ERROR = 0x7f,
+};
+
+struct bin_frame {
+    uint8_t opcode;
+    const char *payload;
+    size_t len;
+};
+
+struct readback;
+
+/**
+ * Parse the frame at the start of @param buf.
+ * @param frame set to the frame found, its payload points into @param buf
+ * @return the length of the frame, 0 if it is not complete yet, -1 if it is malformed
+ */
+ssize_t bin_frame_parse(const char *buf, size_t len, struct bin_frame *frame);
+
+/**
+ * Execute the request in @param frame and start its reply on @param rb.
+ * @return 0 on success, -1 if an error reply was started instead
+ */
+int bin_handle(const struct bin_frame *frame, struct readback *rb);
+
+/**
+ * Start the reply to an append committed outside bin_handle().
+ * @param status the commit status
+ */
+void bin_reply_append(struct readback *rb, int status);
+
+#endif /* AESDSOCKET_BINARY_PROTO_H */
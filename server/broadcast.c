@@ -0,0 +1,218 @@
+/**
+ * @file broadcast.c
+ * @brief Ring that fans newly committed records out to subscribed clients
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "broadcast.h"
+#include "line-stream.h"
+#include "metrics.h"
+#include "log-ring.h"
+
+#define BCAST_INDEX 4096    // record starts remembered for resyncing slow subscribers
+
+static char *ring;
+static size_t ring_size;
+static enum bcast_slow_policy slow_policy;
+
+/**
+ * Bytes ever published, ring[pos % ring_size] holds byte pos for head - ring_size <= pos < head
+ */
+static uint64_t head;
+
+/**
+ * Positions following a newline, starts[i % BCAST_INDEX] for nstarts - BCAST_INDEX <= i < nstarts
+ */
+static uint64_t starts[BCAST_INDEX];
+static uint64_t nstarts;
+
+static int subscribers;
+static struct bcast_waker *wakers;
+
+// writers are favoured so subscribers sending all the time cannot hold up the store writer
+static pthread_rwlock_t ring_lock;
+
+
+int bcast_init(size_t ring_bytes, enum bcast_slow_policy policy) {
+    pthread_rwlockattr_t attr;
+
+    ring = malloc(ring_bytes);
+    if (!ring) {
+        syslog(LOG_ERR, "Failed to allocate memory for the broadcast ring");
+        return -1;
+    }
+    ring_size = ring_bytes;
+    slow_policy = policy;
+    head = 0;
+    nstarts = 0;
+
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&ring_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return 0;
+}
+
+
+void bcast_destroy(void) {
+    if (!ring) return;
+    pthread_rwlock_destroy(&ring_lock);
+    free(ring);
+    ring = NULL;
+}
+
+
+// copy @param len bytes to the head of the ring and remember where records start in them
+static void ring_write(const char *buf, size_t len) {
+    if (len > ring_size) {
+        // only the end survives, the rest would be overwritten right away
+        head += len - ring_size;
+        buf += len - ring_size;
+        len = ring_size;
+    }
+
+    uint32_t ends[LINE_STREAM_BATCH];
+    size_t scanned = 0;
+    size_t n;
+    while ((n = line_scan(buf + scanned, len - scanned, ends, LINE_STREAM_BATCH)) > 0) {
+        for (size_t i = 0; i < n; i++) starts[nstarts++ % BCAST_INDEX] = head + scanned + ends[i];
+        scanned += ends[n - 1];
+        if (n < LINE_STREAM_BATCH) break;
+    }
+
+    size_t off = head % ring_size;
+    size_t first = len < ring_size - off ? len : ring_size - off;
+    memcpy(ring + off, buf, first);
+    memcpy(ring, buf + first, len - first);
+    head += len;
+}
+
+
+void bcast_publish(const struct iovec *iov, int iovcnt) {
+    if (!ring || !__atomic_load_n(&subscribers, __ATOMIC_RELAXED)) return;
+
+    pthread_rwlock_wrlock(&ring_lock);
+    for (int i = 0; i < iovcnt; i++) {
+        ring_write(iov[i].iov_base, iov[i].iov_len);
+    }
+    for (struct bcast_waker *w = wakers; w; w = w->next) {
+        uint64_t one = 1;
+        if (write(w->fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            log_ring_post(LOG_MSG_WAKE_FAILED, errno, NULL);
+        }
+    }
+    pthread_rwlock_unlock(&ring_lock);
+}
+
+
+uint64_t bcast_subscribe(void) {
+    pthread_rwlock_wrlock(&ring_lock);
+    subscribers++;
+    uint64_t pos = head;
+    pthread_rwlock_unlock(&ring_lock);
+    return pos;
+}
+
+
+void bcast_unsubscribe(void) {
+    pthread_rwlock_wrlock(&ring_lock);
+    subscribers--;
+    pthread_rwlock_unlock(&ring_lock);
+}
+
+
+// @return the earliest record start at or after @param tail, the head if no record is whole
+static uint64_t earliest_record(uint64_t tail) {
+    uint64_t first = nstarts > BCAST_INDEX ? nstarts - BCAST_INDEX : 0;
+
+    for (uint64_t i = first; i < nstarts; i++) {
+        if (starts[i % BCAST_INDEX] >= tail) return starts[i % BCAST_INDEX];
+    }
+    return head;
+}
+
+
+int bcast_send(uint64_t *pos, int fd) {
+    int ret;
+
+    // a cancelled connection thread must not leave the ring locked
+    int cancel_state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    pthread_rwlock_rdlock(&ring_lock);
+
+    for (;;) {
+        uint64_t tail = head > ring_size ? head - ring_size : 0;
+        if (*pos < tail) {
+            if (slow_policy == BCAST_SLOW_DROP) {
+                char behind[LOG_RING_STR_MAX];
+                snprintf(behind, sizeof(behind), "%llu", (unsigned long long)(head - *pos));
+                log_ring_post(LOG_MSG_SUBSCRIBER_DROPPED, 0, behind);
+                ret = -1;
+                break;
+            }
+            uint64_t resync = earliest_record(tail);
+            char skipped[LOG_RING_STR_MAX];
+            snprintf(skipped, sizeof(skipped), "%llu", (unsigned long long)(resync - *pos));
+            log_ring_post(LOG_MSG_SUBSCRIBER_RESYNC, 0, skipped);
+            *pos = resync;
+        }
+        if (*pos == head) {
+            ret = 1;
+            break;
+        }
+
+        size_t off = *pos % ring_size;
+        size_t len = head - *pos;
+        size_t first = len < ring_size - off ? len : ring_size - off;
+        struct iovec iov[2] = {
+            { .iov_base = ring + off, .iov_len = first },
+            { .iov_base = ring, .iov_len = len - first },
+        };
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = len > first ? 2 : 1 };
+        ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ret = 0;
+            } else {
+                log_ring_post(LOG_MSG_SUBSCRIBER_SEND_FAILED, errno, NULL);
+                ret = -1;
+            }
+            break;
+        }
+        *pos += n;
+        metrics_add(M_BYTES_OUT, n);
+    }
+
+    pthread_rwlock_unlock(&ring_lock);
+    pthread_setcancelstate(cancel_state, NULL);
+    return ret;
+}
+
+
+void bcast_add_waker(struct bcast_waker *waker) {
+    pthread_rwlock_wrlock(&ring_lock);
+    waker->next = wakers;
+    wakers = waker;
+    pthread_rwlock_unlock(&ring_lock);
+}
+
+
+void bcast_remove_waker(struct bcast_waker *waker) {
+    pthread_rwlock_wrlock(&ring_lock);
+    for (struct bcast_waker **w = &wakers; *w; w = &(*w)->next) {
+        if (*w == waker) {
+            *w = waker->next;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&ring_lock);
+}
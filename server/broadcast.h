@@ -0,0 +1,80 @@
+/**
+ * @file broadcast.h
+ * @brief Ring that fans newly committed records out to subscribed clients
+ *
+ * The store writer copies every committed record into one shared ring and subscribers
+ * send straight from it, so a record is copied once however many clients follow the
+ * store.  A subscriber only keeps its position in the ring.  One that falls more than
+ * the ring size behind has lost data and is either dropped or resynced to the earliest
+ * record still whole in the ring.
+ *
+ * Waiting subscribers are woken through an eventfd they register as a waker, so a
+ * connection thread or an event loop can wait for new records and its socket at once.
+ */
+
+#ifndef AESDSOCKET_BROADCAST_H
+#define AESDSOCKET_BROADCAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define BCAST_DEFAULT_RING (1024 * 1024)
+
+enum bcast_slow_policy {
+    /**
+     * Skip a subscriber that fell behind ahead to the earliest record still in the ring
+     */
+    BCAST_SLOW_RESYNC,
+    /**
+     * Disconnect a subscriber that fell behind
+     */
+    BCAST_SLOW_DROP,
+};
+
+struct bcast_waker {
+    /**
+     * eventfd written to whenever records are published
+     */
+    int fd;
+    struct bcast_waker *next;
+};
+
+/**
+ * Allocate a ring of @param ring_bytes.
+ * @return 0 on success, -1 on error
+ */
+int bcast_init(size_t ring_bytes, enum bcast_slow_policy policy);
+
+void bcast_destroy(void);
+
+/**
+ * Copy committed bytes into the ring, in store order.  Must be called with the store's
+ * writer lock held.  Does nothing while there are no subscribers.
+ */
+void bcast_publish(const struct iovec *iov, int iovcnt);
+
+/**
+ * Register a subscriber.
+ * @return its position, the next byte to be published
+ */
+uint64_t bcast_subscribe(void);
+
+void bcast_unsubscribe(void);
+
+/**
+ * Send whatever was published since @param pos to @param fd without blocking and
+ * advance @param pos past it.
+ * @return 1 once the subscriber caught up, 0 if the socket is full, -1 if the subscriber
+ *         is to be dropped
+ */
+int bcast_send(uint64_t *pos, int fd);
+
+/**
+ * Have @param waker->fd written to on every publish until bcast_remove_waker().
+ */
+void bcast_add_waker(struct bcast_waker *waker);
+
+void bcast_remove_waker(struct bcast_waker *waker);
+
+#endif /* AESDSOCKET_BROADCAST_H */
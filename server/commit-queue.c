@@ -0,0 +1,343 @@
+/**
+ * @file commit-queue.c
+ * @brief Single writer commit thread with group commit for the aesdsocket data store
+ *
+ * The queue is a Treiber stack: producers push with a compare-and-swap and the commit
+ * thread detaches the whole stack with one exchange, then reverses it into submission
+ * order.  A producer that pushes onto an empty stack wakes the commit thread through
+ * an eventfd, every other producer knows the commit thread still has work to pick up.
+ *
+ * With the interval durability policy, committed requests wait on an unsynced list
+ * until the oldest of them waited for the sync interval or enough bytes piled up.
+ *
+ * A timer descriptor handed to the queue is polled together with the eventfd while the
+ * thread waits, and checked about once a second while it is kept busy.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include "commit-queue.h"
+
+static struct commit_req *queue_head;
+static int wake_fd = -1;
+static int stopping;
+static pthread_t commit_thread;
+static commit_fn commit;
+static int max_batch;
+static long linger_us;
+
+static int timer_fd = -1;
+static void (*timer_tick)(void);
+static struct timespec timer_checked;
+
+static enum commit_durability durability;
+static sync_fn sync_store;
+static long sync_interval_ms;
+static size_t sync_interval_bytes;
+
+// committed requests waiting for the next sync, oldest first
+static struct commit_req *unsynced_head;
+static struct commit_req *unsynced_tail;
+static size_t unsynced_bytes;
+static struct timespec unsynced_since;
+
+struct sync_req {
+    struct commit_req req;
+    sem_t done;
+};
+
+
+static void wake(void) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1) {
+        syslog(LOG_ERR, "Failed to wake commit thread: %s", strerror(errno));
+    }
+}
+
+
+// detach everything queued, oldest first; *tail is set to the newest request
+static struct commit_req *take_all(struct commit_req **tail) {
+    struct commit_req *stack = __atomic_exchange_n(&queue_head, NULL, __ATOMIC_ACQUIRE);
+    struct commit_req *fifo = NULL;
+
+    *tail = stack;
+    while (stack) {
+        struct commit_req *next = stack->next;
+        stack->next = fifo;
+        fifo = stack;
+        stack = next;
+    }
+    return fifo;
+}
+
+
+// wait for producers for at most timeout_us, or forever if it is negative
+static void wait_for_work(long timeout_us) {
+    struct pollfd pfds[2] = {
+        { .fd = wake_fd, .events = POLLIN },
+        { .fd = timer_fd, .events = POLLIN },   // ignored while -1
+    };
+    struct timespec ts = { .tv_sec = timeout_us / 1000000, .tv_nsec = (timeout_us % 1000000) * 1000 };
+
+    if (ppoll(pfds, 2, timeout_us < 0 ? NULL : &ts, NULL) > 0) {
+        if (pfds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                syslog(LOG_ERR, "Failed to read commit wakeup: %s", strerror(errno));
+            }
+        }
+        if (pfds[1].revents & POLLIN) timer_tick();
+    }
+}
+
+
+// a thread that never waits does not see the timer in wait_for_work(), look about once a second
+static void check_timer(void) {
+    struct timespec now;
+
+    if (timer_fd == -1) return;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (now.tv_sec == timer_checked.tv_sec) return;
+    timer_checked = now;
+    timer_tick();
+}
+
+
+static int count_reqs(struct commit_req *req) {
+    int count = 0;
+    for (; req; req = req->next) count++;
+    return count;
+}
+
+
+static long elapsed_us(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+
+// give producers up to linger_us to grow a batch that is not full yet
+static void linger(struct commit_req *batch, struct commit_req *tail) {
+    struct timespec start;
+    int count = count_reqs(batch);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (count < max_batch && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        long elapsed = elapsed_us(&start);
+        if (elapsed >= linger_us) break;
+
+        wait_for_work(linger_us - elapsed);
+
+        struct commit_req *more_tail;
+        struct commit_req *more = take_all(&more_tail);
+        if (!more) continue;
+        tail->next = more;
+        tail = more_tail;
+        count += count_reqs(more);
+    }
+}
+
+
+static void complete(struct commit_req *req, int sync_status) {
+    while (req) {
+        struct commit_req *next = req->next;
+        if (sync_status == -1) req->status = -1;
+        req->done(req);     // may reuse or free the request
+        req = next;
+    }
+}
+
+
+static int store_sync(void) {
+    if (sync_store() == -1) {
+        syslog(LOG_ERR, "Failed to sync store, failing the affected packets");
+        return -1;
+    }
+    return 0;
+}
+
+
+static void flush_unsynced(void) {
+    if (!unsynced_head) return;
+
+    struct commit_req *list = unsynced_head;
+    unsynced_head = unsynced_tail = NULL;
+    unsynced_bytes = 0;
+    complete(list, store_sync());
+}
+
+
+// microseconds until the unsynced requests are due, -1 if there are none
+static long unsynced_due_in(void) {
+    if (!unsynced_head) return -1;
+    if (unsynced_bytes >= sync_interval_bytes) return 0;
+    long left = sync_interval_ms * 1000 - elapsed_us(&unsynced_since);
+    return left > 0 ? left : 0;
+}
+
+
+static void commit_batches(struct commit_req *batch) {
+    while (batch) {
+        struct commit_req *last = batch;
+        int count = 1;
+        while (count < max_batch && last->next) {
+            last = last->next;
+            count++;
+        }
+        struct commit_req *rest = last->next;
+        last->next = NULL;
+
+        int status = commit(batch, count);
+        size_t bytes = 0;
+        for (struct commit_req *req = batch; req; req = req->next) {
+            req->status = status;
+            bytes += req->len;
+        }
+
+        switch (durability) {
+            case COMMIT_DURABILITY_PER_BATCH:
+                complete(batch, status == 0 ? store_sync() : 0);
+                break;
+            case COMMIT_DURABILITY_INTERVAL:
+                if (unsynced_head) {
+                    unsynced_tail->next = batch;
+                } else {
+                    unsynced_head = batch;
+                    clock_gettime(CLOCK_MONOTONIC, &unsynced_since);
+                }
+                unsynced_tail = last;
+                unsynced_bytes += bytes;
+                if (unsynced_due_in() == 0) flush_unsynced();
+                break;
+            default:
+                complete(batch, 0);
+                break;
+        }
+        batch = rest;
+    }
+}
+
+
+static void *commit_thread_fn(void *arg) {
+    for (;;) {
+        struct commit_req *tail;
+        struct commit_req *batch = take_all(&tail);
+
+        if (!batch) {
+            if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) break;
+            wait_for_work(unsynced_due_in());
+            if (unsynced_due_in() == 0) flush_unsynced();
+            continue;
+        }
+
+        if (linger_us > 0) linger(batch, tail);
+
+        commit_batches(batch);
+        check_timer();
+    }
+
+    flush_unsynced();
+    return NULL;
+}
+
+
+void commit_queue_set_durability(enum commit_durability mode, sync_fn sync,
+                                 long interval_ms, size_t interval_bytes) {
+    durability = mode;
+    sync_store = sync;
+    sync_interval_ms = interval_ms;
+    sync_interval_bytes = interval_bytes;
+}
+
+
+void commit_queue_set_timer(int fd, void (*tick)(void)) {
+    timer_fd = fd;
+    timer_tick = tick;
+}
+
+
+int commit_queue_start(commit_fn fn, int batch, long linger) {
+    commit = fn;
+    max_batch = batch < 1 ? 1 : batch > COMMIT_MAX_BATCH ? COMMIT_MAX_BATCH : batch;
+    linger_us = linger;
+
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd == -1) {
+        syslog(LOG_ERR, "Failed to create commit eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    // the commit thread never handles SIGINT/SIGTERM, the accept loop in main has to see them
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int rc = pthread_create(&commit_thread, NULL, commit_thread_fn, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0) {
+        syslog(LOG_ERR, "Failed to create commit thread");
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+    syslog(LOG_INFO, "Group commit enabled, batch %d, linger %ld us", max_batch, linger_us);
+    return 0;
+}
+
+
+int commit_queue_enabled(void) {
+    return wake_fd != -1;
+}
+
+
+void commit_queue_submit(struct commit_req *req) {
+    struct commit_req *old = __atomic_load_n(&queue_head, __ATOMIC_RELAXED);
+    do {
+        req->next = old;
+    } while (!__atomic_compare_exchange_n(&queue_head, &old, req, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (old == NULL) wake();
+}
+
+
+static void sync_done(struct commit_req *req) {
+    sem_post(&((struct sync_req *)req)->done);
+}
+
+
+int commit_queue_commit(const char *buf, size_t len) {
+    struct sync_req sreq = { .req = { .buf = buf, .len = len, .done = sync_done } };
+
+    sem_init(&sreq.done, 0, 0);
+    commit_queue_submit(&sreq.req);
+    while (sem_wait(&sreq.done) == -1 && errno == EINTR);
+    sem_destroy(&sreq.done);
+    return sreq.req.status;
+}
+
+
+void commit_queue_stop(void) {
+    if (wake_fd == -1) return;
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    wake();
+    pthread_join(commit_thread, NULL);
+
+    close(wake_fd);
+    wake_fd = -1;
+    stopping = 0;
+    timer_fd = -1;
+}
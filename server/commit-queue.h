@@ -0,0 +1,115 @@
+/**
+ * @file commit-queue.h
+ * @brief Single writer commit thread with group commit for the aesdsocket data store
+ *
+ * Producers push completed packets onto a lock-free multi-producer, single-consumer
+ * queue.  One commit thread takes everything pending, optionally lingers a little to
+ * let the batch grow, and hands the batch to the store which writes it with a single
+ * writev().  Every request is completed with a callback once its batch is committed,
+ * and with a durability policy set, once the store was synced after that.
+ */
+
+#ifndef AESDSOCKET_COMMIT_QUEUE_H
+#define AESDSOCKET_COMMIT_QUEUE_H
+
+#include <stddef.h>
+
+/**
+ * Largest number of packets written with one writev()
+ */
+#define COMMIT_MAX_BATCH 1024
+
+struct commit_req {
+    /**
+     * Queue link, owned by the commit queue while the request is pending
+     */
+    struct commit_req *next;
+    const char *buf;
+    size_t len;
+    /**
+     * 0 if the packet was committed, -1 on error.  Set before @param done is called.
+     */
+    int status;
+    /**
+     * Called on the commit thread once the request completed.  The request is no longer
+     * referenced by the queue afterwards.
+     */
+    void (*done)(struct commit_req *req);
+};
+
+/**
+ * Writes a batch of requests to the store.
+ * @param batch the requests, linked through next in submission order
+ * @param count the number of requests in @param batch, at most COMMIT_MAX_BATCH
+ * @return 0 on success, -1 on error
+ */
+typedef int (*commit_fn)(struct commit_req *batch, int count);
+
+enum commit_durability {
+    /**
+     * Complete requests as soon as their batch is written
+     */
+    COMMIT_DURABILITY_NONE,
+    /**
+     * Sync once the oldest unsynced request waited for the sync interval or enough bytes are unsynced
+     */
+    COMMIT_DURABILITY_INTERVAL,
+    /**
+     * Sync after every batch
+     */
+    COMMIT_DURABILITY_PER_BATCH,
+};
+
+/**
+ * Makes everything committed so far durable.
+ * @return 0 on success, -1 on error
+ */
+typedef int (*sync_fn)(void);
+
+/**
+ * Select when committed requests are synced before they complete.  Call before commit_queue_start().
+ * @param sync the function making the store durable
+ * @param interval_ms for COMMIT_DURABILITY_INTERVAL, the longest a request waits for its sync
+ * @param interval_bytes for COMMIT_DURABILITY_INTERVAL, the unsynced bytes that trigger a sync right away
+ */
+void commit_queue_set_durability(enum commit_durability mode, sync_fn sync,
+                                 long interval_ms, size_t interval_bytes);
+
+/**
+ * Have the commit thread call @param tick whenever @param fd becomes readable, even while it
+ * keeps committing.  @param tick runs on the commit thread and may submit requests itself.
+ * Call before commit_queue_start().
+ */
+void commit_queue_set_timer(int fd, void (*tick)(void));
+
+/**
+ * Start the commit thread.
+ * @param commit the function writing each batch
+ * @param max_batch the largest number of requests committed together
+ * @param linger_us how long to wait for more requests when a batch is not full, 0 to commit right away
+ * @return 0 on success, -1 on error
+ */
+int commit_queue_start(commit_fn commit, int max_batch, long linger_us);
+
+/**
+ * @return nonzero if the commit thread is running
+ */
+int commit_queue_enabled(void);
+
+/**
+ * Queue @param req for the commit thread.  Never blocks.
+ */
+void commit_queue_submit(struct commit_req *req);
+
+/**
+ * Commit @param len bytes from @param buf and wait until the commit completed.
+ * @return the commit status
+ */
+int commit_queue_commit(const char *buf, size_t len);
+
+/**
+ * Commit everything still queued and stop the commit thread.
+ */
+void commit_queue_stop(void);
+
+#endif /* AESDSOCKET_COMMIT_QUEUE_H */
@@ -0,0 +1,130 @@
+/**
+ * @file conn-table.c
+ * @brief Preallocated table of connection slots for the thread per connection model
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sched.h>
+#include "conn-table.h"
+
+static struct conn_slot *slots;
+static unsigned int num_slots;
+
+/**
+ * Top of the free stack: the index of the first free slot plus one in the low half and
+ * a counter bumped by every pop in the high half, so a slot taken and returned between
+ * reading the top and swapping it cannot be mistaken for an unchanged stack.
+ */
+static uint64_t free_top;
+
+
+static void free_push(struct conn_slot *slot) {
+    uint32_t index = slot - slots + 1;
+    uint64_t old = __atomic_load_n(&free_top, __ATOMIC_RELAXED);
+    uint64_t new;
+
+    do {
+        __atomic_store_n(&slot->next_free, (uint32_t)old, __ATOMIC_RELAXED);
+        new = (old & ~(uint64_t)UINT32_MAX) | index;
+    } while (!__atomic_compare_exchange_n(&free_top, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+static struct conn_slot *free_pop(void) {
+    uint64_t old = __atomic_load_n(&free_top, __ATOMIC_ACQUIRE);
+    uint64_t new;
+    struct conn_slot *slot;
+
+    do {
+        uint32_t index = (uint32_t)old;
+        if (index == 0) return NULL;
+        slot = &slots[index - 1];
+        uint32_t next = __atomic_load_n(&slot->next_free, __ATOMIC_RELAXED);
+        new = ((old >> 32) + 1) << 32 | next;
+    } while (!__atomic_compare_exchange_n(&free_top, &old, new, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return slot;
+}
+
+
+int conn_table_init(unsigned int nslots) {
+    if (posix_memalign((void **)&slots, CONN_SLOT_ALIGN, nslots * sizeof(struct conn_slot)) != 0) {
+        syslog(LOG_ERR, "Failed to allocate memory for %u connection slots", nslots);
+        slots = NULL;
+        return -1;
+    }
+    memset(slots, 0, nslots * sizeof(struct conn_slot));
+    num_slots = nslots;
+
+    // chain the slots in order, the first one ends up on top
+    free_top = 0;
+    for (unsigned int i = nslots; i > 0; i--) {
+        slots[i - 1].client_fd = -1;
+        readback_init(&slots[i - 1].rb);
+        line_stream_init(&slots[i - 1].rx);
+        free_push(&slots[i - 1]);
+    }
+    return 0;
+}
+
+
+struct conn_slot *conn_table_get(int client_fd) {
+    struct conn_slot *slot = free_pop();
+    if (!slot) return NULL;
+
+    // the last thread on this slot freed it on its way out, it is gone or about to be,
+    // possibly before its acceptor got to publish its id
+    if (slot->joinable) {
+        while (__atomic_load_n(&slot->joinable, __ATOMIC_ACQUIRE) != CONN_THREAD_STARTED) {
+            sched_yield();
+        }
+        pthread_join(slot->thread_connection, NULL);
+        slot->joinable = 0;
+    }
+    slot->client_fd = client_fd;
+    slot->charged = 0;
+    slot->negotiated = 0;
+    return slot;
+}
+
+
+void conn_table_put(struct conn_slot *slot) {
+    if (slot->client_fd != -1) close(slot->client_fd);
+    slot->client_fd = -1;
+    readback_release(&slot->rb);
+    line_stream_reset(&slot->rx, CONN_RX_KEEP);
+    free_push(slot);
+}
+
+
+void conn_table_started(struct conn_slot *slot, pthread_t thread) {
+    slot->thread_connection = thread;
+    __atomic_store_n(&slot->joinable, CONN_THREAD_STARTED, __ATOMIC_RELEASE);
+}
+
+
+void conn_table_cancel_all(void) {
+    // a thread that already returned its slot is still joinable, cancelling it does nothing
+    for (unsigned int i = 0; i < num_slots; i++) {
+        if (slots[i].joinable) pthread_cancel(slots[i].thread_connection);
+    }
+    for (unsigned int i = 0; i < num_slots; i++) {
+        if (slots[i].joinable) {
+            pthread_join(slots[i].thread_connection, NULL);
+            slots[i].joinable = 0;
+        }
+    }
+}
+
+
+void conn_table_destroy(void) {
+    for (unsigned int i = 0; i < num_slots; i++) {
+        line_stream_free(&slots[i].rx);
+    }
+    free(slots);
+    slots = NULL;
+    num_slots = 0;
+}
@@ -0,0 +1,92 @@
+/**
+ * @file conn-table.h
+ * @brief Preallocated table of connection slots for the thread per connection model
+ *
+ * Every slot is allocated once at startup, aligned to a cache line so neighbouring
+ * connections never share one.  Free slots are kept on a lock-free stack, so taking
+ * and returning a slot neither allocates nor takes a lock.  A slot keeps its receive
+ * buffer when it is returned, the next client received on it reuses the memory.
+ *
+ * A connection thread returns its slot as the very last thing it does and is joined
+ * by whoever takes the slot next, so finished threads never pile up unjoined.
+ */
+
+#ifndef AESDSOCKET_CONN_TABLE_H
+#define AESDSOCKET_CONN_TABLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "readback.h"
+#include "line-stream.h"
+#include "fair-queue.h"
+
+#define CONN_SLOT_ALIGN 64
+#define CONN_DEFAULT_SLOTS 1024
+#define CONN_RX_KEEP (4 * BUFFER_SIZE)  // receive buffers up to this size stay with the slot
+
+// conn_slot.joinable
+#define CONN_THREAD_STARTING 1  // the acceptor is creating the thread
+#define CONN_THREAD_STARTED 2   // thread_connection holds its id
+
+struct conn_slot {
+    /**
+     * Only written by the acceptor, published by conn_table_started()
+     */
+    pthread_t thread_connection;
+    int client_fd;
+    /**
+     * A connection thread was started on the slot and has not been joined yet, set to
+     * CONN_THREAD_STARTING before the thread is created
+     */
+    int joinable;
+    struct readback rb;
+    struct line_stream rx;
+    /**
+     * The first byte picked the protocol
+     */
+    int negotiated;
+    /**
+     * Bytes received but not handled yet the connection is charged for in admission control
+     */
+    size_t charged;
+    struct fq_flow flow;
+    /**
+     * Index of the next free slot plus one while the slot is free, 0 ends the list
+     */
+    uint32_t next_free;
+} __attribute__((aligned(CONN_SLOT_ALIGN)));
+
+/**
+ * Allocate @param nslots slots, the most connections served at once.
+ * @return 0 on success, -1 on error
+ */
+int conn_table_init(unsigned int nslots);
+
+/**
+ * Take a free slot for the connection @param client_fd, joining the thread that used it last.
+ * @return the slot, NULL if every slot is in use
+ */
+struct conn_slot *conn_table_get(int client_fd);
+
+/**
+ * Publish @param thread, just created for the connection in @param slot.  The thread may
+ * have returned the slot already, its next owner waits for this to join it.
+ */
+void conn_table_started(struct conn_slot *slot, pthread_t thread);
+
+/**
+ * Close the connection in @param slot, drop its pending response and make the slot free.
+ * The receive buffer is kept for the next connection unless it grew beyond CONN_RX_KEEP.
+ * Called by the connection thread last thing before it exits.
+ */
+void conn_table_put(struct conn_slot *slot);
+
+/**
+ * Cancel the threads of all connections and wait for them, once no more slots are taken.
+ */
+void conn_table_cancel_all(void);
+
+void conn_table_destroy(void);
+
+#endif /* AESDSOCKET_CONN_TABLE_H */
@@ -0,0 +1,153 @@
+/**
+ * @file datagram.c
+ * @brief Batched UDP ingest for aesdsocket
+ *
+ * Every slot of the batch has room for a datagram and the newline it may lack, so each
+ * datagram is stored from its own buffer with one iovec.  The receiver only polls once
+ * the socket ran dry, under load every system call takes a whole batch.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "datagram.h"
+#include "metrics.h"
+
+static int dgram_fd = -1;
+static int stop_fd = -1;
+static int batch_size;
+static char *bufs;          // batch_size slots of DGRAM_MAX + 1 bytes
+static struct mmsghdr *msgs;
+static struct iovec *slots;
+static pthread_t receiver;
+
+
+// write the @param n datagrams received at @param received to the store
+static void store_datagrams(int n, uint64_t received) {
+    struct iovec iov[n];
+    int iovcnt = 0;
+
+    for (int i = 0; i < n; i++) {
+        char *buf = slots[i].iov_base;
+        size_t len = msgs[i].msg_len;
+        if (len == 0) continue;
+        // commands need an answer and there is nobody to send it to
+        if (packet_is_command(buf, len) || packet_is_subscribe(buf, len)) {
+            metrics_count(M_ERRORS);
+            continue;
+        }
+        metrics_count(M_PACKETS);
+        metrics_add(M_BYTES_IN, len);
+        if (buf[len - 1] != '\n') buf[len++] = '\n';
+        iov[iovcnt].iov_base = buf;
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+    }
+    if (iovcnt == 0) return;
+
+    metrics_mark_received(received);
+    store_append_records(iov, iovcnt);
+}
+
+
+static void *receive_datagrams(void *arg) {
+    struct pollfd pfds[2] = {
+        { .fd = dgram_fd, .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN },
+    };
+
+    for (;;) {
+        for (int i = 0; i < batch_size; i++) {
+            msgs[i].msg_hdr.msg_iov = &slots[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(dgram_fd, msgs, batch_size, MSG_DONTWAIT, NULL);
+        if (n > 0) {
+            store_datagrams(n, metrics_now());
+            // a full batch means more are waiting, unless we are told to stop
+            if (n == batch_size && poll(&pfds[1], 1, 0) == 0) continue;
+        } else if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            syslog(LOG_ERR, "Failed to receive datagrams: %s", strerror(errno));
+            break;
+        }
+
+        if (poll(pfds, 2, -1) == -1 && errno != EINTR) {
+            syslog(LOG_ERR, "poll failed: %s", strerror(errno));
+            break;
+        }
+        if (pfds[1].revents) break;
+    }
+    return NULL;
+}
+
+
+int datagram_start(int fd, int batch) {
+    dgram_fd = fd;
+    batch_size = batch;
+    bufs = malloc((size_t)batch * (DGRAM_MAX + 1));
+    msgs = calloc(batch, sizeof(*msgs));
+    slots = calloc(batch, sizeof(*slots));
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (!bufs || !msgs || !slots || stop_fd == -1) {
+        syslog(LOG_ERR, "Failed to set up datagram receiver");
+        goto fail;
+    }
+    for (int i = 0; i < batch; i++) {
+        // the extra byte takes the newline a datagram may lack
+        slots[i].iov_base = bufs + (size_t)i * (DGRAM_MAX + 1);
+        slots[i].iov_len = DGRAM_MAX;
+    }
+
+    // the receiver never handles SIGINT/SIGTERM, the accept loop in main has to see them
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int rc = pthread_create(&receiver, NULL, receive_datagrams, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0) {
+        syslog(LOG_ERR, "Failed to create datagram receiver thread");
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (stop_fd != -1) close(stop_fd);
+    stop_fd = -1;
+    free(bufs);
+    free(msgs);
+    free(slots);
+    close(dgram_fd);
+    dgram_fd = -1;
+    return -1;
+}
+
+
+void datagram_stop(void) {
+    if (stop_fd == -1) return;
+
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) == -1) {
+        syslog(LOG_ERR, "Failed to stop datagram receiver: %s", strerror(errno));
+    }
+    pthread_join(receiver, NULL);
+    close(stop_fd);
+    stop_fd = -1;
+    close(dgram_fd);
+    dgram_fd = -1;
+    free(bufs);
+    free(msgs);
+    free(slots);
+}
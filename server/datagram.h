@@ -0,0 +1,33 @@
+/**
+ * @file datagram.h
+ * @brief Batched UDP ingest for aesdsocket
+ *
+ * Producers that only append can send every record as one datagram to the server's port,
+ * without a connection and without an answer.  A receiver thread takes everything queued
+ * on the socket, up to a batch of datagrams per recvmmsg(), and writes the batch to the
+ * store with a single writev().  A datagram is a complete record, one not ending in a
+ * newline gets one.
+ */
+
+#ifndef AESDSOCKET_DATAGRAM_H
+#define AESDSOCKET_DATAGRAM_H
+
+#define DGRAM_MAX 65536             // fits the largest UDP payload
+#define DGRAM_DEFAULT_BATCH 64
+#define DGRAM_MAX_BATCH 256
+#define DGRAM_RCVBUF (4 * 1024 * 1024)   // capped by net.core.rmem_max
+
+/**
+ * Start receiving on the bound UDP socket @param fd, which is closed by datagram_stop().
+ * @param batch datagrams taken per recvmmsg() at most
+ * @return 0 on success, -1 on error
+ */
+int datagram_start(int fd, int batch);
+
+/**
+ * Stop the receiver and close its socket.  Datagrams still queued are left on the
+ * socket, for a process it was passed on to.  Does nothing if the receiver is not running.
+ */
+void datagram_stop(void);
+
+#endif /* AESDSOCKET_DATAGRAM_H */
@@ -0,0 +1,1033 @@
+/**
+ * @file event-loop.c
+ * @brief epoll based connection handling for aesdsocket
+ *
+ * The accept loop in main hands every new client to one of the loop threads through
+ * a pipe.  With the port sharded over SO_REUSEPORT sockets every loop is pinned to a
+ * CPU and accepts on its own socket instead, so no single thread accepts for all.
+ * From then on the connection is only touched by that loop thread, so the
+ * per-connection state needs no locking.  Packets are framed on newlines and handled
+ * one at a time; while the read-back of a packet is pending the connection only waits
+ * for EPOLLOUT, which keeps responses in order and stops a slow reader from making
+ * the server buffer its input.
+ *
+ * A connection opening with BIN_MAGIC is framed by the binary protocol instead.
+ * A connection that subscribed stops being framed at all and is woken through the
+ * loop's broadcast waker whenever records are committed.
+ *
+ * With the worker pool enabled the storage work of a packet runs on a worker, with
+ * group commit enabled the packet is queued for the commit thread.  Either way the
+ * connection is taken out of epoll while its packet is away and handed back through a
+ * list and an eventfd, so only the loop thread puts it back and sends the read-back.
+ *
+ * With io_uring the loops keep the same connection state machine but stop asking for
+ * readiness: watching for EPOLLIN queues a receive straight into the connection's
+ * receive buffer, on a fixed file slot, and many connections' receives are submitted
+ * and reaped with one system call.  EPOLLOUT and the loop's own descriptors become one
+ * shot polls.  A loop whose ring cannot be set up runs on epoll.
+ *
+ * With idle or slow reader timeouts set every loop has a timerfd sweeping its
+ * connections a few times per timeout, closing those that sent nothing or whose socket
+ * stayed full for too long.  With clients held to a rate the same timer resumes the
+ * connections parked until their token buckets refilled.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "queue.h"
+#include "aesdsocket.h"
+#include "event-loop.h"
+#include "readback.h"
+#include "worker-pool.h"
+#include "commit-queue.h"
+#include "binary-proto.h"
+#include "line-stream.h"
+#include "broadcast.h"
+#include "uring.h"
+#include "metrics.h"
+#include "probes.h"
+#include "log-ring.h"
+#include "admission.h"
+#include "fair-queue.h"
+
+#define MAX_EVENTS 64
+#define URING_ENTRIES 256
+#define URING_FILES 1024    // connections per loop on fixed file slots, the rest use their descriptor
+#define SWEEP_MIN_MS 10
+#define SWEEP_MAX_MS 1000
+#define THROTTLE_TICK_MS 10 // how often parked connections are looked at
+
+/**
+ * io_uring operations of a connection, tagged in the low bits of their user data.  One
+ * receive or input poll and one output poll may be in flight at a time.
+ */
+#define URING_SOURCE 0      // a loop descriptor became readable
+#define URING_RECV 1
+#define URING_POLLOUT 2
+#define URING_POLLIN 3      // the kernel would not wait in a receive, poll first
+#define URING_TAG_MASK 3
+
+struct ev_loop;
+
+struct ev_conn {
+    struct work_item work;  // storage work handed to the worker pool
+    struct commit_req commit;   // packet queued for the commit thread
+    int committed;          // commit finished, the read-back has not been started yet
+    struct ev_loop *loop;
+    int fd;
+    uint32_t events;        // events currently registered with epoll
+    struct line_stream rx;  // received bytes not handled yet
+    int rx_eof;             // peer has shut down its sending side
+    int negotiated;         // the first byte picked the protocol
+    int binary;             // speaks the binary protocol rather than newline text
+    const char *packet;     // packet owned by a pool worker, points into rx
+    size_t packet_len;
+    struct bin_frame frame; // binary request owned by a pool worker
+    struct readback rb;     // read-back being streamed to the client
+    int subscribed;         // only receives newly committed records from now on
+    uint64_t sub_pos;       // position in the broadcast ring
+    int slot;               // io_uring fixed file slot, -1 if none
+    unsigned int armed;     // io_uring operations in flight, URING_RECV and URING_POLLOUT bits
+    int poll_first;         // wait for input with a poll before receiving
+    int closing;            // closed, freed once its io_uring operations completed
+    uint64_t rx_time;       // when data was last received, for the commit latency and idle timeout
+    uint64_t stalled_since; // when the socket filled up without taking all of a response, 0 if not
+    size_t charged;         // received bytes charged for in admission control
+    struct fq_flow flow;
+    uint64_t throttled_until;   // parked over its rate until then, 0 if not
+    struct ev_conn *handback_next;
+    LIST_ENTRY(ev_conn) entries;
+    LIST_ENTRY(ev_conn) sub_entries;
+    LIST_ENTRY(ev_conn) throttle_entries;
+};
+
+struct ev_loop {
+    pthread_t thread;
+    int epoll_fd;
+    int pipe_fds[2];        // accepted client descriptors are passed through this pipe
+    int listen_fd;          // the loop's own listening socket, -1 if main accepts for it
+    struct bcast_waker waker;   // registered while the loop has subscribers
+    LIST_HEAD(ev_conn_list, ev_conn) conns;
+    struct ev_conn_list subs;
+    struct ev_conn_list throttled;
+    int uring;              // runs on io_uring rather than epoll
+    struct uring ring;
+    int handback_fd;        // eventfd signalled when connections are handed back
+    pthread_mutex_t handback_lock;
+    struct ev_conn *handback;
+    int closing;            // closed connections waiting for their io_uring operations
+    int timer_fd;           // periodic sweep for timed out connections, -1 without timeouts
+};
+
+static struct ev_loop *loops;
+static int num_loops;
+static unsigned int next_loop;
+static int accepting = 1;   // cleared once another process took the listening sockets over
+
+
+static void conn_free(struct ev_loop *loop, struct ev_conn *c) {
+    AESD_PROBE1(conn_close, c->fd);
+    metrics_count(M_DISCONNECTS);
+    if (c->slot != -1) uring_file_remove(&loop->ring, c->slot);
+    close(c->fd);
+    admission_leave(c->charged);
+    readback_release(&c->rb);
+    line_stream_free(&c->rx);
+    free(c);
+}
+
+
+// close an admitted client that never became a connection
+static void drop_client(int client_fd) {
+    close(client_fd);
+    admission_leave(0);
+}
+
+
+// charge the connection for what its receive buffer holds
+static void conn_charge(struct ev_conn *c) {
+    size_t avail;
+    line_stream_data(&c->rx, &avail);
+    admission_charge(&c->charged, avail);
+}
+
+
+static void conn_close(struct ev_loop *loop, struct ev_conn *c) {
+    if (c->rx_eof) log_ring_post(LOG_MSG_DISCONNECTED, 0, NULL);
+    if (c->subscribed) {
+        LIST_REMOVE(c, sub_entries);
+        if (LIST_EMPTY(&loop->subs)) bcast_remove_waker(&loop->waker);
+        bcast_unsubscribe();
+    }
+    if (c->throttled_until) LIST_REMOVE(c, throttle_entries);
+    LIST_REMOVE(c, entries);
+    if (c->armed) {
+        // the kernel may still receive into rx, shutting down completes what is in flight
+        c->closing = 1;
+        loop->closing++;
+        shutdown(c->fd, SHUT_RDWR);
+        return;
+    }
+    conn_free(loop, c);
+}
+
+
+/**
+ * Make room in the receive buffer, storing an overlong text line as a partial packet.
+ * @return where to receive into, NULL if the connection has to be closed
+ */
+static char *conn_rx_space(struct ev_conn *c, size_t *room) {
+    size_t max = c->binary ? BIN_MAX_FRAME : RX_MAX;
+    char *space = line_stream_space(&c->rx, max, room);
+
+    if (!space) {
+        size_t avail;
+        const char *data = line_stream_data(&c->rx, &avail);
+        if (avail < max) return NULL;
+        if (c->binary) {
+            // conn_advance() takes every complete frame, this one cannot be valid
+            log_ring_post(LOG_MSG_FRAME_TOO_LARGE, 0, NULL);
+            metrics_count(M_ERRORS);
+            return NULL;
+        }
+        // no newline in sight, store what we have as a partial packet
+        fair_queue_set_flow(&c->flow);
+        if (store_append(data, avail) == -1) return NULL;
+        line_stream_consume(&c->rx, avail);
+        space = line_stream_space(&c->rx, max, room);
+    }
+    return space;
+}
+
+
+// queue the io_uring operations standing in for interest in @param events
+static int conn_arm(struct ev_loop *loop, struct ev_conn *c, uint32_t events) {
+    int fixed = c->slot != -1;
+    int fd = fixed ? c->slot : c->fd;
+    int ret = 0;
+
+    c->events = events;
+    if ((events & EPOLLIN) && !(c->armed & URING_RECV)) {
+        if (c->poll_first) {
+            ret = uring_poll(&loop->ring, fd, fixed, POLLIN, (uintptr_t)c | URING_POLLIN);
+        } else {
+            size_t room;
+            char *space = conn_rx_space(c, &room);
+            if (!space) return -1;
+            ret = uring_recv(&loop->ring, fd, fixed, space, room, (uintptr_t)c | URING_RECV);
+        }
+        if (ret == 0) c->armed |= URING_RECV;
+    }
+    if (ret == 0 && (events & EPOLLOUT) && !(c->armed & URING_POLLOUT)) {
+        ret = uring_poll(&loop->ring, fd, fixed, POLLOUT, (uintptr_t)c | URING_POLLOUT);
+        if (ret == 0) c->armed |= URING_POLLOUT;
+    }
+    if (ret == -1) syslog(LOG_ERR, "Failed to queue io_uring operation");
+    return ret;
+}
+
+
+static int conn_watch(struct ev_loop *loop, struct ev_conn *c, uint32_t events) {
+    if (loop->uring) return conn_arm(loop, c, events);
+    if (c->events == events) return 0;
+
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+        syslog(LOG_ERR, "Failed to update epoll events: %s", strerror(errno));
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+
+
+// account for a receive returning @param n, -errno on error
+static int conn_received(struct ev_conn *c, ssize_t n) {
+    if (n < 0) {
+        if (n == -EAGAIN || n == -EWOULDBLOCK || n == -EINTR) return 0;
+        log_ring_post(LOG_MSG_RECV_FAILED, -n, NULL);
+        metrics_count(M_ERRORS);
+        return -1;
+    }
+    if (n == 0) c->rx_eof = 1;
+    line_stream_received(&c->rx, n);
+    if (n > 0) {
+        metrics_add(M_BYTES_IN, n);
+        c->rx_time = metrics_now();
+        conn_charge(c);
+    }
+    return 0;
+}
+
+
+static int conn_read(struct ev_conn *c) {
+    size_t room;
+    char *space = conn_rx_space(c, &room);
+    if (!space) return -1;
+
+    ssize_t n = recv(c->fd, space, room, 0);
+    return conn_received(c, n == -1 ? -errno : n);
+}
+
+
+/**
+ * Give a detached connection back to its loop to stream the read-back.  The loop thread
+ * picks it up from the list: only it may queue on its ring, and the sweep must not see
+ * the connection watched again while a worker still uses it.
+ */
+static void conn_hand_back(struct ev_conn *c) {
+    struct ev_loop *loop = c->loop;
+
+    pthread_mutex_lock(&loop->handback_lock);
+    c->handback_next = loop->handback;
+    loop->handback = c;
+    pthread_mutex_unlock(&loop->handback_lock);
+
+    uint64_t one = 1;
+    if (write(loop->handback_fd, &one, sizeof(one)) == -1) {
+        syslog(LOG_ERR, "Failed to wake event loop: %s", strerror(errno));
+    }
+}
+
+
+/**
+ * Take the connection out of epoll while its packet is processed elsewhere, so the
+ * loop leaves it and its receive buffer alone until conn_hand_back().
+ */
+static int conn_detach(struct ev_loop *loop, struct ev_conn *c, const char *packet, size_t len) {
+    // on io_uring nothing is in flight while a packet is handled
+    if (!loop->uring && epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL) == -1) {
+        syslog(LOG_ERR, "Failed to remove client from epoll: %s", strerror(errno));
+        return -1;
+    }
+    c->events = 0;
+    c->packet = packet;
+    c->packet_len = len;
+    return 0;
+}
+
+
+static void conn_work(struct work_item *work) {
+    struct ev_conn *c = (struct ev_conn *)work;
+
+    metrics_mark_received(c->rx_time);
+    fair_queue_set_flow(&c->flow);
+    if (c->binary) {
+        bin_handle(&c->frame, &c->rb);
+    } else {
+        handle_packet(c->packet, c->packet_len, &c->rb);
+    }
+    conn_hand_back(c);
+}
+
+
+static int conn_submit(struct ev_loop *loop, struct ev_conn *c, const char *packet, size_t len) {
+    if (conn_detach(loop, c, packet, len) == -1) return -1;
+    if (worker_pool_submit(&c->work) == -1) {
+        conn_work(&c->work);
+    }
+    return 0;
+}
+
+
+// runs on the commit thread
+static void conn_committed(struct commit_req *req) {
+    struct ev_conn *c = (struct ev_conn *)((char *)req - offsetof(struct ev_conn, commit));
+
+    metrics_since(H_RECV_COMMIT, c->rx_time);
+    c->committed = 1;
+    conn_hand_back(c);
+}
+
+
+static int conn_commit(struct ev_loop *loop, struct ev_conn *c, const char *packet, size_t len) {
+    if (conn_detach(loop, c, packet, len) == -1) return -1;
+    c->commit.buf = packet;
+    c->commit.len = len;
+    commit_queue_submit(&c->commit);
+    return 0;
+}
+
+
+// send a subscriber the records committed since it last caught up, what it sends is ignored
+static int conn_follow(struct ev_loop *loop, struct ev_conn *c) {
+    size_t avail;
+    line_stream_data(&c->rx, &avail);
+    line_stream_consume(&c->rx, avail);
+    if (c->rx_eof) return -1;
+
+    int sent = bcast_send(&c->sub_pos, c->fd);
+    if (sent < 0) return -1;
+    if (!sent && !c->stalled_since) c->stalled_since = metrics_now();
+    if (sent) c->stalled_since = 0;
+    return conn_watch(loop, c, sent ? EPOLLIN : EPOLLIN | EPOLLOUT);
+}
+
+
+static int conn_subscribe(struct ev_loop *loop, struct ev_conn *c) {
+    if (LIST_EMPTY(&loop->subs)) bcast_add_waker(&loop->waker);
+    LIST_INSERT_HEAD(&loop->subs, c, sub_entries);
+    c->subscribed = 1;
+    c->sub_pos = bcast_subscribe();
+    return conn_follow(loop, c);
+}
+
+
+/**
+ * Stop handling the packets of a client over its rate until it paid off its debt in
+ * @param wait nanoseconds, loop_sweep() resumes it.
+ */
+static int conn_throttle(struct ev_loop *loop, struct ev_conn *c, uint64_t wait) {
+    metrics_count(M_THROTTLED);
+    // out of epoll, a hang up would be reported over and over while the connection waits
+    if (conn_detach(loop, c, NULL, 0) == -1) return -1;
+    c->throttled_until = metrics_now() + wait;
+    LIST_INSERT_HEAD(&loop->throttled, c, throttle_entries);
+    return 0;
+}
+
+
+/**
+ * Handle every complete packet in the receive buffer and stream back the responses.
+ * @return -1 when the connection should be closed, 0 otherwise
+ */
+static int conn_advance(struct ev_loop *loop, struct ev_conn *c) {
+    // a receive completing on io_uring leaves a parked connection parked
+    if (c->throttled_until) return 0;
+    // woken while waiting for output, the client has read some of what was sent
+    if (c->events & EPOLLOUT) c->stalled_since = 0;
+    if (c->subscribed) return conn_follow(loop, c);
+
+    // packets stored right here on the loop thread count their commit from the last receive
+    metrics_mark_received(c->rx_time);
+    fair_queue_set_flow(&c->flow);
+    if (c->committed) {
+        c->committed = 0;
+        if (c->binary) {
+            bin_reply_append(&c->rb, c->commit.status);
+        } else if (c->commit.status == 0) {
+            store_readback(&c->rb);
+        }
+    }
+
+    for (;;) {
+        if (readback_pending(&c->rb)) {
+            int r = readback_send(&c->rb, c->fd);
+            if (r < 0) return -1;
+            if (r == 0) {
+                if (!c->stalled_since) c->stalled_since = metrics_now();
+                return conn_watch(loop, c, EPOLLOUT);
+            }
+        }
+
+        size_t avail;
+        const char *start = line_stream_data(&c->rx, &avail);
+        // a client in debt is parked rather than put to sleep with the whole loop
+        uint64_t wait;
+        if (avail > 0 && (wait = fair_queue_throttle(&c->flow)) != 0) return conn_throttle(loop, c, wait);
+        if (!c->negotiated && avail > 0) {
+            c->negotiated = 1;
+            c->binary = (unsigned char)*start == BIN_MAGIC;
+        }
+
+        if (c->binary) {
+            ssize_t len = bin_frame_parse(start, avail, &c->frame);
+            if (len < 0) {
+                log_ring_post(LOG_MSG_MALFORMED_FRAME, 0, NULL);
+                metrics_count(M_ERRORS);
+                return -1;
+            }
+            if (len == 0) break;
+            line_stream_consume(&c->rx, len);
+            metrics_count(M_PACKETS);
+            AESD_PROBE2(packet_framed, c->fd, len);
+            if (worker_pool_enabled()) return conn_submit(loop, c, start, len);
+            if (commit_queue_enabled() && c->frame.opcode == BIN_OP_APPEND) {
+                return conn_commit(loop, c, c->frame.payload, c->frame.len);
+            }
+            bin_handle(&c->frame, &c->rb);
+            continue;
+        }
+
+        size_t len;
+        if (!line_stream_next(&c->rx, &start, &len)) break;
+        metrics_count(M_PACKETS);
+        AESD_PROBE2(packet_framed, c->fd, len);
+        if (packet_is_subscribe(start, len)) return conn_subscribe(loop, c);
+        if (worker_pool_enabled()) return conn_submit(loop, c, start, len);
+        if (commit_queue_enabled() && !packet_is_command(start, len)) return conn_commit(loop, c, start, len);
+        handle_packet(start, len, &c->rb);
+    }
+
+    if (c->rx_eof) {
+        // an unfinished binary frame is dropped, unfinished text is stored like a partial packet
+        size_t avail;
+        const char *tail = line_stream_data(&c->rx, &avail);
+        if (!c->binary && avail > 0) store_append(tail, avail);
+        return -1;
+    }
+    conn_charge(c);
+    return conn_watch(loop, c, EPOLLIN);
+}
+
+
+static int conn_resume(struct ev_loop *loop, struct ev_conn *c) {
+    LIST_REMOVE(c, throttle_entries);
+    c->throttled_until = 0;
+    if (!loop->uring) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+            syslog(LOG_ERR, "Failed to return client to epoll: %s", strerror(errno));
+            return -1;
+        }
+        c->events = EPOLLIN;
+    }
+    return conn_advance(loop, c);
+}
+
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+static void conn_add(struct ev_loop *loop, int client_fd) {
+    if (set_nonblocking(client_fd) == -1) {
+        syslog(LOG_ERR, "Failed to make client socket nonblocking: %s", strerror(errno));
+        drop_client(client_fd);
+        return;
+    }
+
+    struct ev_conn *c = calloc(1, sizeof(struct ev_conn));
+    if (!c) {
+        syslog(LOG_ERR, "Failed to allocate memory for connection data");
+        drop_client(client_fd);
+        return;
+    }
+    c->work.fn = conn_work;
+    c->commit.done = conn_committed;
+    c->loop = loop;
+    c->fd = client_fd;
+    c->slot = -1;
+    c->rx_time = metrics_now();     // the idle timeout runs from the accept
+    fair_queue_flow_init(&c->flow, client_fd);
+    line_stream_init(&c->rx);
+    readback_init(&c->rb);
+
+    if (loop->uring) {
+        c->slot = uring_file_add(&loop->ring, client_fd);
+        if (conn_arm(loop, c, EPOLLIN) == -1) {
+            conn_free(loop, c);
+            return;
+        }
+    } else {
+        c->events = EPOLLIN;
+        struct epoll_event ev = { .events = c->events, .data.ptr = c };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+            syslog(LOG_ERR, "Failed to add client to epoll: %s", strerror(errno));
+            drop_client(client_fd);
+            free(c);
+            return;
+        }
+    }
+    LIST_INSERT_HEAD(&loop->conns, c, entries);
+}
+
+
+/**
+ * Pick up the descriptors queued by event_loop_add_client().
+ * @return 0 once the write end of the pipe was closed by event_loop_stop()
+ */
+static int loop_take_clients(struct ev_loop *loop) {
+    int fds[MAX_EVENTS];
+    ssize_t n;
+
+    while ((n = read(loop->pipe_fds[0], fds, sizeof(fds))) > 0) {
+        for (size_t i = 0; i < n / sizeof(int); i++) {
+            conn_add(loop, fds[i]);
+        }
+    }
+    if (n == 0) return 0;
+    return 1;
+}
+
+
+// @return 0 once the listening socket is shut down, broken or handed over
+static int loop_accept(struct ev_loop *loop) {
+    struct sockaddr_in client_addr;
+    char addr_str[INET_ADDRSTRLEN];
+
+    // leave the socket and its queued clients to the new process
+    if (!__atomic_load_n(&accepting, __ATOMIC_RELAXED)) return 0;
+
+    for (;;) {
+        socklen_t addr_size = sizeof(client_addr);
+        int client_fd = accept4(loop->listen_fd, (struct sockaddr *)&client_addr, &addr_size, SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            if (running) syslog(LOG_ERR, "Failed to accept: %s", strerror(errno));
+            return 0;
+        }
+        inet_ntop(AF_INET, &client_addr.sin_addr, addr_str, sizeof(addr_str));
+        log_ring_post(LOG_MSG_ACCEPTED, 0, addr_str);
+        metrics_count(M_CONNECTIONS);
+        AESD_PROBE1(conn_accept, client_fd);
+        if (admission_admit(client_fd) == -1) continue;
+        conn_add(loop, client_fd);
+    }
+}
+
+
+static void loop_wake_subscribers(struct ev_loop *loop) {
+    uint64_t count;
+    struct ev_conn *c, *tmp;
+
+    if (read(loop->waker.fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        syslog(LOG_ERR, "Failed to read broadcast waker: %s", strerror(errno));
+    }
+    LIST_FOREACH_SAFE(c, &loop->subs, sub_entries, tmp) {
+        if (conn_follow(loop, c) == -1) conn_close(loop, c);
+    }
+}
+
+
+// resume the connections conn_hand_back() queued
+static void loop_take_handbacks(struct ev_loop *loop) {
+    uint64_t count;
+
+    if (read(loop->handback_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        syslog(LOG_ERR, "Failed to read hand back eventfd: %s", strerror(errno));
+    }
+    pthread_mutex_lock(&loop->handback_lock);
+    struct ev_conn *c = loop->handback;
+    loop->handback = NULL;
+    pthread_mutex_unlock(&loop->handback_lock);
+
+    while (c) {
+        struct ev_conn *next = c->handback_next;
+        struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+        if (!loop->uring && epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+            syslog(LOG_ERR, "Failed to return client to epoll: %s", strerror(errno));
+            conn_close(loop, c);
+        } else {
+            c->events = EPOLLOUT;
+            if (conn_advance(loop, c) == -1) conn_close(loop, c);
+        }
+        c = next;
+    }
+}
+
+
+/**
+ * Resume the connections whose buckets refilled, close the connections that sent nothing
+ * or took none of their response for too long.
+ */
+static void loop_sweep(struct ev_loop *loop) {
+    const struct admission_limits *limits = admission_limits();
+    uint64_t idle_ns = (uint64_t)limits->idle_timeout_ms * 1000000;
+    uint64_t slow_ns = (uint64_t)limits->slow_timeout_ms * 1000000;
+    uint64_t expirations;
+    struct ev_conn *c, *tmp;
+
+    if (read(loop->timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+        syslog(LOG_ERR, "Failed to read sweep timer: %s", strerror(errno));
+    }
+    uint64_t now = metrics_now();
+    LIST_FOREACH_SAFE(c, &loop->throttled, throttle_entries, tmp) {
+        if (c->throttled_until > now) continue;
+        if (conn_resume(loop, c) == -1) conn_close(loop, c);
+    }
+    LIST_FOREACH_SAFE(c, &loop->conns, entries, tmp) {
+        // a detached connection belongs to a worker or the commit thread until handed back
+        if (c->events == 0 || c->throttled_until) continue;
+        if (slow_ns && c->stalled_since && now - c->stalled_since > slow_ns) {
+            log_ring_post(LOG_MSG_SLOW_READER, 0, NULL);
+        } else if (idle_ns && !c->subscribed && !readback_pending(&c->rb) && now - c->rx_time > idle_ns) {
+            log_ring_post(LOG_MSG_IDLE_TIMEOUT, 0, NULL);
+        } else {
+            continue;
+        }
+        metrics_count(M_TIMEOUTS);
+        conn_close(loop, c);
+    }
+}
+
+
+/**
+ * The loop's own descriptors are told apart from connections by their address in the
+ * loop: NULL for the pipe, the waker, the listening socket, the hand back eventfd and
+ * the sweep timer.
+ */
+static int is_source(struct ev_loop *loop, void *ptr) {
+    return ptr == NULL || ptr == &loop->waker || ptr == &loop->listen_fd || ptr == &loop->handback_fd ||
+        ptr == &loop->timer_fd;
+}
+
+
+static int source_fd(struct ev_loop *loop, void *source) {
+    if (source == NULL) return loop->pipe_fds[0];
+    if (source == &loop->waker) return loop->waker.fd;
+    return *(int *)source;
+}
+
+
+/**
+ * Service one of the loop's own descriptors.
+ * @return 0 once it is not to be watched any more
+ */
+static int loop_source(struct ev_loop *loop, void *source) {
+    if (source == NULL) return loop_take_clients(loop);
+    if (source == &loop->listen_fd) return loop_accept(loop);
+    if (source == &loop->waker) {
+        loop_wake_subscribers(loop);
+    } else if (source == &loop->timer_fd) {
+        loop_sweep(loop);
+    } else {
+        loop_take_handbacks(loop);
+    }
+    return 1;
+}
+
+
+static void loop_close_all(struct ev_loop *loop) {
+    // connections waiting to be handed back are closed with the rest
+    pthread_mutex_lock(&loop->handback_lock);
+    loop->handback = NULL;
+    pthread_mutex_unlock(&loop->handback_lock);
+
+    while (!LIST_EMPTY(&loop->conns)) {
+        conn_close(loop, LIST_FIRST(&loop->conns));
+    }
+}
+
+
+static void loop_run_epoll(struct ev_loop *loop) {
+    struct epoll_event events[MAX_EVENTS];
+    int active = 1;
+
+    while (active) {
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct ev_conn *c = events[i].data.ptr;
+            if (is_source(loop, c)) {
+                if (loop_source(loop, c)) continue;
+                if (c == NULL) {
+                    active = 0;
+                } else {
+                    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source_fd(loop, c), NULL);
+                }
+                continue;
+            }
+
+            if ((c->events & EPOLLIN) && conn_read(c) == -1) {
+                conn_close(loop, c);
+                continue;
+            }
+            if (conn_advance(loop, c) == -1) conn_close(loop, c);
+        }
+    }
+
+    loop_close_all(loop);
+}
+
+
+static int loop_arm_source(struct ev_loop *loop, void *source) {
+    if (uring_poll(&loop->ring, source_fd(loop, source), 0, POLLIN, (uintptr_t)source | URING_SOURCE) == -1) {
+        syslog(LOG_ERR, "Failed to queue io_uring poll");
+        return -1;
+    }
+    return 0;
+}
+
+
+static void conn_complete(struct ev_loop *loop, struct ev_conn *c, unsigned int tag, int res) {
+    c->armed &= tag == URING_POLLOUT ? ~URING_POLLOUT : ~URING_RECV;
+    if (c->closing) {
+        if (!c->armed) {
+            loop->closing--;
+            conn_free(loop, c);
+        }
+        return;
+    }
+
+    int ret = 0;
+    if (tag == URING_RECV) {
+        // older kernels do not wait in receives on nonblocking sockets
+        if (res == -EAGAIN) c->poll_first = 1;
+        ret = conn_received(c, res);
+    } else if (tag == URING_POLLIN) {
+        ret = conn_read(c);
+    }
+    if (ret == -1 || conn_advance(loop, c) == -1) conn_close(loop, c);
+}
+
+
+static void loop_run_uring(struct ev_loop *loop) {
+    int active = 1;
+
+    // after the pipe closed, wait for the operations of the closed connections to complete
+    while (active || loop->closing > 0) {
+        if (uring_submit_and_wait(&loop->ring, 1) == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+
+        uint64_t user_data;
+        int res;
+        while (uring_next_completion(&loop->ring, &user_data, &res)) {
+            unsigned int tag = user_data & URING_TAG_MASK;
+            void *ptr = (void *)(uintptr_t)(user_data & ~(uint64_t)URING_TAG_MASK);
+
+            if (tag != URING_SOURCE) {
+                conn_complete(loop, ptr, tag, res);
+            } else if (active && loop_source(loop, ptr)) {
+                loop_arm_source(loop, ptr);
+            } else if (ptr == NULL && active) {
+                active = 0;
+                loop_close_all(loop);
+            }
+        }
+    }
+
+    loop_close_all(loop);
+}
+
+
+static void *loop_thread(void *arg) {
+    struct ev_loop *loop = (struct ev_loop *)arg;
+
+    if (loop->uring) {
+        loop_run_uring(loop);
+    } else {
+        loop_run_epoll(loop);
+    }
+    return NULL;
+}
+
+
+// set up io_uring for @param loop and queue polls of its descriptors
+static int loop_open_uring(struct ev_loop *loop) {
+    if (uring_init(&loop->ring, URING_ENTRIES, URING_FILES) == -1) {
+        syslog(LOG_INFO, "io_uring unavailable (%s), using epoll", strerror(errno));
+        return -1;
+    }
+    if (loop_arm_source(loop, NULL) == -1 || loop_arm_source(loop, &loop->waker) == -1 ||
+        loop_arm_source(loop, &loop->handback_fd) == -1 ||
+        (loop->listen_fd != -1 && loop_arm_source(loop, &loop->listen_fd) == -1) ||
+        (loop->timer_fd != -1 && loop_arm_source(loop, &loop->timer_fd) == -1)) {
+        uring_exit(&loop->ring);
+        return -1;
+    }
+    loop->uring = 1;
+    return 0;
+}
+
+
+static int loop_open_epoll(struct ev_loop *loop) {
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        syslog(LOG_ERR, "Failed to create epoll instance: %s", strerror(errno));
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = &loop->waker };
+    struct epoll_event listen_ev = { .events = EPOLLIN, .data.ptr = &loop->listen_fd };
+    struct epoll_event timer_ev = { .events = EPOLLIN, .data.ptr = &loop->timer_fd };
+    struct epoll_event handback_ev = { .events = EPOLLIN, .data.ptr = &loop->handback_fd };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->pipe_fds[0], &ev) == -1 ||
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->waker.fd, &wake_ev) == -1 ||
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->handback_fd, &handback_ev) == -1 ||
+        (loop->listen_fd != -1 &&
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &listen_ev) == -1) ||
+        (loop->timer_fd != -1 &&
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &timer_ev) == -1)) {
+        syslog(LOG_ERR, "Failed to add descriptors to epoll: %s", strerror(errno));
+        close(loop->epoll_fd);
+        return -1;
+    }
+    return 0;
+}
+
+
+static void loop_release(struct ev_loop *loop) {
+    if (loop->uring) {
+        uring_exit(&loop->ring);
+    } else {
+        close(loop->epoll_fd);
+    }
+    close(loop->pipe_fds[0]);
+    close(loop->waker.fd);
+    close(loop->handback_fd);
+    if (loop->timer_fd != -1) close(loop->timer_fd);
+    pthread_mutex_destroy(&loop->handback_lock);
+}
+
+
+/**
+ * Create the sweep timer of @param loop when a timeout or a rate is set, ticking a few
+ * times per the shorter timeout so a connection is closed soon after it runs out.
+ * @return 0 on success, -1 on error
+ */
+static int loop_open_timer(struct ev_loop *loop) {
+    const struct admission_limits *limits = admission_limits();
+    long period_ms = limits->idle_timeout_ms;
+
+    loop->timer_fd = -1;
+    if (limits->slow_timeout_ms > 0 && (period_ms == 0 || limits->slow_timeout_ms < period_ms)) {
+        period_ms = limits->slow_timeout_ms;
+    }
+    if (period_ms == 0 && !fair_queue_limited()) return 0;
+    period_ms /= 4;
+    if (period_ms < SWEEP_MIN_MS) period_ms = SWEEP_MIN_MS;
+    if (period_ms > SWEEP_MAX_MS) period_ms = SWEEP_MAX_MS;
+    if (fair_queue_limited() && period_ms > THROTTLE_TICK_MS) period_ms = THROTTLE_TICK_MS;
+
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timer_fd == -1) {
+        syslog(LOG_ERR, "Failed to create timerfd: %s", strerror(errno));
+        return -1;
+    }
+    struct timespec period = { .tv_sec = period_ms / 1000, .tv_nsec = (period_ms % 1000) * 1000000 };
+    struct itimerspec its = { .it_interval = period, .it_value = period };
+    if (timerfd_settime(loop->timer_fd, 0, &its, NULL) == -1) {
+        syslog(LOG_ERR, "Failed to arm timerfd: %s", strerror(errno));
+        close(loop->timer_fd);
+        loop->timer_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+int event_loop_start(int nloops, const int *listen_fds, int io_uring) {
+    loops = calloc(nloops, sizeof(struct ev_loop));
+    if (!loops) {
+        syslog(LOG_ERR, "Failed to allocate memory for event loops");
+        return -1;
+    }
+
+    // loop threads never handle SIGINT/SIGTERM, the accept loop in main has to see them
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    for (num_loops = 0; num_loops < nloops; num_loops++) {
+        struct ev_loop *loop = &loops[num_loops];
+        LIST_INIT(&loop->conns);
+        LIST_INIT(&loop->subs);
+        LIST_INIT(&loop->throttled);
+        pthread_mutex_init(&loop->handback_lock, NULL);
+        loop->listen_fd = listen_fds ? listen_fds[num_loops] : -1;
+
+        if (loop->listen_fd != -1 && set_nonblocking(loop->listen_fd) == -1) {
+            syslog(LOG_ERR, "Failed to make listening socket nonblocking: %s", strerror(errno));
+            break;
+        }
+        if (pipe2(loop->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            syslog(LOG_ERR, "Failed to create pipe: %s", strerror(errno));
+            break;
+        }
+        loop->waker.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        loop->handback_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->waker.fd == -1 || loop->handback_fd == -1) {
+            syslog(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+            if (loop->waker.fd != -1) close(loop->waker.fd);
+            if (loop->handback_fd != -1) close(loop->handback_fd);
+            close(loop->pipe_fds[0]);
+            close(loop->pipe_fds[1]);
+            break;
+        }
+        if (loop_open_timer(loop) == -1) {
+            close(loop->handback_fd);
+            close(loop->waker.fd);
+            close(loop->pipe_fds[0]);
+            close(loop->pipe_fds[1]);
+            break;
+        }
+        // a ring that cannot be set up leaves the loop on epoll
+        if ((!io_uring || loop_open_uring(loop) == -1) && loop_open_epoll(loop) == -1) {
+            if (loop->timer_fd != -1) close(loop->timer_fd);
+            close(loop->handback_fd);
+            close(loop->waker.fd);
+            close(loop->pipe_fds[0]);
+            close(loop->pipe_fds[1]);
+            break;
+        }
+
+        if (pthread_create(&loop->thread, NULL, loop_thread, loop) != 0) {
+            syslog(LOG_ERR, "Failed to create event loop thread");
+            close(loop->pipe_fds[1]);
+            loop_release(loop);
+            break;
+        }
+        if (loop->listen_fd != -1) pin_thread(loop->thread, num_loops);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (num_loops < nloops) {
+        event_loop_stop();
+        return -1;
+    }
+    return 0;
+}
+
+
+int event_loop_add_client(int client_fd) {
+    struct ev_loop *loop = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % num_loops];
+
+    if (write(loop->pipe_fds[1], &client_fd, sizeof(client_fd)) != sizeof(client_fd)) {
+        syslog(LOG_ERR, "Failed to pass client to event loop: %s", strerror(errno));
+        drop_client(client_fd);
+        return -1;
+    }
+    return 0;
+}
+
+
+void event_loop_stop_accepting(void) {
+    __atomic_store_n(&accepting, 0, __ATOMIC_RELAXED);
+}
+
+
+void event_loop_stop(void) {
+    for (int i = 0; i < num_loops; i++) {
+        close(loops[i].pipe_fds[1]);
+    }
+    for (int i = 0; i < num_loops; i++) {
+        pthread_join(loops[i].thread, NULL);
+        loop_release(&loops[i]);
+    }
+    free(loops);
+    loops = NULL;
+    num_loops = 0;
+}
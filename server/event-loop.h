@@ -0,0 +1,40 @@
+/**
+ * @file event-loop.h
+ * @brief epoll based connection handling for aesdsocket
+ *
+ * Instead of one thread per client, a small fixed number of loop threads service
+ * all connections using nonblocking sockets.  Each connection keeps its receive
+ * and framing state in a per-fd structure owned by exactly one loop thread.
+ */
+
+#ifndef AESDSOCKET_EVENT_LOOP_H
+#define AESDSOCKET_EVENT_LOOP_H
+
+/**
+ * Start @param nloops loop threads.
+ * @param listen_fds one listening socket per loop, each accepted on by its own loop thread
+ *        pinned to a CPU, or NULL to take clients from event_loop_add_client() only
+ * @param io_uring run the loops on io_uring, each falls back to epoll if it cannot set up a ring
+ * @return 0 on success, -1 on error
+ */
+int event_loop_start(int nloops, const int *listen_fds, int io_uring);
+
+/**
+ * Hand the accepted connection @param client_fd to one of the loop threads.
+ * The loop takes ownership of the descriptor, also on failure.
+ * @return 0 on success, -1 on error
+ */
+int event_loop_add_client(int client_fd);
+
+/**
+ * Stop accepting on the loops' own listening sockets, they stay open for another process
+ * to accept on.  The loops keep serving their connections.
+ */
+void event_loop_stop_accepting(void);
+
+/**
+ * Ask all loop threads to close their connections and wait for them to exit.
+ */
+void event_loop_stop(void);
+
+#endif /* AESDSOCKET_EVENT_LOOP_H */
@@ -0,0 +1,224 @@
+/**
+ * @file fair-queue.c
+ * @brief Fair scheduling of the clients writing to the aesdsocket store
+ *
+ * The turn to write is handed from one writer to the next rather than fought over: a
+ * writer finding it taken queues a waiter on its own stack and sleeps on the waiter's
+ * condition variable until the writer before it picks it in fair_queue_leave().  Every
+ * waiting client has at most one waiter, so the waiters are the lists of active flows:
+ * sparse flows are let in first, the others are taken round-robin.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "queue.h"
+#include "fair-queue.h"
+#include "metrics.h"
+#include "probes.h"
+
+struct waiter {
+    struct fq_flow *flow;
+    size_t len;
+    int granted;
+    pthread_cond_t cond;
+    TAILQ_ENTRY(waiter) entries;
+};
+
+static struct fair_queue_config config;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int busy;            // a writer has the turn
+static TAILQ_HEAD(waiter_list, waiter) sparse = TAILQ_HEAD_INITIALIZER(sparse);
+static struct waiter_list waiting = TAILQ_HEAD_INITIALIZER(waiting);
+static uint64_t busy_turns;     // turns handed out round-robin
+
+static __thread struct fq_flow *current;
+static __thread struct fq_flow own;     // the server's own writes on this thread
+
+
+void fair_queue_configure(const struct fair_queue_config *c) {
+    config = *c;
+    if (config.quantum == 0) config.quantum = FQ_DEFAULT_QUANTUM;
+}
+
+
+int fair_queue_limited(void) {
+    return config.byte_rate > 0 || config.packet_rate > 0;
+}
+
+
+static void bucket_fill(struct token_bucket *b, double rate, uint64_t now) {
+    b->level = rate * config.burst_ms / 1000;
+    b->updated = now;
+}
+
+
+static void bucket_refill(struct token_bucket *b, double rate, uint64_t now) {
+    double burst = rate * config.burst_ms / 1000;
+
+    b->level += rate * (now - b->updated) / 1e9;
+    if (b->level > burst) b->level = burst;
+    b->updated = now;
+}
+
+
+// @return nanoseconds until @param b is out of debt
+static uint64_t bucket_debt(struct token_bucket *b, double rate, uint64_t now) {
+    if (rate <= 0) return 0;
+    bucket_refill(b, rate, now);
+    return b->level >= 0 ? 0 : (uint64_t)(-b->level / rate * 1e9) + 1;
+}
+
+
+void fair_queue_flow_init(struct fq_flow *flow, int fd) {
+    uint64_t now = metrics_now();
+
+    flow->id = fd;
+    flow->limited = 1;
+    flow->deficit = 0;
+    flow->sparse_turn = UINT64_MAX;
+    flow->sparse_bytes = 0;
+    bucket_fill(&flow->bytes, config.byte_rate, now);
+    bucket_fill(&flow->packets, config.packet_rate, now);
+}
+
+
+void fair_queue_set_flow(struct fq_flow *flow) {
+    current = flow;
+}
+
+
+static struct fq_flow *flow(void) {
+    if (current) return current;
+    own.id = -1;
+    return &own;
+}
+
+
+uint64_t fair_queue_throttle(struct fq_flow *f) {
+    if (!f->limited || !fair_queue_limited()) return 0;
+
+    uint64_t now = metrics_now();
+    uint64_t bytes = bucket_debt(&f->bytes, config.byte_rate, now);
+    uint64_t packets = bucket_debt(&f->packets, config.packet_rate, now);
+    return bytes > packets ? bytes : packets;
+}
+
+
+void fair_queue_pay(void) {
+    uint64_t wait = fair_queue_throttle(flow());
+    if (wait == 0) return;
+
+    metrics_count(M_THROTTLED);
+    struct timespec ts = { .tv_sec = wait / 1000000000, .tv_nsec = wait % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR) {
+        continue;
+    }
+}
+
+
+void fair_queue_charge(size_t len) {
+    struct fq_flow *f = flow();
+    if (!f->limited) return;
+
+    if (config.byte_rate > 0) f->bytes.level -= len;
+    if (config.packet_rate > 0) f->packets.level -= 1;
+}
+
+
+// a whole round went by without a grant, skip ahead to the round the first waiter gets in
+static void skip_rounds(void) {
+    size_t rounds = SIZE_MAX;
+    struct waiter *w;
+
+    TAILQ_FOREACH(w, &waiting, entries) {
+        size_t needed = (w->len - w->flow->deficit + config.quantum - 1) / config.quantum;
+        if (needed < rounds) rounds = needed;
+    }
+    if (rounds <= 1) return;
+    TAILQ_FOREACH(w, &waiting, entries) {
+        w->flow->deficit += (rounds - 1) * config.quantum;
+    }
+}
+
+
+// deficit round-robin, @return the waiter to get the turn next, NULL if nobody waits
+static struct waiter *pick_next(void) {
+    struct waiter *w;
+    struct waiter *first = NULL;    // first waiter passed over in this round
+
+    if ((w = TAILQ_FIRST(&sparse))) {
+        TAILQ_REMOVE(&sparse, w, entries);
+        return w;
+    }
+
+    while ((w = TAILQ_FIRST(&waiting))) {
+        if (w == first) {
+            skip_rounds();
+            first = NULL;
+        }
+        TAILQ_REMOVE(&waiting, w, entries);
+        w->flow->deficit += config.quantum;
+        if (w->flow->deficit >= w->len) {
+            // the flow has nothing else waiting, credit is not kept while idle
+            w->flow->deficit = 0;
+            busy_turns++;
+            return w;
+        }
+        TAILQ_INSERT_TAIL(&waiting, w, entries);
+        if (!first) first = w;
+    }
+    return NULL;
+}
+
+
+void fair_queue_enter(size_t len) {
+    if (!config.fair) return;
+
+    uint64_t start = metrics_now();
+    struct waiter w = { .flow = flow(), .len = len, .granted = 0 };
+
+    pthread_mutex_lock(&lock);
+    if (!busy) {
+        busy = 1;
+    } else {
+        pthread_cond_init(&w.cond, NULL);
+        if (w.flow->sparse_turn != busy_turns) {
+            w.flow->sparse_turn = busy_turns;
+            w.flow->sparse_bytes = 0;
+        }
+        // up to a quantum per round-robin turn goes first, a flow writing more waits its turn
+        if (w.flow->sparse_bytes + len <= config.quantum) {
+            w.flow->sparse_bytes += len;
+            TAILQ_INSERT_TAIL(&sparse, &w, entries);
+        } else {
+            TAILQ_INSERT_TAIL(&waiting, &w, entries);
+        }
+        while (!w.granted) {
+            pthread_cond_wait(&w.cond, &lock);
+        }
+        pthread_cond_destroy(&w.cond);
+    }
+    pthread_mutex_unlock(&lock);
+
+    uint64_t wait = metrics_now() - start;
+    metrics_observe(H_QUEUE_WAIT, wait);
+    AESD_PROBE2(queue_wait, w.flow->id, wait);
+}
+
+
+void fair_queue_leave(void) {
+    if (!config.fair) return;
+
+    pthread_mutex_lock(&lock);
+    struct waiter *next = pick_next();
+    if (next) {
+        // the turn passes straight on, busy stays set
+        next->granted = 1;
+        pthread_cond_signal(&next->cond);
+    } else {
+        busy = 0;
+    }
+    pthread_mutex_unlock(&lock);
+}
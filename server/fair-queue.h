@@ -0,0 +1,115 @@
+/**
+ * @file fair-queue.h
+ * @brief Fair scheduling of the clients writing to the aesdsocket store
+ *
+ * Writers do not race for file_mutex any more, they line up here and are let in one at a
+ * time by deficit round-robin over the clients: every round each waiting client earns a
+ * quantum of bytes and writes once its credit covers its packet, so a client sending big
+ * packets gets its share of bytes but cannot hold everyone else up for long.  Like in
+ * FQ-CoDel sparse clients go first: between two turns taken round-robin every client
+ * may write up to a quantum ahead of the others.
+ *
+ * Every client can also be held to a byte rate and a packet rate by token buckets.
+ * A write may take a bucket below zero, the client then writes nothing more until the
+ * bucket refilled.  Connection threads sleep that off in store_append(), event loops ask
+ * with fair_queue_throttle() before handling a packet and park the connection meanwhile.
+ *
+ * The commit thread of group commit is the only writer to the store, with it packets
+ * are only held to the rates.
+ */
+
+#ifndef AESDSOCKET_FAIR_QUEUE_H
+#define AESDSOCKET_FAIR_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FQ_DEFAULT_QUANTUM 4096
+
+struct fair_queue_config {
+    /**
+     * Schedule the writers by deficit round-robin rather than let them race for the lock
+     */
+    int fair;
+    /**
+     * Bytes a waiting client earns per round
+     */
+    size_t quantum;
+    /**
+     * Bytes and packets per second a client may write, 0 for no limit
+     */
+    double byte_rate;
+    double packet_rate;
+    /**
+     * How many milliseconds at the full rate a client may write in one burst
+     */
+    long burst_ms;
+};
+
+struct token_bucket {
+    double level;           // below zero while the client is in debt
+    uint64_t updated;
+};
+
+/**
+ * One client's place in the scheduler.  A flow is only used by one thread at a time,
+ * its connection handles one packet after the other.
+ */
+struct fq_flow {
+    int id;                 // the client's descriptor, for the probes
+    int limited;            // held to the configured rates
+    size_t deficit;         // bytes earned while waiting
+    uint64_t sparse_turn;   // round-robin turns handed out when sparse_bytes were counted
+    size_t sparse_bytes;    // bytes written ahead of the others since then
+    struct token_bucket bytes;
+    struct token_bucket packets;
+};
+
+/**
+ * Set the scheduling and rates.  Call before any client is accepted.
+ */
+void fair_queue_configure(const struct fair_queue_config *config);
+
+/**
+ * @return nonzero if clients are held to a rate
+ */
+int fair_queue_limited(void);
+
+/**
+ * Prepare @param flow for the client on @param fd, with full buckets.
+ */
+void fair_queue_flow_init(struct fq_flow *flow, int fd);
+
+/**
+ * Account the writes of the calling thread to @param flow from now on, NULL for writes
+ * of the server itself, which are never held to a rate.
+ */
+void fair_queue_set_flow(struct fq_flow *flow);
+
+/**
+ * @return nanoseconds until @param flow may write again, 0 if it may write now
+ */
+uint64_t fair_queue_throttle(struct fq_flow *flow);
+
+/**
+ * Sleep until the calling thread's flow paid off its debt.  A cancellation point.
+ */
+void fair_queue_pay(void);
+
+/**
+ * Charge the calling thread's flow for writing one packet of @param len bytes.
+ */
+void fair_queue_charge(size_t len);
+
+/**
+ * Wait for the calling thread's turn to write @param len bytes.  Every call is followed
+ * by fair_queue_leave().  Returns right away unless fair scheduling is configured.
+ */
+void fair_queue_enter(size_t len);
+
+/**
+ * Hand the turn to the next waiting writer.
+ */
+void fair_queue_leave(void);
+
+#endif /* AESDSOCKET_FAIR_QUEUE_H */
@@ -0,0 +1,295 @@
+/**
+ * @file handoff.c
+ * @brief Hot restart of aesdsocket by passing the listening sockets on
+ *
+ * The old process sends one message carrying the number of sockets and the sockets
+ * themselves.  The new process answers HANDOFF_READY once it is about to accept, the old
+ * one answers HANDOFF_RELEASED after closing its store.  The new process hanging up
+ * before it is ready, because it failed to start, leaves the old one serving as before.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+#define HANDOFF_MAGIC 0x61657364    // "aesd"
+#define HANDOFF_READY 'R'
+#define HANDOFF_RELEASED 'D'
+
+struct handoff_header {
+    uint32_t magic;
+    uint32_t count;         // descriptors passed along
+};
+
+// new process: the server the sockets were taken from
+static int old_fd = -1;
+
+// old process: the handoff socket and the server the sockets were passed on to
+static int serve_fd = -1;
+static char serve_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static struct stat serve_stat;
+static pthread_t serve_thread;
+static const int *serve_fds;
+static int serve_nfds;
+static void (*serve_stop)(void);
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int pending_fd = -1;     // a new process getting the sockets
+static int stopping;
+static int new_fd = -1;
+static int done;            // the sockets were passed on
+
+
+static int set_path(struct sockaddr_un *addr, const char *path) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        syslog(LOG_ERR, "Handoff socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+
+// @return the next byte from @param fd, -1 on EOF or error
+static int read_byte(int fd) {
+    char c;
+    ssize_t n;
+
+    while ((n = read(fd, &c, 1)) == -1 && errno == EINTR) {
+        continue;
+    }
+    return n == 1 ? c : -1;
+}
+
+
+int handoff_take(const char *path, int *fds, int max_fds) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (set_path(&addr, path) == -1) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to create handoff socket: %s", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int err = errno;
+        close(fd);
+        // nobody to take over from, a plain start
+        if (err == ENOENT || err == ECONNREFUSED) return 0;
+        syslog(LOG_ERR, "Failed to connect to handoff socket %s: %s", path, strerror(err));
+        return -1;
+    }
+
+    struct handoff_header hdr;
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    union {
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t n;
+    while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+        continue;
+    }
+
+    int received = 0;
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    }
+    int *passed = received ? (int *)CMSG_DATA(cmsg) : NULL;
+    if (n != sizeof(hdr) || hdr.magic != HANDOFF_MAGIC || hdr.count != (uint32_t)received ||
+        received == 0 || received > max_fds || (msg.msg_flags & MSG_CTRUNC)) {
+        syslog(LOG_ERR, "Invalid handoff from %s", path);
+        for (int i = 0; i < received; i++) {
+            close(passed[i]);
+        }
+        close(fd);
+        return -1;
+    }
+
+    memcpy(fds, passed, received * sizeof(int));
+    old_fd = fd;
+    syslog(LOG_INFO, "Took over %d listening sockets", received);
+    return received;
+}
+
+
+void handoff_ready(int wait_release) {
+    if (old_fd == -1) return;
+
+    char c = HANDOFF_READY;
+    if (write(old_fd, &c, 1) != 1) {
+        syslog(LOG_ERR, "Failed to tell the old server to stop accepting: %s", strerror(errno));
+    } else if (wait_release) {
+        // released, or the old server is gone
+        read_byte(old_fd);
+    }
+    close(old_fd);
+    old_fd = -1;
+}
+
+
+static int pass_sockets(int fd) {
+    struct handoff_header hdr = { .magic = HANDOFF_MAGIC, .count = serve_nfds };
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    union {
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(serve_nfds * sizeof(int)),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(serve_nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), serve_fds, serve_nfds * sizeof(int));
+
+    ssize_t n;
+    while ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+        continue;
+    }
+    return n == sizeof(hdr) ? 0 : -1;
+}
+
+
+static void *serve_handoff(void *arg) {
+    for (;;) {
+        int fd = accept4(serve_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;  // shut down by handoff_serve_stop()
+        }
+
+        pthread_mutex_lock(&lock);
+        if (stopping) {
+            pthread_mutex_unlock(&lock);
+            close(fd);
+            break;
+        }
+        pending_fd = fd;
+        pthread_mutex_unlock(&lock);
+
+        // from here on the new process may be accepting on the sockets
+        __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+        int ready = pass_sockets(fd) == 0 && read_byte(fd) == HANDOFF_READY;
+
+        pthread_mutex_lock(&lock);
+        pending_fd = -1;
+        pthread_mutex_unlock(&lock);
+
+        if (ready) {
+            syslog(LOG_INFO, "Listening sockets taken over, draining connections");
+            new_fd = fd;
+            serve_stop();
+            break;
+        }
+        syslog(LOG_ERR, "New server gave up before accepting, still serving");
+        __atomic_store_n(&done, 0, __ATOMIC_RELEASE);
+        close(fd);
+    }
+    return NULL;
+}
+
+
+int handoff_serve_start(const char *path, const int *fds, int nfds, void (*stop)(void)) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (set_path(&addr, path) == -1) return -1;
+    if (nfds > HANDOFF_MAX_FDS) {
+        syslog(LOG_ERR, "Too many listening sockets to hand off: %d", nfds);
+        return -1;
+    }
+
+    serve_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (serve_fd == -1) {
+        syslog(LOG_ERR, "Failed to create handoff socket: %s", strerror(errno));
+        return -1;
+    }
+    // the socket of the process taken over from, or left behind by an earlier run
+    unlink(path);
+    if (bind(serve_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(serve_fd, 1) == -1) {
+        syslog(LOG_ERR, "Failed to listen on handoff socket %s: %s", path, strerror(errno));
+        close(serve_fd);
+        serve_fd = -1;
+        return -1;
+    }
+    strcpy(serve_path, path);
+    stat(serve_path, &serve_stat);
+    serve_fds = fds;
+    serve_nfds = nfds;
+    serve_stop = stop;
+
+    // the handoff thread never handles SIGINT/SIGTERM, the accept loop in main has to see them
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int rc = pthread_create(&serve_thread, NULL, serve_handoff, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0) {
+        syslog(LOG_ERR, "Failed to create handoff thread");
+        close(serve_fd);
+        serve_fd = -1;
+        unlink(serve_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+int handoff_done(void) {
+    return __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+}
+
+
+void handoff_serve_stop(void) {
+    if (serve_fd == -1) return;
+
+    // a new process half way through the handoff gets nothing
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    if (pending_fd != -1) shutdown(pending_fd, SHUT_RDWR);
+    pthread_mutex_unlock(&lock);
+
+    shutdown(serve_fd, SHUT_RDWR);
+    pthread_join(serve_thread, NULL);
+    close(serve_fd);
+    serve_fd = -1;
+    // after a handoff the path is the new process's socket
+    struct stat st;
+    if (stat(serve_path, &st) == 0 && st.st_dev == serve_stat.st_dev && st.st_ino == serve_stat.st_ino) {
+        unlink(serve_path);
+    }
+}
+
+
+void handoff_release(void) {
+    if (new_fd == -1) return;
+
+    // the new process only waits for it with a store one process may have open
+    char c = HANDOFF_RELEASED;
+    if (send(new_fd, &c, 1, MSG_NOSIGNAL) == -1 && errno != EPIPE && errno != ECONNRESET) {
+        syslog(LOG_ERR, "Failed to release the store: %s", strerror(errno));
+    }
+    close(new_fd);
+    new_fd = -1;
+}
@@ -0,0 +1,60 @@
+/**
+ * @file handoff.h
+ * @brief Hot restart of aesdsocket by passing the listening sockets on
+ *
+ * A running server listens on a Unix socket for its successor.  The new process connects,
+ * receives the listening sockets with SCM_RIGHTS and says when it is ready to accept on
+ * them.  The old process then stops accepting and lets its connections finish while the
+ * new one takes the clients, the port is never closed so nobody is refused.  Connections
+ * are not passed on, their partial packets, read-backs and subscriptions live in the old
+ * process.
+ *
+ * A store only one process may have open is passed on too: the new process waits until
+ * the old one closed it before opening it itself.
+ */
+
+#ifndef AESDSOCKET_HANDOFF_H
+#define AESDSOCKET_HANDOFF_H
+
+#define HANDOFF_MAX_FDS 64
+
+/**
+ * Take the listening sockets over from the server at @param path.
+ * @param fds receives up to @param max_fds descriptors
+ * @return the number of sockets received, 0 if no server is running at @param path,
+ *         -1 on error
+ */
+int handoff_take(const char *path, int *fds, int max_fds);
+
+/**
+ * Tell the old server the new one is about to accept, it stops accepting.  Nothing to do
+ * unless handoff_take() received sockets.
+ * @param wait_release also wait until the old server closed its store
+ */
+void handoff_ready(int wait_release);
+
+/**
+ * Pass the @param nfds listening sockets in @param fds on to the next process connecting
+ * to the Unix socket at @param path.  Once it is ready @param stop is called on the
+ * handoff thread to stop accepting.
+ * @return 0 on success, -1 on error
+ */
+int handoff_serve_start(const char *path, const int *fds, int nfds, void (*stop)(void));
+
+/**
+ * @return nonzero once the listening sockets were passed on to another process, which
+ *         may be accepting on them.  The sockets must not be shut down any more.
+ */
+int handoff_done(void);
+
+/**
+ * Stop serving the handoff socket and remove it unless another process took it over.
+ */
+void handoff_serve_stop(void);
+
+/**
+ * Let the new process open the store, call after closing it.
+ */
+void handoff_release(void);
+
+#endif /* AESDSOCKET_HANDOFF_H */
@@ -0,0 +1,182 @@
+/**
+ * @file line-stream.c
+ * @brief Receive buffer that splits a byte stream into newline terminated packets
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "aesdsocket.h"
+#include "line-stream.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define LINE_SCAN_X86
+#include <immintrin.h>
+#endif
+
+static size_t (*scan_impl)(const char *buf, size_t len, uint32_t *ends, size_t max);
+
+
+// store the ends of the newlines in buf[from..len) after the @param n already found
+static size_t scan_tail(const char *buf, size_t from, size_t len, uint32_t *ends, size_t n, size_t max) {
+    const char *p = buf + from;
+    const char *end = buf + len;
+
+    while (n < max && p < end) {
+        const char *newline = memchr(p, '\n', end - p);
+        if (!newline) break;
+        p = newline + 1;
+        ends[n++] = p - buf;
+    }
+    return n;
+}
+
+
+static size_t scan_scalar(const char *buf, size_t len, uint32_t *ends, size_t max) {
+    return scan_tail(buf, 0, len, ends, 0, max);
+}
+
+
+#ifdef LINE_SCAN_X86
+static size_t scan_sse2(const char *buf, size_t len, uint32_t *ends, size_t max) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t n = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        // one bit per newline in the vector, lowest first
+        while (mask) {
+            ends[n++] = i + __builtin_ctz(mask) + 1;
+            if (n == max) return n;
+            mask &= mask - 1;
+        }
+    }
+    return scan_tail(buf, i, len, ends, n, max);
+}
+
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t len, uint32_t *ends, size_t max) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t n = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        while (mask) {
+            ends[n++] = i + __builtin_ctz(mask) + 1;
+            if (n == max) return n;
+            mask &= mask - 1;
+        }
+    }
+    return scan_tail(buf, i, len, ends, n, max);
+}
+#endif
+
+
+void line_scan_init(void) {
+    const char *name = "scalar";
+
+    scan_impl = scan_scalar;
+#ifdef LINE_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_impl = scan_avx2;
+        name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_impl = scan_sse2;
+        name = "sse2";
+    }
+#endif
+    syslog(LOG_DEBUG, "Using the %s newline scan", name);
+}
+
+
+size_t line_scan(const char *buf, size_t len, uint32_t *ends, size_t max) {
+    if (max == 0) return 0;
+    return scan_impl ? scan_impl(buf, len, ends, max) : scan_scalar(buf, len, ends, max);
+}
+
+
+void line_stream_init(struct line_stream *ls) {
+    memset(ls, 0, sizeof(*ls));
+}
+
+
+void line_stream_free(struct line_stream *ls) {
+    free(ls->buf);
+    line_stream_init(ls);
+}
+
+
+void line_stream_reset(struct line_stream *ls, size_t keep) {
+    char *buf = ls->buf;
+    size_t cap = ls->cap;
+
+    if (cap > keep) {
+        free(buf);
+        buf = NULL;
+        cap = 0;
+    }
+    line_stream_init(ls);
+    ls->buf = buf;
+    ls->cap = cap;
+}
+
+
+char *line_stream_space(struct line_stream *ls, size_t max, size_t *room) {
+    *room = 0;
+
+    // move the unconsumed bytes to the front, the recorded ends move with them
+    if (ls->off > 0) {
+        memmove(ls->buf, ls->buf + ls->off, ls->len - ls->off);
+        for (unsigned int i = ls->next; i < ls->nends; i++) ls->ends[i] -= ls->off;
+        ls->scanned -= ls->off;
+        ls->len -= ls->off;
+        ls->off = 0;
+    }
+
+    if (ls->len == ls->cap) {
+        if (ls->cap >= max) return NULL;
+        size_t cap = ls->cap ? ls->cap * 2 : BUFFER_SIZE;
+        if (cap > max) cap = max;
+        char *buf = realloc(ls->buf, cap);
+        if (!buf) {
+            syslog(LOG_ERR, "Failed to grow receive buffer");
+            return NULL;
+        }
+        ls->buf = buf;
+        ls->cap = cap;
+    }
+
+    *room = ls->cap - ls->len;
+    return ls->buf + ls->len;
+}
+
+
+int line_stream_next(struct line_stream *ls, const char **packet, size_t *len) {
+    if (ls->next == ls->nends) {
+        // record every packet end in the bytes received since the last scan
+        ls->next = 0;
+        ls->nends = line_scan(ls->buf + ls->scanned, ls->len - ls->scanned, ls->ends, LINE_STREAM_BATCH);
+        for (unsigned int i = 0; i < ls->nends; i++) ls->ends[i] += ls->scanned;
+        ls->scanned = ls->nends == LINE_STREAM_BATCH ? ls->ends[LINE_STREAM_BATCH - 1] : ls->len;
+        if (ls->nends == 0) return 0;
+    }
+
+    size_t end = ls->ends[ls->next++];
+    *packet = ls->buf + ls->off;
+    *len = end - ls->off;
+    ls->off = end;
+    return 1;
+}
+
+
+void line_stream_consume(struct line_stream *ls, size_t n) {
+    ls->off += n;
+    while (ls->next < ls->nends && ls->ends[ls->next] <= ls->off) ls->next++;
+    if (ls->scanned < ls->off) ls->scanned = ls->off;
+}
@@ -0,0 +1,96 @@
+/**
+ * @file line-stream.h
+ * @brief Receive buffer that splits a byte stream into newline terminated packets
+ *
+ * Received bytes are searched for newlines a whole vector at a time, SSE2 or AVX2 on
+ * x86 and a portable scan elsewhere.  One pass over a received batch records the end of
+ * every packet in it, so pipelined packets are handed out without scanning again, and
+ * bytes of an unfinished packet are never searched twice while the rest trickles in.
+ */
+
+#ifndef AESDSOCKET_LINE_STREAM_H
+#define AESDSOCKET_LINE_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LINE_STREAM_BATCH 64    // packet ends recorded per scan
+
+struct line_stream {
+    /**
+     * Received bytes, buf[off..len) have not been consumed yet
+     */
+    char *buf;
+    size_t off;
+    size_t len;
+    size_t cap;
+    /**
+     * buf[scanned..len) has not been searched for newlines yet
+     */
+    size_t scanned;
+    /**
+     * Offsets just past the newlines found by the last scan, ends[next..nends) are unused
+     */
+    uint32_t ends[LINE_STREAM_BATCH];
+    unsigned int next;
+    unsigned int nends;
+};
+
+/**
+ * Pick the fastest newline scan the CPU supports.  Call once before any other thread starts.
+ */
+void line_scan_init(void);
+
+/**
+ * Find the newlines in @param buf.
+ * @param ends set to the offsets just past the first @param max newlines
+ * @return the number of offsets stored
+ */
+size_t line_scan(const char *buf, size_t len, uint32_t *ends, size_t max);
+
+void line_stream_init(struct line_stream *ls);
+
+void line_stream_free(struct line_stream *ls);
+
+/**
+ * Drop all received bytes, keeping the buffer for reuse unless it grew beyond @param keep bytes.
+ */
+void line_stream_reset(struct line_stream *ls, size_t keep);
+
+/**
+ * Make room for more received bytes, growing the buffer up to @param max bytes.
+ * @param room set to the free space at the returned pointer
+ * @return where to receive into, NULL if the buffer already holds @param max unconsumed
+ *         bytes or could not grow
+ */
+char *line_stream_space(struct line_stream *ls, size_t max, size_t *room);
+
+/**
+ * Account for @param n bytes received into the space from line_stream_space().
+ */
+static inline void line_stream_received(struct line_stream *ls, size_t n) {
+    ls->len += n;
+}
+
+/**
+ * Take the next complete packet, newline included.  It stays valid until the next
+ * call to line_stream_space().
+ * @return 1 if a packet was found, 0 if the stream holds no complete packet
+ */
+int line_stream_next(struct line_stream *ls, const char **packet, size_t *len);
+
+/**
+ * @param avail set to the number of unconsumed bytes
+ * @return the unconsumed bytes
+ */
+static inline const char *line_stream_data(const struct line_stream *ls, size_t *avail) {
+    *avail = ls->len - ls->off;
+    return ls->buf + ls->off;
+}
+
+/**
+ * Consume @param n bytes without framing them on newlines.
+ */
+void line_stream_consume(struct line_stream *ls, size_t n);
+
+#endif /* AESDSOCKET_LINE_STREAM_H */
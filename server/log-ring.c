@@ -0,0 +1,236 @@
+/**
+ * @file log-ring.c
+ * @brief Asynchronous logging for the aesdsocket hot paths
+ *
+ * The ring is a bounded multi-producer queue where every record carries a sequence number:
+ * a producer claims the next position with a compare-and-swap on the tail and publishes
+ * the record by advancing its sequence, the drainer takes records whose sequence shows
+ * they are published.  A producer finding the ring full drops its record and counts it.
+ * The drainer is not woken by producers, it looks every LOG_RING_DRAIN_MS, so posting
+ * a record never makes a system call.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+#include "log-ring.h"
+
+struct log_record {
+    uint64_t seq;
+    int msg;
+    int err;
+    char str[LOG_RING_STR_MAX];
+};
+
+struct log_type {
+    const char *name;       // reported with the number of dropped messages
+    int level;
+    const char *text;       // formatted with the string, the errno text or nothing
+    enum { ARG_NONE, ARG_STR, ARG_ERRNO } arg;
+};
+
+static const struct log_type types[LOG_MSG_COUNT] = {
+    [LOG_MSG_ACCEPTED] = { "accept", LOG_INFO, "Accepted connection from %s", ARG_STR },
+    [LOG_MSG_DISCONNECTED] = { "disconnect", LOG_INFO, "Client disconnected", ARG_NONE },
+    [LOG_MSG_SUBSCRIBER_LEFT] = { "subscriber disconnect", LOG_INFO, "Subscriber disconnected", ARG_NONE },
+    [LOG_MSG_RECV_FAILED] = { "receive error", LOG_ERR, "Failed to receive data: %s", ARG_ERRNO },
+    [LOG_MSG_SEND_FAILED] = { "send error", LOG_ERR, "Failed to send data: %s", ARG_ERRNO },
+    [LOG_MSG_MALFORMED_FRAME] = { "malformed frame", LOG_ERR, "Malformed binary frame from client", ARG_NONE },
+    [LOG_MSG_FRAME_TOO_LARGE] = { "frame too large", LOG_ERR, "Binary frame too large", ARG_NONE },
+    [LOG_MSG_REJECTED] = { "rejected client", LOG_ERR, "Server at capacity, rejecting client", ARG_NONE },
+    [LOG_MSG_IDLE_TIMEOUT] = { "idle timeout", LOG_INFO, "Closing idle client", ARG_NONE },
+    [LOG_MSG_SLOW_READER] = { "slow reader", LOG_INFO, "Closing client not reading its responses", ARG_NONE },
+    [LOG_MSG_BAD_COMMAND] = { "invalid command", LOG_ERR, "Invalid %s command format from client", ARG_STR },
+    [LOG_MSG_BAD_SEEK] = { "invalid seek", LOG_ERR, "Invalid seek to %s", ARG_STR },
+    [LOG_MSG_BAD_OPCODE] = { "unknown opcode", LOG_ERR, "Unknown binary opcode %s", ARG_STR },
+    [LOG_MSG_READ_FAILED] = { "read error", LOG_ERR, "Failed to read file for response: %s", ARG_ERRNO },
+    [LOG_MSG_STORE_SHRANK] = { "store shrank", LOG_ERR, "Store shrank while sending a framed response", ARG_NONE },
+    [LOG_MSG_WAKE_FAILED] = { "wake error", LOG_ERR, "Failed to wake subscriber: %s", ARG_ERRNO },
+    [LOG_MSG_SUBSCRIBER_DROPPED] = { "subscriber dropped", LOG_INFO, "Dropping subscriber %s bytes behind", ARG_STR },
+    [LOG_MSG_SUBSCRIBER_RESYNC] = { "subscriber resync", LOG_DEBUG, "Resyncing subscriber, skipped %s bytes", ARG_STR },
+    [LOG_MSG_SUBSCRIBER_SEND_FAILED] = { "subscriber send error", LOG_ERR, "Failed to send to subscriber: %s", ARG_ERRNO },
+};
+
+static struct log_record ring[LOG_RING_SIZE];
+static uint64_t tail __attribute__((aligned(64)));     // next position producers claim
+static uint64_t head __attribute__((aligned(64)));     // next position the drainer takes
+
+// records a producer found no room for, per type
+static uint64_t ring_dropped[LOG_MSG_COUNT];
+
+// drainer state
+static uint64_t rate_dropped[LOG_MSG_COUNT];
+static unsigned int sent_this_second[LOG_MSG_COUNT];
+static time_t current_second;
+
+static int started;
+static int stop_fd = -1;
+static pthread_t drain_thread;
+
+
+static void forward(int msg, int err, const char *str) {
+    const struct log_type *t = &types[msg];
+
+    switch (t->arg) {
+        case ARG_STR:
+            syslog(t->level, t->text, str);
+            break;
+        case ARG_ERRNO:
+            syslog(t->level, t->text, strerror(err));
+            break;
+        default:
+            syslog(t->level, "%s", t->text);
+            break;
+    }
+}
+
+
+// forward the record if its type is within the rate of the current second
+static void forward_limited(const struct log_record *rec) {
+    if (sent_this_second[rec->msg] >= LOG_RING_RATE) {
+        rate_dropped[rec->msg]++;
+        return;
+    }
+    sent_this_second[rec->msg]++;
+    forward(rec->msg, rec->err, rec->str);
+}
+
+
+static void report_dropped(void) {
+    for (int msg = 0; msg < LOG_MSG_COUNT; msg++) {
+        uint64_t dropped = rate_dropped[msg] + __atomic_exchange_n(&ring_dropped[msg], 0, __ATOMIC_RELAXED);
+        rate_dropped[msg] = 0;
+        if (dropped) {
+            syslog(LOG_WARNING, "Dropped %" PRIu64 " %s messages", dropped, types[msg].name);
+        }
+    }
+}
+
+
+// hand every published record to syslog
+static void drain(void) {
+    time_t now = time(NULL);
+    if (now != current_second) {
+        report_dropped();
+        memset(sent_this_second, 0, sizeof(sent_this_second));
+        current_second = now;
+    }
+
+    for (;;) {
+        struct log_record *rec = &ring[head % LOG_RING_SIZE];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != head + 1) break;
+
+        forward_limited(rec);
+        // free the slot for the producer coming around the ring next
+        __atomic_store_n(&rec->seq, head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        head++;
+    }
+}
+
+
+static void *drain_thread_fn(void *arg) {
+    struct pollfd pfd = { .fd = stop_fd, .events = POLLIN };
+
+    for (;;) {
+        drain();
+        int n = poll(&pfd, 1, LOG_RING_DRAIN_MS);
+        if (n > 0) break;
+        if (n == -1 && errno != EINTR) {
+            syslog(LOG_ERR, "poll failed: %s", strerror(errno));
+            break;
+        }
+    }
+    drain();
+    report_dropped();
+    return NULL;
+}
+
+
+int log_ring_start(void) {
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+        ring[i].seq = i;
+    }
+    head = tail = 0;
+
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd == -1) {
+        syslog(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    // the drainer never handles SIGINT/SIGTERM, the accept loop in main has to see them
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int rc = pthread_create(&drain_thread, NULL, drain_thread_fn, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0) {
+        syslog(LOG_ERR, "Failed to create log drainer thread");
+        close(stop_fd);
+        stop_fd = -1;
+        return -1;
+    }
+    __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+void log_ring_post(enum log_msg msg, int err, const char *str) {
+    if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+        forward(msg, err, str);
+        return;
+    }
+
+    uint64_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    struct log_record *rec;
+    for (;;) {
+        rec = &ring[pos % LOG_RING_SIZE];
+        uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (seq < pos) {
+            // the drainer has not freed this slot from the previous lap, the ring is full
+            __atomic_fetch_add(&ring_dropped[msg], 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    rec->msg = msg;
+    rec->err = err;
+    if (str) {
+        strncpy(rec->str, str, sizeof(rec->str) - 1);
+        rec->str[sizeof(rec->str) - 1] = '\0';
+    } else {
+        rec->str[0] = '\0';
+    }
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+void log_ring_stop(void) {
+    if (!started) return;
+
+    // later messages go straight to syslog, the drainer takes what was posted before
+    __atomic_store_n(&started, 0, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) == -1) {
+        syslog(LOG_ERR, "Failed to stop log drainer: %s", strerror(errno));
+    }
+    pthread_join(drain_thread, NULL);
+    close(stop_fd);
+    stop_fd = -1;
+}
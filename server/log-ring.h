@@ -0,0 +1,64 @@
+/**
+ * @file log-ring.h
+ * @brief Asynchronous logging for the aesdsocket hot paths
+ *
+ * Connection threads and event loops append small binary records to a bounded lock-free
+ * ring instead of calling syslog() themselves, which would format the message and make a
+ * system call, possibly while holding a lock.  A drainer thread picks the records up a few
+ * times a second, formats them and forwards them to syslog.
+ *
+ * Every message type is rate limited on its own.  Records lost because the ring was full
+ * or over the rate are counted per type and reported by the drainer once a second.
+ */
+
+#ifndef AESDSOCKET_LOG_RING_H
+#define AESDSOCKET_LOG_RING_H
+
+#define LOG_RING_SIZE 4096      // records, a power of two
+#define LOG_RING_DRAIN_MS 100
+#define LOG_RING_RATE 200       // messages of a type forwarded per second at most
+#define LOG_RING_STR_MAX 48     // fits an IPv6 address
+
+enum log_msg {
+    LOG_MSG_ACCEPTED,           // str: the client address
+    LOG_MSG_DISCONNECTED,
+    LOG_MSG_SUBSCRIBER_LEFT,
+    LOG_MSG_RECV_FAILED,        // err
+    LOG_MSG_SEND_FAILED,        // err
+    LOG_MSG_MALFORMED_FRAME,
+    LOG_MSG_FRAME_TOO_LARGE,
+    LOG_MSG_REJECTED,           // over the admission limits or out of connection slots
+    LOG_MSG_IDLE_TIMEOUT,
+    LOG_MSG_SLOW_READER,
+    LOG_MSG_BAD_COMMAND,        // str: the command name
+    LOG_MSG_BAD_SEEK,           // str: the seek arguments
+    LOG_MSG_BAD_OPCODE,         // str: the binary opcode
+    LOG_MSG_READ_FAILED,        // err, reading the store for a response
+    LOG_MSG_STORE_SHRANK,
+    LOG_MSG_WAKE_FAILED,        // err
+    LOG_MSG_SUBSCRIBER_DROPPED, // str: the bytes it was behind
+    LOG_MSG_SUBSCRIBER_RESYNC,  // str: the bytes skipped
+    LOG_MSG_SUBSCRIBER_SEND_FAILED, // err
+    LOG_MSG_COUNT,
+};
+
+/**
+ * Start the drainer thread.  Until then, and after log_ring_stop(), messages are sent to
+ * syslog right away.
+ * @return 0 on success, -1 on error
+ */
+int log_ring_start(void);
+
+/**
+ * Log @param msg without waiting for syslog.
+ * @param err the errno value for messages that report one, 0 otherwise
+ * @param str the string argument for messages that take one, NULL otherwise
+ */
+void log_ring_post(enum log_msg msg, int err, const char *str);
+
+/**
+ * Forward every record still in the ring and stop the drainer thread.
+ */
+void log_ring_stop(void);
+
+#endif /* AESDSOCKET_LOG_RING_H */
@@ -0,0 +1,233 @@
+/**
+ * @file metrics.c
+ * @brief Counters and latency histograms for aesdsocket
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include "metrics.h"
+
+struct hist {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t sum_ns;
+    uint64_t count;
+};
+
+struct shard {
+    uint64_t counters[M_COUNTERS];
+    struct hist hists[M_HISTS];
+} __attribute__((aligned(64)));
+
+static struct shard shards[METRICS_SHARDS];
+static unsigned int next_shard;
+static __thread struct shard *own;
+static __thread uint64_t received_ns;
+
+static const char *const counter_names[M_COUNTERS] = {
+    [M_CONNECTIONS] = "connections_total",
+    [M_DISCONNECTS] = "disconnects_total",
+    [M_PACKETS] = "packets_total",
+    [M_BYTES_IN] = "bytes_in_total",
+    [M_BYTES_OUT] = "bytes_out_total",
+    [M_ERRORS] = "errors_total",
+    [M_REJECTED] = "rejected_total",
+    [M_TIMEOUTS] = "timeouts_total",
+    [M_THROTTLED] = "throttled_total",
+};
+
+static const char *const hist_names[M_HISTS] = {
+    [H_RECV_COMMIT] = "recv_commit_seconds",
+    [H_LOCK_WAIT] = "lock_wait_seconds",
+    [H_WRITE] = "write_seconds",
+    [H_READBACK] = "readback_seconds",
+    [H_SEND] = "send_seconds",
+    [H_QUEUE_WAIT] = "queue_wait_seconds",
+};
+
+static int serve_fd = -1;
+static char serve_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static pthread_t serve_thread;
+static struct stat serve_stat;     // the socket file bound at serve_path
+
+
+static struct shard *shard(void) {
+    if (!own) own = &shards[__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % METRICS_SHARDS];
+    return own;
+}
+
+
+void metrics_add(enum metrics_counter counter, uint64_t n) {
+    __atomic_fetch_add(&shard()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+
+void metrics_observe(enum metrics_hist hist, uint64_t ns) {
+    struct hist *h = &shard()->hists[hist];
+    uint64_t scaled = ns >> METRICS_MIN_SHIFT;
+    int bucket = scaled ? 64 - __builtin_clzll(scaled) : 0;
+
+    if (bucket >= METRICS_BUCKETS) bucket = METRICS_BUCKETS - 1;
+    __atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+
+void metrics_mark_received(uint64_t ns) {
+    received_ns = ns;
+}
+
+
+uint64_t metrics_received(void) {
+    return received_ns;
+}
+
+
+static uint64_t sum(const uint64_t *first) {
+    size_t offset = (const char *)first - (const char *)&shards[0];
+    uint64_t total = 0;
+
+    for (int i = 0; i < METRICS_SHARDS; i++) {
+        total += __atomic_load_n((const uint64_t *)((const char *)&shards[i] + offset), __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+
+static void write_hist(FILE *out, enum metrics_hist hist) {
+    const struct hist *h = &shards[0].hists[hist];
+    const char *name = hist_names[hist];
+    uint64_t cumulative = 0;
+
+    fprintf(out, "# TYPE aesdsocket_%s histogram\n", name);
+    // the last bucket also holds everything longer, it only shows up as +Inf
+    for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+        cumulative += sum(&h->buckets[b]);
+        fprintf(out, "aesdsocket_%s_bucket{le=\"%g\"} %" PRIu64 "\n", name,
+                (double)(1ULL << (METRICS_MIN_SHIFT + b)) / 1e9, cumulative);
+    }
+    fprintf(out, "aesdsocket_%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, sum(&h->count));
+    fprintf(out, "aesdsocket_%s_sum %.9f\n", name, sum(&h->sum_ns) / 1e9);
+    fprintf(out, "aesdsocket_%s_count %" PRIu64 "\n", name, sum(&h->count));
+}
+
+
+int metrics_write(int fd) {
+    char *text;
+    size_t len;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) {
+        syslog(LOG_ERR, "Failed to format metrics: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int c = 0; c < M_COUNTERS; c++) {
+        fprintf(out, "# TYPE aesdsocket_%s counter\n", counter_names[c]);
+        fprintf(out, "aesdsocket_%s %" PRIu64 "\n", counter_names[c], sum(&shards[0].counters[c]));
+    }
+    for (int h = 0; h < M_HISTS; h++) {
+        write_hist(out, h);
+    }
+    if (fclose(out) != 0) {
+        syslog(LOG_ERR, "Failed to format metrics");
+        return -1;
+    }
+
+    int ret = 0;
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = write(fd, text + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "Failed to write metrics: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+        done += n;
+    }
+    free(text);
+    return ret;
+}
+
+
+static void *serve_metrics(void *arg) {
+    for (;;) {
+        int fd = accept4(serve_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;  // shut down by metrics_serve_stop()
+        }
+        metrics_write(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+
+int metrics_serve_start(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "Metrics socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    serve_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (serve_fd == -1) {
+        syslog(LOG_ERR, "Failed to create metrics socket: %s", strerror(errno));
+        return -1;
+    }
+    // a socket left behind by an earlier run would make bind() fail
+    unlink(path);
+    if (bind(serve_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(serve_fd, 4) == -1) {
+        syslog(LOG_ERR, "Failed to listen on metrics socket %s: %s", path, strerror(errno));
+        close(serve_fd);
+        serve_fd = -1;
+        return -1;
+    }
+    strcpy(serve_path, path);
+    stat(serve_path, &serve_stat);
+
+    // the metrics thread never handles SIGINT/SIGTERM, the accept loop in main has to see them
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int rc = pthread_create(&serve_thread, NULL, serve_metrics, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0) {
+        syslog(LOG_ERR, "Failed to create metrics thread");
+        close(serve_fd);
+        serve_fd = -1;
+        unlink(serve_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+void metrics_serve_stop(void) {
+    if (serve_fd == -1) return;
+
+    shutdown(serve_fd, SHUT_RDWR);
+    pthread_join(serve_thread, NULL);
+    close(serve_fd);
+    serve_fd = -1;
+    // after a hot restart the path is the new process's socket
+    struct stat st;
+    if (stat(serve_path, &st) == 0 && st.st_dev == serve_stat.st_dev && st.st_ino == serve_stat.st_ino) {
+        unlink(serve_path);
+    }
+}
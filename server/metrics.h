@@ -0,0 +1,121 @@
+/**
+ * @file metrics.h
+ * @brief Counters and latency histograms for aesdsocket
+ *
+ * Every thread updates its own shard of the counters, picked once per thread, so the hot
+ * paths never take a lock and rarely share a cache line.  With more threads than shards
+ * a few threads share one, the updates are relaxed atomic adds either way.  Latencies are
+ * counted in histograms with power of two buckets from about a microsecond up.
+ *
+ * The shards are only summed up when the metrics are read, by the STATS command or over
+ * the metrics Unix socket, in the Prometheus text exposition format.
+ */
+
+#ifndef AESDSOCKET_METRICS_H
+#define AESDSOCKET_METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define METRICS_SHARDS 64
+#define METRICS_BUCKETS 28      // the first ends at 2^METRICS_MIN_SHIFT ns, the last finite one
+                                // at 2^36 ns (~69 s), the last one only shows as +Inf
+#define METRICS_MIN_SHIFT 10
+
+enum metrics_counter {
+    M_CONNECTIONS,
+    M_DISCONNECTS,
+    M_PACKETS,
+    M_BYTES_IN,
+    M_BYTES_OUT,
+    M_ERRORS,
+    M_REJECTED,
+    M_TIMEOUTS,
+    M_THROTTLED,
+    M_COUNTERS,
+};
+
+enum metrics_hist {
+    /**
+     * From the receive completing a packet to its commit
+     */
+    H_RECV_COMMIT,
+    /**
+     * Waiting for file_mutex
+     */
+    H_LOCK_WAIT,
+    /**
+     * Writing to the store backend
+     */
+    H_WRITE,
+    /**
+     * Locating and starting a read-back
+     */
+    H_READBACK,
+    /**
+     * Each call sending a pending response
+     */
+    H_SEND,
+    /**
+     * Waiting for the turn to write with fair scheduling
+     */
+    H_QUEUE_WAIT,
+    M_HISTS,
+};
+
+/**
+ * @return the monotonic clock in nanoseconds
+ */
+static inline uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_add(enum metrics_counter counter, uint64_t n);
+
+static inline void metrics_count(enum metrics_counter counter) {
+    metrics_add(counter, 1);
+}
+
+/**
+ * Count a latency of @param ns nanoseconds.
+ */
+void metrics_observe(enum metrics_hist hist, uint64_t ns);
+
+/**
+ * Count the time since @param start from metrics_now().
+ */
+static inline void metrics_since(enum metrics_hist hist, uint64_t start) {
+    metrics_observe(hist, metrics_now() - start);
+}
+
+/**
+ * Note that the data the calling thread is about to store was received at @param ns, the
+ * commit that follows is counted in H_RECV_COMMIT.  0 for data that was not received.
+ */
+void metrics_mark_received(uint64_t ns);
+
+/**
+ * @return the time set by metrics_mark_received() on the calling thread
+ */
+uint64_t metrics_received(void);
+
+/**
+ * Write all metrics to @param fd in the Prometheus text format.
+ * @return 0 on success, -1 on error
+ */
+int metrics_write(int fd);
+
+/**
+ * Serve the metrics to every client connecting to the Unix socket at @param path.
+ * @return 0 on success, -1 on error
+ */
+int metrics_serve_start(const char *path);
+
+/**
+ * Stop serving the metrics socket and remove it.
+ */
+void metrics_serve_stop(void);
+
+#endif /* AESDSOCKET_METRICS_H */
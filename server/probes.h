@@ -0,0 +1,52 @@
+/**
+ * @file probes.h
+ * @brief USDT probe points on the aesdsocket hot paths
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev) available the probes are single nop instructions
+ * plus an ELF note, so bpftrace or perf can attach to a running daemon, e.g.
+ *
+ *     bpftrace -e 'usdt:/usr/bin/aesdsocket:aesdsocket:write_done { @[arg0] = hist(arg3 - arg2); }'
+ *
+ * Without it, or built with -DAESD_NO_USDT, they compile to nothing.  The probe arguments
+ * are evaluated even while nothing is attached, so only values the code has at hand are
+ * passed.  Timestamps are CLOCK_MONOTONIC nanoseconds where the code takes them anyway for
+ * the metrics, elsewhere the tracer's own clock (nsecs) stamps the event.
+ *
+ *     conn_accept(fd)                          a client was accepted
+ *     conn_close(fd)                           a client connection is being closed
+ *     packet_framed(fd, len)                   a text packet or binary frame was split off
+ *     lock_acquired(wait_start, acquired)      file_mutex was taken
+ *     lock_released(acquired)                  file_mutex is being released
+ *     write_start(iov, iovcnt, start)          writing to the store backend
+ *     write_done(ret, size, start, end)        store size after the write, 0 if unknown
+ *     readback_start(offset, len, start)       a read-back from byte offset, len -1 for all
+ *     readback_done(fd, ret, start, end)       a send of a response finished, 1 complete, -1 failed
+ *     ioctl_seek(fd, write_cmd, write_cmd_offset, pos)    pos -1 if the seek failed
+ *     queue_wait(fd, wait)                     a client got its turn to write after wait ns, fd -1 for the server
+ */
+
+#ifndef AESDSOCKET_PROBES_H
+#define AESDSOCKET_PROBES_H
+
+#if !defined(AESD_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define AESD_USDT 1
+#endif
+#endif
+
+#ifdef AESD_USDT
+#include <sys/sdt.h>
+
+#define AESD_PROBE1(name, a) DTRACE_PROBE1(aesdsocket, name, a)
+#define AESD_PROBE2(name, a, b) DTRACE_PROBE2(aesdsocket, name, a, b)
+#define AESD_PROBE3(name, a, b, c) DTRACE_PROBE3(aesdsocket, name, a, b, c)
+#define AESD_PROBE4(name, a, b, c, d) DTRACE_PROBE4(aesdsocket, name, a, b, c, d)
+#else
+// the arguments are referenced so nothing becomes unused, but never evaluated
+#define AESD_PROBE1(name, a) do { if (0) { (void)(a); } } while (0)
+#define AESD_PROBE2(name, a, b) do { if (0) { (void)(a); (void)(b); } } while (0)
+#define AESD_PROBE3(name, a, b, c) do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+#define AESD_PROBE4(name, a, b, c, d) do { if (0) { (void)(a); (void)(b); (void)(c); (void)(d); } } while (0)
+#endif
+
+#endif /* AESDSOCKET_PROBES_H */
@@ -0,0 +1,352 @@
+/**
+ * @file readback.c
+ * @brief Streams the data store back to a client socket
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include "readback.h"
+#include "metrics.h"
+#include "probes.h"
+#include "log-ring.h"
+
+#define SENDFILE_CHUNK (1024 * 1024)
+#define SPLICE_CHUNK (64 * 1024)    // default pipe capacity
+#define CACHE_IOV 64
+
+
+// let go of the descriptor being sent
+static void drop_fd(struct readback *rb) {
+    if (rb->ref) {
+        shared_file_put(rb->ref);
+    } else if (rb->file_fd != -1) {
+        close(rb->file_fd);
+    }
+    rb->ref = NULL;
+    rb->file_fd = -1;
+}
+
+
+static void readback_finish(struct readback *rb) {
+    drop_fd(rb);
+    if (rb->chunk) cache_chunk_put(rb->chunk);
+    rb->chunk = NULL;
+    rb->next = NULL;
+    rb->prefix_pos = rb->prefix_len = 0;
+}
+
+
+static int would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+
+void readback_init(struct readback *rb) {
+    rb->file_fd = -1;
+    rb->ref = NULL;
+    rb->pipe_fds[0] = rb->pipe_fds[1] = -1;
+    rb->piped = 0;
+    rb->buf_pos = rb->buf_len = 0;
+    rb->chunk = NULL;
+    rb->next = NULL;
+    rb->prefix_pos = rb->prefix_len = 0;
+}
+
+
+// pick the transfer method for @param file_fd, keeping the rest of the response state
+static void start_fd(struct readback *rb, int file_fd) {
+    struct stat st;
+
+    rb->file_fd = file_fd;
+    rb->buf_pos = rb->buf_len = 0;
+
+    if (fstat(file_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        rb->method = READBACK_SENDFILE;
+    } else if (rb->pipe_fds[0] != -1 || pipe2(rb->pipe_fds, O_CLOEXEC) == 0) {
+        rb->method = READBACK_SPLICE;
+    } else {
+        rb->method = READBACK_COPY;
+    }
+}
+
+
+void readback_start(struct readback *rb, int file_fd) {
+    if (readback_pending(rb)) readback_finish(rb);
+    if (rb->piped) readback_release(rb);    // a failed splice left stale data in the pipe
+    start_fd(rb, file_fd);
+    rb->remaining = SIZE_MAX;
+}
+
+
+void readback_start_ref(struct readback *rb, struct file_ref *ref, off_t offset) {
+    readback_start(rb, ref->fd);
+    rb->ref = ref;
+    rb->offset = offset;
+}
+
+
+// @return where to read @param rb from, NULL for the file position
+static off_t *read_offset(struct readback *rb) {
+    return rb->ref ? &rb->offset : NULL;
+}
+
+
+void readback_start_chain(struct readback *rb, int file_fd, store_next_fn next, uint64_t cursor) {
+    readback_start(rb, file_fd);
+    rb->next = next;
+    rb->cursor = cursor;
+}
+
+
+static int send_sendfile(struct readback *rb, int sock_fd) {
+    for (;;) {
+        if (rb->remaining == 0) return 1;
+        ssize_t n = sendfile(sock_fd, rb->file_fd, read_offset(rb),
+                             rb->remaining < SENDFILE_CHUNK ? rb->remaining : SENDFILE_CHUNK);
+        if (n == 0) return 1;
+        if (n > 0) {
+            rb->remaining -= n;
+            metrics_add(M_BYTES_OUT, n);
+            continue;
+        }
+
+        if (would_block()) return 0;
+        if (errno == EINTR) continue;
+        if (errno == EINVAL || errno == ENOSYS) {
+            // the file position is unchanged, carry on with plain copies
+            rb->method = READBACK_COPY;
+            return 2;
+        }
+        log_ring_post(LOG_MSG_SEND_FAILED, errno, NULL);
+        return -1;
+    }
+}
+
+
+static int send_splice(struct readback *rb, int sock_fd) {
+    for (;;) {
+        if (rb->piped == 0) {
+            if (rb->remaining == 0) return 1;
+            ssize_t n = splice(rb->file_fd, read_offset(rb), rb->pipe_fds[1], NULL,
+                               rb->remaining < SPLICE_CHUNK ? rb->remaining : SPLICE_CHUNK, SPLICE_F_MOVE);
+            if (n == 0) return 1;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EINVAL || errno == ENOSYS) {
+                    // driver has no splice_read, nothing was consumed yet
+                    rb->method = READBACK_COPY;
+                    return 2;
+                }
+                log_ring_post(LOG_MSG_READ_FAILED, errno, NULL);
+                return -1;
+            }
+            rb->piped = n;
+            rb->remaining -= n;
+        }
+
+        ssize_t n = splice(rb->pipe_fds[0], NULL, sock_fd, NULL, rb->piped, SPLICE_F_MOVE);
+        if (n < 0) {
+            if (would_block()) return 0;
+            if (errno == EINTR) continue;
+            log_ring_post(LOG_MSG_SEND_FAILED, errno, NULL);
+            return -1;
+        }
+        rb->piped -= n;
+        metrics_add(M_BYTES_OUT, n);
+    }
+}
+
+
+static int send_copy(struct readback *rb, int sock_fd) {
+    for (;;) {
+        if (rb->buf_pos == rb->buf_len) {
+            if (rb->remaining == 0) return 1;
+            size_t want = rb->remaining < sizeof(rb->buf) ? rb->remaining : sizeof(rb->buf);
+            ssize_t n = rb->ref ? pread(rb->file_fd, rb->buf, want, rb->offset) : read(rb->file_fd, rb->buf, want);
+            if (n > 0 && rb->ref) rb->offset += n;
+            if (n == 0) return 1;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                log_ring_post(LOG_MSG_READ_FAILED, errno, NULL);
+                return -1;
+            }
+            rb->buf_pos = 0;
+            rb->buf_len = n;
+            rb->remaining -= n;
+        }
+
+        ssize_t sent = send(sock_fd, rb->buf + rb->buf_pos, rb->buf_len - rb->buf_pos, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (would_block()) return 0;
+            if (errno == EINTR) continue;
+            log_ring_post(LOG_MSG_SEND_FAILED, errno, NULL);
+            return -1;
+        }
+        rb->buf_pos += sent;
+        metrics_add(M_BYTES_OUT, sent);
+    }
+}
+
+
+void readback_start_snapshot(struct readback *rb, struct cache_snapshot *snap) {
+    if (readback_pending(rb)) readback_finish(rb);
+    rb->method = READBACK_CACHE;
+    rb->chunk = snap->first;
+    rb->last = snap->last;
+    rb->chunk_off = snap->skip;
+    rb->remaining = SIZE_MAX;
+}
+
+
+// move past the current chunk, keeping the chain pinned by a reference on the new one
+static void advance_chunk(struct readback *rb) {
+    struct cache_chunk *done = rb->chunk;
+
+    rb->chunk = done == rb->last ? NULL : cache_chunk_next(done);
+    if (rb->chunk) cache_chunk_get(rb->chunk);
+    rb->chunk_off = 0;
+    cache_chunk_put(done);
+}
+
+
+static int send_cache(struct readback *rb, int sock_fd) {
+    while (rb->chunk && rb->remaining > 0) {
+        struct iovec iov[CACHE_IOV];
+        int iovcnt = 0;
+        size_t off = rb->chunk_off;
+        size_t left = rb->remaining;
+
+        for (struct cache_chunk *c = rb->chunk; c && iovcnt < CACHE_IOV && left > 0;
+             c = c == rb->last ? NULL : cache_chunk_next(c)) {
+            iov[iovcnt].iov_base = c->data + off;
+            iov[iovcnt].iov_len = c->len - off < left ? c->len - off : left;
+            left -= iov[iovcnt].iov_len;
+            iovcnt++;
+            off = 0;
+        }
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t sent = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (would_block()) return 0;
+            if (errno == EINTR) continue;
+            log_ring_post(LOG_MSG_SEND_FAILED, errno, NULL);
+            return -1;
+        }
+        rb->remaining -= sent;
+        metrics_add(M_BYTES_OUT, sent);
+
+        while (rb->chunk && (size_t)sent >= rb->chunk->len - rb->chunk_off) {
+            sent -= rb->chunk->len - rb->chunk_off;
+            advance_chunk(rb);
+        }
+        if (rb->chunk) rb->chunk_off += sent;
+    }
+    return 1;
+}
+
+
+void readback_prefix(struct readback *rb, const void *data, size_t len) {
+    memcpy(rb->prefix, data, len);
+    rb->prefix_pos = 0;
+    rb->prefix_len = len;
+}
+
+
+static int body_pending(const struct readback *rb) {
+    return rb->file_fd != -1 || rb->chunk != NULL;
+}
+
+
+static int send_prefix(struct readback *rb, int sock_fd) {
+    int flags = MSG_NOSIGNAL | (body_pending(rb) ? MSG_MORE : 0);
+
+    while (rb->prefix_pos < rb->prefix_len) {
+        ssize_t sent = send(sock_fd, rb->prefix + rb->prefix_pos, rb->prefix_len - rb->prefix_pos, flags);
+        if (sent < 0) {
+            if (would_block()) return 0;
+            if (errno == EINTR) continue;
+            log_ring_post(LOG_MSG_SEND_FAILED, errno, NULL);
+            return -1;
+        }
+        rb->prefix_pos += sent;
+        metrics_add(M_BYTES_OUT, sent);
+    }
+    return 1;
+}
+
+
+static int readback_send_all(struct readback *rb, int sock_fd) {
+    int r = send_prefix(rb, sock_fd);
+
+    if (r != 1 || !body_pending(rb)) {
+        if (r != 0) readback_finish(rb);
+        return r;
+    }
+
+    while (body_pending(rb)) {
+        switch (rb->method) {
+            case READBACK_SENDFILE:
+                r = send_sendfile(rb, sock_fd);
+                break;
+            case READBACK_SPLICE:
+                r = send_splice(rb, sock_fd);
+                break;
+            case READBACK_CACHE:
+                r = send_cache(rb, sock_fd);
+                break;
+            default:
+                r = send_copy(rb, sock_fd);
+                break;
+        }
+        if (r == 2) continue;   // switched to the fallback method
+        if (r == 1 && rb->next && rb->file_fd != -1 && rb->remaining > 0) {
+            int next_fd = rb->next(&rb->cursor);
+            if (next_fd != -1) {
+                drop_fd(rb);
+                start_fd(rb, next_fd);
+                continue;
+            }
+        }
+        if (r == 1 && rb->prefix_len && rb->remaining > 0) {
+            // the header announced more than the store still had, the framing is lost
+            log_ring_post(LOG_MSG_STORE_SHRANK, 0, NULL);
+            r = -1;
+        }
+        if (r != 0) readback_finish(rb);
+        break;
+    }
+    return r;
+}
+
+
+int readback_send(struct readback *rb, int sock_fd) {
+    uint64_t start = metrics_now();
+    int r = readback_send_all(rb, sock_fd);
+    uint64_t end = metrics_now();
+
+    metrics_observe(H_SEND, end - start);
+    if (r < 0) metrics_count(M_ERRORS);
+    if (r != 0) AESD_PROBE4(readback_done, sock_fd, r, start, end);
+    return r;
+}
+
+
+void readback_release(struct readback *rb) {
+    readback_finish(rb);
+    if (rb->pipe_fds[0] != -1) {
+        close(rb->pipe_fds[0]);
+        close(rb->pipe_fds[1]);
+        rb->pipe_fds[0] = rb->pipe_fds[1] = -1;
+    }
+    rb->piped = 0;
+}
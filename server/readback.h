@@ -0,0 +1,139 @@
+/**
+ * @file readback.h
+ * @brief Streams the data store back to a client socket
+ *
+ * Regular files are sent with sendfile(), other descriptors such as /dev/aesdchar are
+ * spliced through a pipe, so the contents never pass through a user space buffer.
+ * When the kernel or the driver does not support either, the transfer falls back to
+ * read() and send() through a small buffer.  With the store cache enabled responses are
+ * sent straight from the cached chunks instead.
+ */
+
+#ifndef AESDSOCKET_READBACK_H
+#define AESDSOCKET_READBACK_H
+
+#include <stddef.h>
+#include "aesdsocket.h"
+#include "store-cache.h"
+#include "shared-file.h"
+
+#define READBACK_PREFIX_MAX 16
+
+enum readback_method {
+    READBACK_SENDFILE,
+    READBACK_SPLICE,
+    READBACK_COPY,
+    READBACK_CACHE,
+};
+
+/**
+ * Per connection transfer state.  The pipe used for splicing is created on first use
+ * and kept until readback_release(), a partially sent response survives EAGAIN.
+ */
+struct readback {
+    /**
+     * Descriptor being sent, -1 when no response is pending
+     */
+    int file_fd;
+    /**
+     * Shared handle file_fd belongs to, NULL if the read-back owns file_fd.  A shared
+     * descriptor is read at offset rather than at its file position.
+     */
+    struct file_ref *ref;
+    off_t offset;
+    enum readback_method method;
+    int pipe_fds[2];
+    /**
+     * Bytes spliced into the pipe but not yet sent
+     */
+    size_t piped;
+    char buf[BUFFER_SIZE];
+    size_t buf_pos;
+    size_t buf_len;
+    /**
+     * Cache chunk being sent, NULL when no snapshot is pending.  Holds a reference.
+     */
+    struct cache_chunk *chunk;
+    struct cache_chunk *last;
+    size_t chunk_off;
+    /**
+     * Continues the response once file_fd is exhausted, NULL if file_fd is all of it
+     */
+    store_next_fn next;
+    uint64_t cursor;
+    /**
+     * Bytes left to send before the response is complete, SIZE_MAX to send everything
+     */
+    size_t remaining;
+    /**
+     * Frame header sent ahead of the body.  A header announces the body length, so a body
+     * that ends early fails the response.
+     */
+    char prefix[READBACK_PREFIX_MAX];
+    size_t prefix_pos;
+    size_t prefix_len;
+};
+
+/**
+ * Initialize @param rb to an idle state with no pipe allocated.
+ */
+void readback_init(struct readback *rb);
+
+/**
+ * Start sending the remaining contents of @param file_fd.  @param rb takes ownership of
+ * the descriptor and closes it once the transfer is complete or fails.
+ */
+void readback_start(struct readback *rb, int file_fd);
+
+/**
+ * Start sending the shared descriptor of @param ref from byte @param offset on.  @param rb
+ * takes over the reference.
+ */
+void readback_start_ref(struct readback *rb, struct file_ref *ref, off_t offset);
+
+/**
+ * Start sending @param file_fd like readback_start(), then continue with every descriptor
+ * @param next returns for @param cursor until it returns -1.
+ */
+void readback_start_chain(struct readback *rb, int file_fd, store_next_fn next, uint64_t cursor);
+
+/**
+ * Start sending the cache snapshot @param snap.  @param rb takes over the reference held by
+ * the snapshot.
+ */
+void readback_start_snapshot(struct readback *rb, struct cache_snapshot *snap);
+
+/**
+ * End the response just started on @param rb after at most @param len bytes.
+ */
+static inline void readback_limit(struct readback *rb, size_t len) {
+    rb->remaining = len;
+}
+
+/**
+ * @return nonzero while a response started with readback_start() or readback_start_snapshot()
+ *      is not completely sent
+ */
+static inline int readback_pending(const struct readback *rb) {
+    return rb->file_fd != -1 || rb->chunk != NULL || rb->prefix_pos < rb->prefix_len;
+}
+
+/**
+ * Send @param len bytes from @param data, at most READBACK_PREFIX_MAX, ahead of the response
+ * just started on @param rb, or as the whole response if none was started.
+ */
+void readback_prefix(struct readback *rb, const void *data, size_t len);
+
+/**
+ * Send as much of the pending response to @param sock_fd as the socket accepts.
+ * On a blocking socket this only returns once the response is complete or failed.
+ * @return 1 when the response is complete, 0 when the socket would block, -1 on error
+ */
+int readback_send(struct readback *rb, int sock_fd);
+
+/**
+ * Drop any pending response and free the pipe.
+ */
+void readback_release(struct readback *rb);
+
+#endif /* AESDSOCKET_READBACK_H */
@@ -0,0 +1,572 @@
+/**
+ * @file segment-log.c
+ * @brief Segmented, indexed log storage for the aesdsocket data file
+ *
+ * Data is written before its index entries, so after a crash an index can only lag its
+ * segment.  Only the newest segment can be affected and is repaired on open by scanning
+ * it from its last indexed command.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "segment-log.h"
+
+#define SEGLOG_MAX_IOV 1024
+#define INDEX_BATCH 256     // index entries buffered before they are written
+#define SCAN_READ_SIZE (64 * 1024)
+#define SEGMENT_NAME_MAX 32     // "/", the 20 digit base, the extension and the NUL
+
+struct segment {
+    uint64_t base;      // number of the first command in the segment
+    uint64_t count;     // commands starting in the segment, one index entry each
+    size_t size;
+    time_t mtime;
+};
+
+// seg_lock protects the segment table against readers, writers are serialized by the store
+static pthread_mutex_t seg_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct segment *segs;        // oldest first, the last one is active
+static int nsegs;
+static int segs_cap;
+static size_t total;
+
+static char log_dir[PATH_MAX];
+static size_t segment_bytes;
+static size_t retain_bytes;
+static long retain_secs;
+
+static int log_fd = -1;     // the active segment and its index, opened for appending
+static int idx_fd = -1;
+static int at_boundary;     // the next byte written starts a new command
+
+
+// seglog_open() made sure the name fits, a path cut short could only name another file
+static void segment_path(char *path, size_t len, uint64_t base, const char *ext) {
+    if (snprintf(path, len, "%s/%020" PRIu64 ".%s", log_dir, base, ext) >= (int)len) abort();
+}
+
+
+static int open_segment_file(uint64_t base, const char *ext, int flags) {
+    char path[PATH_MAX];
+    segment_path(path, sizeof(path), base, ext);
+    int fd = open(path, flags | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1 && !(flags & O_CREAT) && errno == ENOENT) return -1;
+    if (fd == -1) syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+    return fd;
+}
+
+
+static void remove_segment_files(uint64_t base) {
+    char path[PATH_MAX];
+    segment_path(path, sizeof(path), base, "log");
+    unlink(path);
+    segment_path(path, sizeof(path), base, "idx");
+    unlink(path);
+}
+
+
+// seg_lock must be held when other threads may use the table
+static struct segment *table_add(uint64_t base) {
+    if (nsegs == segs_cap) {
+        int cap = segs_cap ? segs_cap * 2 : 16;
+        struct segment *p = realloc(segs, cap * sizeof(struct segment));
+        if (!p) {
+            syslog(LOG_ERR, "Failed to allocate memory for segment table");
+            return NULL;
+        }
+        segs = p;
+        segs_cap = cap;
+    }
+    struct segment *seg = &segs[nsegs++];
+    seg->base = base;
+    seg->count = 0;
+    seg->size = 0;
+    seg->mtime = time(NULL);
+    return seg;
+}
+
+
+static int compare_segments(const void *a, const void *b) {
+    uint64_t x = ((const struct segment *)a)->base;
+    uint64_t y = ((const struct segment *)b)->base;
+    return x < y ? -1 : x > y;
+}
+
+
+static int write_index(const uint32_t *entries, int n) {
+    const char *buf = (const char *)entries;
+    size_t len = n * sizeof(uint32_t);
+
+    while (len > 0) {
+        ssize_t written = write(idx_fd, buf, len);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "Failed to write segment index: %s", strerror(errno));
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+
+// load every segment found in log_dir into the table
+static int scan_dir(void) {
+    DIR *dir = opendir(log_dir);
+    if (!dir) {
+        syslog(LOG_ERR, "Failed to open %s: %s", log_dir, strerror(errno));
+        return -1;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        uint64_t base;
+        int end = 0;
+        if (sscanf(ent->d_name, "%20" SCNu64 ".log%n", &base, &end) != 1 ||
+            ent->d_name[end] != '\0') continue;
+
+        char path[PATH_MAX];
+        struct stat st;
+        struct segment *seg = table_add(base);
+        if (!seg) {
+            closedir(dir);
+            return -1;
+        }
+        segment_path(path, sizeof(path), base, "log");
+        if (stat(path, &st) == 0) {
+            seg->size = st.st_size;
+            seg->mtime = st.st_mtime;
+        }
+        segment_path(path, sizeof(path), base, "idx");
+        if (stat(path, &st) == 0) seg->count = st.st_size / sizeof(uint32_t);
+    }
+    closedir(dir);
+
+    qsort(segs, nsegs, sizeof(struct segment), compare_segments);
+    for (int i = 0; i < nsegs; i++) total += segs[i].size;
+    return 0;
+}
+
+
+// bring the index of the active segment up to date with its data
+static int repair_active(void) {
+    struct segment *seg = &segs[nsegs - 1];
+    uint32_t entry = 0;
+
+    // drop entries for data that never made it to disk
+    while (seg->count > 0) {
+        if (pread(idx_fd, &entry, sizeof(entry), (seg->count - 1) * sizeof(entry)) != sizeof(entry)) {
+            syslog(LOG_ERR, "Failed to read segment index: %s", strerror(errno));
+            return -1;
+        }
+        if (entry < seg->size) break;
+        seg->count--;
+    }
+    if (ftruncate(idx_fd, seg->count * sizeof(entry)) == -1) {
+        syslog(LOG_ERR, "Failed to truncate segment index: %s", strerror(errno));
+        return -1;
+    }
+
+    // index commands that start after the last indexed one
+    char *buf = malloc(SCAN_READ_SIZE);
+    if (!buf) return -1;
+    uint32_t entries[INDEX_BATCH];
+    int n = 0;
+    size_t off = seg->count > 0 ? entry : 0;
+    int ret = 0;
+    at_boundary = seg->count == 0;
+
+    while (off < seg->size) {
+        ssize_t len = pread(log_fd, buf, SCAN_READ_SIZE, off);
+        if (len == 0) break;
+        if (len < 0) {
+            syslog(LOG_ERR, "Failed to read segment for index repair: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+        for (ssize_t i = 0; i < len; i++) {
+            if (at_boundary) {
+                entries[n++] = off + i;
+                seg->count++;
+                at_boundary = 0;
+                if (n == INDEX_BATCH) {
+                    if (write_index(entries, n) != 0) ret = -1;
+                    n = 0;
+                }
+            }
+            if (buf[i] == '\n') at_boundary = 1;
+        }
+        off += len;
+    }
+    free(buf);
+
+    if (write_index(entries, n) != 0) ret = -1;
+    return ret;
+}
+
+
+// open a new empty segment starting at command @param base and make it active
+static int create_segment(uint64_t base) {
+    int lfd = open_segment_file(base, "log", O_CREAT | O_TRUNC | O_WRONLY | O_APPEND);
+    if (lfd == -1) return -1;
+    int ifd = open_segment_file(base, "idx", O_CREAT | O_TRUNC | O_WRONLY | O_APPEND);
+    if (ifd == -1) {
+        close(lfd);
+        remove_segment_files(base);
+        return -1;
+    }
+
+    pthread_mutex_lock(&seg_lock);
+    struct segment *seg = table_add(base);
+    pthread_mutex_unlock(&seg_lock);
+    if (!seg) {
+        close(lfd);
+        close(ifd);
+        remove_segment_files(base);
+        return -1;
+    }
+
+    if (log_fd != -1) {
+        // a rolled segment is never written again or repaired on open, make it and its
+        // index durable once
+        if (fdatasync(log_fd) == -1) syslog(LOG_ERR, "Failed to sync segment: %s", strerror(errno));
+        if (fdatasync(idx_fd) == -1) syslog(LOG_ERR, "Failed to sync segment index: %s", strerror(errno));
+        close(log_fd);
+        close(idx_fd);
+    }
+    log_fd = lfd;
+    idx_fd = ifd;
+    at_boundary = 1;
+    return 0;
+}
+
+
+int seglog_open(const char *dir, size_t seg_bytes, size_t max_bytes, long max_secs) {
+    if (strlen(dir) > sizeof(log_dir) - SEGMENT_NAME_MAX) {
+        syslog(LOG_ERR, "Segment directory path too long: %s", dir);
+        return -1;
+    }
+    strcpy(log_dir, dir);
+    segment_bytes = seg_bytes;
+    retain_bytes = max_bytes;
+    retain_secs = max_secs;
+
+    if (mkdir(log_dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1 && errno != EEXIST) {
+        syslog(LOG_ERR, "Failed to create %s: %s", log_dir, strerror(errno));
+        return -1;
+    }
+    if (scan_dir() != 0) goto fail;
+
+    if (nsegs == 0) {
+        if (create_segment(0) != 0) goto fail;
+    } else {
+        uint64_t base = segs[nsegs - 1].base;
+        log_fd = open_segment_file(base, "log", O_CREAT | O_RDWR | O_APPEND);
+        idx_fd = open_segment_file(base, "idx", O_CREAT | O_RDWR | O_APPEND);
+        if (log_fd == -1 || idx_fd == -1 || repair_active() != 0) goto fail;
+    }
+
+    syslog(LOG_INFO, "Segmented log in %s, %d segments, %zu bytes", log_dir, nsegs, total);
+    return 0;
+
+fail:
+    seglog_close(0);
+    return -1;
+}
+
+
+int seglog_enabled(void) {
+    return log_fd != -1;
+}
+
+
+static int ends_command(const struct iovec *v) {
+    return v->iov_len > 0 && ((const char *)v->iov_base)[v->iov_len - 1] == '\n';
+}
+
+
+// write to the active segment and index the commands starting in the written bytes
+static int write_run(const struct iovec *iov, int iovcnt) {
+    struct iovec pending[SEGLOG_MAX_IOV];
+    struct iovec *v = pending;
+    size_t written = 0;
+    int ret = 0;
+
+    memcpy(pending, iov, iovcnt * sizeof(struct iovec));
+    for (int left = iovcnt; left > 0; ) {
+        ssize_t n = writev(log_fd, v, left);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "Failed to write segment: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+        written += n;
+        while (left > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            left--;
+        }
+        if (left > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+
+    struct segment *seg = &segs[nsegs - 1];
+    uint32_t entries[INDEX_BATCH];
+    int n = 0;
+    uint64_t count = 0;
+    size_t off = seg->size;
+    size_t left = written;
+
+    for (int i = 0; i < iovcnt && left > 0; i++) {
+        const char *p = iov[i].iov_base;
+        const char *end = p + (iov[i].iov_len < left ? iov[i].iov_len : left);
+        left -= end - p;
+        while (p < end) {
+            if (at_boundary) {
+                entries[n++] = off + (p - (const char *)iov[i].iov_base);
+                count++;
+                at_boundary = 0;
+                if (n == INDEX_BATCH) {
+                    if (write_index(entries, n) != 0) ret = -1;
+                    n = 0;
+                }
+            }
+            const char *newline = memchr(p, '\n', end - p);
+            if (!newline) break;
+            p = newline + 1;
+            at_boundary = 1;
+        }
+        off += iov[i].iov_len;
+    }
+    if (write_index(entries, n) != 0) ret = -1;
+
+    pthread_mutex_lock(&seg_lock);
+    seg->size += written;
+    seg->count += count;
+    seg->mtime = time(NULL);
+    total += written;
+    pthread_mutex_unlock(&seg_lock);
+    return ret;
+}
+
+
+// drop the oldest segments past the retention limits, never the active one
+static size_t apply_retention(void) {
+    time_t now = time(NULL);
+    size_t dropped = 0;
+
+    pthread_mutex_lock(&seg_lock);
+    while (nsegs > 1 &&
+           ((retain_bytes && total > retain_bytes) ||
+            (retain_secs && now - segs[0].mtime > retain_secs))) {
+        // readers still holding the segment open keep reading it
+        remove_segment_files(segs[0].base);
+        total -= segs[0].size;
+        dropped += segs[0].size;
+        memmove(segs, segs + 1, (nsegs - 1) * sizeof(struct segment));
+        nsegs--;
+    }
+    pthread_mutex_unlock(&seg_lock);
+    return dropped;
+}
+
+
+static void roll_if_full(void) {
+    struct segment *seg = &segs[nsegs - 1];
+    if (at_boundary && seg->size >= segment_bytes && seg->count > 0) {
+        create_segment(seg->base + seg->count);     // keeps writing the full one on failure
+    }
+}
+
+
+int seglog_append(const struct iovec *iov, int iovcnt, size_t *dropped) {
+    int ret = 0;
+    int start = 0;
+    size_t run = 0;
+
+    // roll between buffers at the first command boundary past the segment size
+    for (int i = 0; i < iovcnt; i++) {
+        if (i > start && ends_command(&iov[i - 1]) && segs[nsegs - 1].size + run >= segment_bytes) {
+            if (write_run(iov + start, i - start) != 0) ret = -1;
+            roll_if_full();
+            start = i;
+            run = 0;
+        }
+        run += iov[i].iov_len;
+    }
+    if (write_run(iov + start, iovcnt - start) != 0) ret = -1;
+    roll_if_full();
+
+    *dropped = apply_retention();
+    return ret;
+}
+
+
+size_t seglog_size(void) {
+    pthread_mutex_lock(&seg_lock);
+    size_t size = total;
+    pthread_mutex_unlock(&seg_lock);
+    return size;
+}
+
+
+int seglog_sync(void) {
+    if (fdatasync(log_fd) == -1) {
+        syslog(LOG_ERR, "Failed to sync segment: %s", strerror(errno));
+        return -1;
+    }
+    // after the data, an index entry never points past what is durable
+    if (fdatasync(idx_fd) == -1) {
+        syslog(LOG_ERR, "Failed to sync segment index: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+// seg_lock must be held
+static int open_at(const struct segment *seg, size_t offset, uint64_t *cursor) {
+    int fd = open_segment_file(seg->base, "log", O_RDONLY);
+    if (fd == -1) return -1;
+    if (offset && lseek(fd, offset, SEEK_SET) == -1) {
+        syslog(LOG_ERR, "Failed to seek segment: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    *cursor = seg->base;
+    return fd;
+}
+
+
+int seglog_open_all(uint64_t *cursor) {
+    pthread_mutex_lock(&seg_lock);
+    int fd = open_at(&segs[0], 0, cursor);
+    pthread_mutex_unlock(&seg_lock);
+    return fd;
+}
+
+
+int seglog_open_offset(size_t offset, uint64_t *cursor) {
+    int fd = -1;
+
+    pthread_mutex_lock(&seg_lock);
+    int i = 0;
+    while (i < nsegs - 1 && offset >= segs[i].size) {
+        offset -= segs[i].size;
+        i++;
+    }
+    if (offset > segs[i].size) {
+        errno = EINVAL;
+    } else {
+        fd = open_at(&segs[i], offset, cursor);
+    }
+    pthread_mutex_unlock(&seg_lock);
+    return fd;
+}
+
+
+// read index entry @param i of @param seg, seg_lock must be held
+static int read_entry(const struct segment *seg, uint64_t i, uint32_t *entry) {
+    int fd = open_segment_file(seg->base, "idx", O_RDONLY);
+    if (fd == -1) return -1;
+    ssize_t n = pread(fd, entry, sizeof(*entry), i * sizeof(*entry));
+    close(fd);
+    if (n != sizeof(*entry)) {
+        syslog(LOG_ERR, "Failed to read segment index entry %" PRIu64, seg->base + i);
+        return -1;
+    }
+    return 0;
+}
+
+
+off_t seglog_locate(uint64_t cmd, size_t cmd_offset) {
+    off_t pos = -1;
+
+    pthread_mutex_lock(&seg_lock);
+    uint64_t target = segs[0].base + cmd;
+
+    // the last segment whose base is not past the target
+    int lo = 0, hi = nsegs - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (segs[mid].base <= target) lo = mid; else hi = mid - 1;
+    }
+    const struct segment *seg = &segs[lo];
+    uint64_t i = target - seg->base;
+    uint32_t start, end;
+
+    errno = EINVAL;
+    if (target < seg->base || i >= seg->count) goto out;
+    if (read_entry(seg, i, &start) != 0) goto out;
+    if (i + 1 < seg->count) {
+        if (read_entry(seg, i + 1, &end) != 0) goto out;
+    } else {
+        end = seg->size;
+    }
+    errno = EINVAL;
+    if (cmd_offset >= end - start) goto out;
+
+    pos = start + cmd_offset;
+    for (int j = 0; j < lo; j++) pos += segs[j].size;
+
+out:
+    pthread_mutex_unlock(&seg_lock);
+    return pos;
+}
+
+
+uint64_t seglog_records(void) {
+    pthread_mutex_lock(&seg_lock);
+    uint64_t count = nsegs > 0 ? segs[nsegs - 1].base + segs[nsegs - 1].count - segs[0].base : 0;
+    pthread_mutex_unlock(&seg_lock);
+    return count;
+}
+
+
+int seglog_open_next(uint64_t *cursor) {
+    int fd = -1;
+
+    pthread_mutex_lock(&seg_lock);
+    for (int i = 0; i < nsegs; i++) {
+        if (segs[i].base > *cursor) {
+            fd = open_at(&segs[i], 0, cursor);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&seg_lock);
+    return fd;
+}
+
+
+void seglog_close(int remove_files) {
+    if (log_fd != -1) close(log_fd);
+    if (idx_fd != -1) close(idx_fd);
+    log_fd = idx_fd = -1;
+
+    pthread_mutex_lock(&seg_lock);
+    if (remove_files) {
+        for (int i = 0; i < nsegs; i++) remove_segment_files(segs[i].base);
+        rmdir(log_dir);
+    }
+    free(segs);
+    segs = NULL;
+    nsegs = segs_cap = 0;
+    total = 0;
+    pthread_mutex_unlock(&seg_lock);
+}
@@ -0,0 +1,98 @@
+/**
+ * @file segment-log.h
+ * @brief Segmented, indexed log storage for the aesdsocket data file
+ *
+ * The log is split into segment files in one directory, each named after the number of
+ * the first command it holds.  Once the active segment reached the segment size, the next
+ * write starting a new command goes to a fresh segment.  Every segment has a sidecar index
+ * with the 32 bit offset of each command it holds, so a command number maps to a segment
+ * and offset without reading any data and startup only looks at file sizes.  Retention
+ * drops whole segments, oldest first, when the log grows past the size limit or a segment
+ * was last written longer ago than the age limit.
+ */
+
+#ifndef AESDSOCKET_SEGMENT_LOG_H
+#define AESDSOCKET_SEGMENT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Open the log in @param dir, creating the directory if needed.  Segments left behind by an
+ * earlier run are picked up, the index of the newest one is repaired if it lags its data.
+ * @param segment_bytes the size at which the active segment is rolled
+ * @param retain_bytes the log size above which the oldest segments are dropped, 0 for no limit
+ * @param retain_secs the age after which a segment is dropped, 0 for no limit
+ * @return 0 on success, -1 on error
+ */
+int seglog_open(const char *dir, size_t segment_bytes, size_t retain_bytes, long retain_secs);
+
+/**
+ * @return nonzero if seglog_open() succeeded
+ */
+int seglog_enabled(void);
+
+/**
+ * Append the buffers to the log, rolling segments and applying retention as needed.
+ * Writers must be serialized by the caller.
+ * @param dropped set to the number of bytes retention removed from the start of the log
+ * @return 0 on success, -1 on error
+ */
+int seglog_append(const struct iovec *iov, int iovcnt, size_t *dropped);
+
+/**
+ * @return the number of bytes currently retained
+ */
+size_t seglog_size(void);
+
+/**
+ * Make everything appended so far durable.  Rolled segments are synced when they are closed.
+ * @return 0 on success, -1 on error
+ */
+int seglog_sync(void);
+
+/**
+ * Open the oldest retained segment for reading from its start.
+ * @param cursor set to identify the segment for seglog_open_next()
+ * @return the descriptor, -1 on error
+ */
+int seglog_open_all(uint64_t *cursor);
+
+/**
+ * Open the segment holding a byte of the log, positioned at it.
+ * @param offset the byte offset, counted from the start of the oldest retained segment
+ * @param cursor set to identify the segment for seglog_open_next()
+ * @return the descriptor, -1 with errno EINVAL if @param offset is past the end
+ */
+int seglog_open_offset(size_t offset, uint64_t *cursor);
+
+/**
+ * Find a byte within a command through the segment indexes.
+ * @param cmd the command number, counted from the oldest retained command
+ * @param cmd_offset the byte offset within the command, must be inside it
+ * @return the byte offset for seglog_open_offset(), -1 with errno EINVAL if the command or
+ *      offset is out of range
+ */
+off_t seglog_locate(uint64_t cmd, size_t cmd_offset);
+
+/**
+ * @return the number of retained commands, an unfinished last one included
+ */
+uint64_t seglog_records(void);
+
+/**
+ * Open the segment following the one identified by @param cursor and advance it.
+ * Segments dropped in the meantime are skipped.
+ * @return the descriptor, -1 when there is no later segment
+ */
+int seglog_open_next(uint64_t *cursor);
+
+/**
+ * Close the log.
+ * @param remove_files nonzero to delete the segments, their indexes and the directory
+ */
+void seglog_close(int remove_files);
+
+#endif /* AESDSOCKET_SEGMENT_LOG_H */
@@ -0,0 +1,148 @@
+/**
+ * @file shared-file.c
+ * @brief Long lived descriptors of a store file, shared by every thread
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "shared-file.h"
+
+static const int open_flags[SHARED_FILE_MODES] = {
+    [SHARED_FILE_READ] = O_RDONLY | O_CLOEXEC,
+    [SHARED_FILE_APPEND] = O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC,
+};
+
+
+void shared_file_init(struct shared_file *sf, const char *path) {
+    memset(sf, 0, sizeof(*sf));
+    sf->path = path;
+    pthread_mutex_init(&sf->lock, NULL);
+}
+
+
+void shared_file_put(struct file_ref *ref) {
+    if (__atomic_sub_fetch(&ref->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(ref->fd);
+        free(ref);
+    }
+}
+
+
+// lock must be held
+static void drop_all(struct shared_file *sf) {
+    for (int mode = 0; mode < SHARED_FILE_MODES; mode++) {
+        if (sf->refs[mode]) shared_file_put(sf->refs[mode]);
+        sf->refs[mode] = NULL;
+    }
+}
+
+
+static int open_count(const struct shared_file *sf) {
+    int n = 0;
+    for (int mode = 0; mode < SHARED_FILE_MODES; mode++) {
+        if (sf->refs[mode]) n++;
+    }
+    return n;
+}
+
+
+// the file the descriptors refer to changed, start over, lock must be held
+static void rotated(struct shared_file *sf) {
+    drop_all(sf);
+    sf->generation++;
+    syslog(LOG_INFO, "%s was replaced, reopening it", sf->path);
+}
+
+
+// drop the descriptors once the path names another file, lock must be held
+static void recheck(struct shared_file *sf) {
+    struct timespec now;
+    struct stat st;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    long elapsed_ms = (now.tv_sec - sf->checked.tv_sec) * 1000 + (now.tv_nsec - sf->checked.tv_nsec) / 1000000;
+    if (elapsed_ms < SHARED_FILE_RECHECK_MS) return;
+    sf->checked = now;
+
+    if (open_count(sf) == 0) return;
+    if (stat(sf->path, &st) == -1 || st.st_dev != sf->dev || st.st_ino != sf->ino) rotated(sf);
+}
+
+
+// lock must be held
+static struct file_ref *open_ref(struct shared_file *sf, enum shared_file_mode mode) {
+    int fd = open(sf->path, open_flags[mode], S_IRWXU | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+        // a store that was not written yet has no file, which is not an error
+        syslog(errno == ENOENT ? LOG_DEBUG : LOG_ERR, "Failed to open %s: %s", sf->path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        syslog(LOG_ERR, "Failed to stat %s: %s", sf->path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    // the other descriptor may still refer to a file that was rotated since
+    if (open_count(sf) > 0 && (st.st_dev != sf->dev || st.st_ino != sf->ino)) rotated(sf);
+    sf->dev = st.st_dev;
+    sf->ino = st.st_ino;
+
+    struct file_ref *ref = malloc(sizeof(struct file_ref));
+    if (!ref) {
+        syslog(LOG_ERR, "Failed to allocate memory for file handle");
+        close(fd);
+        return NULL;
+    }
+    ref->fd = fd;
+    ref->refs = 1;
+    ref->generation = sf->generation;
+    sf->refs[mode] = ref;
+    return ref;
+}
+
+
+struct file_ref *shared_file_get(struct shared_file *sf, enum shared_file_mode mode) {
+    pthread_mutex_lock(&sf->lock);
+    recheck(sf);
+    struct file_ref *ref = sf->refs[mode] ? sf->refs[mode] : open_ref(sf, mode);
+    if (ref) __atomic_add_fetch(&ref->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sf->lock);
+    return ref;
+}
+
+
+void shared_file_failed(struct shared_file *sf, struct file_ref *ref) {
+    pthread_mutex_lock(&sf->lock);
+    for (int mode = 0; mode < SHARED_FILE_MODES; mode++) {
+        if (sf->refs[mode] == ref) {
+            shared_file_put(ref);
+            sf->refs[mode] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sf->lock);
+    shared_file_put(ref);
+}
+
+
+unsigned int shared_file_generation(struct shared_file *sf) {
+    pthread_mutex_lock(&sf->lock);
+    recheck(sf);
+    unsigned int generation = sf->generation;
+    pthread_mutex_unlock(&sf->lock);
+    return generation;
+}
+
+
+void shared_file_close(struct shared_file *sf) {
+    pthread_mutex_lock(&sf->lock);
+    drop_all(sf);
+    pthread_mutex_unlock(&sf->lock);
+}
@@ -0,0 +1,79 @@
+/**
+ * @file shared-file.h
+ * @brief Long lived descriptors of a store file, shared by every thread
+ *
+ * Instead of opening the store for every write and read-back, a shared file keeps one
+ * append and one read descriptor open for the life of the process.  Reads go through
+ * pread(), sendfile() and splice() with explicit offsets, so threads share the read
+ * descriptor without racing on its file position.
+ *
+ * Descriptors are reference counted: a read-back in progress keeps its descriptor even
+ * if the shared file reopens in the meantime.  Every SHARED_FILE_RECHECK_MS the path is
+ * compared against the open file, and once it was rotated or removed the descriptors are
+ * dropped and opened again on next use.  A descriptor that failed is reopened as well.
+ */
+
+#ifndef AESDSOCKET_SHARED_FILE_H
+#define AESDSOCKET_SHARED_FILE_H
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define SHARED_FILE_RECHECK_MS 1000
+
+enum shared_file_mode {
+    SHARED_FILE_READ,
+    SHARED_FILE_APPEND,     // created if missing
+    SHARED_FILE_MODES,
+};
+
+struct file_ref {
+    int fd;
+    int refs;
+    /**
+     * Generation of the shared file it was opened in
+     */
+    unsigned int generation;
+};
+
+struct shared_file {
+    const char *path;
+    pthread_mutex_t lock;
+    struct file_ref *refs[SHARED_FILE_MODES];
+    /**
+     * Incremented whenever the path turned out to name a different file than before
+     */
+    unsigned int generation;
+    dev_t dev;
+    ino_t ino;
+    struct timespec checked;
+};
+
+void shared_file_init(struct shared_file *sf, const char *path);
+
+/**
+ * Drop the shared descriptors, they are closed once the last reference is put.
+ */
+void shared_file_close(struct shared_file *sf);
+
+/**
+ * Take a reference on the descriptor for @param mode, opening it if needed.
+ * @return the reference, NULL if the file could not be opened
+ */
+struct file_ref *shared_file_get(struct shared_file *sf, enum shared_file_mode mode);
+
+void shared_file_put(struct file_ref *ref);
+
+/**
+ * Report that an operation on @param ref failed, the next shared_file_get() reopens it.
+ * Puts the reference.
+ */
+void shared_file_failed(struct shared_file *sf, struct file_ref *ref);
+
+/**
+ * @return the generation of the file the path names as of the last check
+ */
+unsigned int shared_file_generation(struct shared_file *sf);
+
+#endif /* AESDSOCKET_SHARED_FILE_H */
@@ -0,0 +1,613 @@
+/**
+ * @file store-backend.c
+ * @brief Storage backends for the aesdsocket data store
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+#include "store-backend.h"
+#include "store-cache.h"
+#include "segment-log.h"
+#include "commit-queue.h"
+#include "readback.h"
+#include "line-stream.h"
+#include "shared-file.h"
+#include "probes.h"
+
+#define DEVICE_PATH "/dev/aesdchar"
+#define FILE_PATH "/var/tmp/aesdsocketdata"
+#define SEGMENT_PATH "/var/tmp/aesdsocketdata.d"
+#define SCAN_READ_SIZE (16 * 1024)
+
+static const char *device_path = DEVICE_PATH;
+static const char *file_path = FILE_PATH;
+static struct shared_file device_file;
+static struct shared_file data_file;
+
+// the seek ioctl and lseek() move the position of the shared device descriptor
+static pthread_mutex_t device_seek_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// where every command of the data file starts, so commands are found without scanning the file
+static struct {
+    off_t *starts;
+    size_t count;
+    size_t cap;
+    off_t size;         // bytes of the file covered
+    int at_boundary;    // the next byte starts a command
+    int failed;         // the index could not grow, commands are found by scanning instead
+    unsigned int generation;    // of data_file when the index was built
+} file_index = { .at_boundary = 1 };
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// write the buffers to the append descriptor of @param sf and report the resulting size
+static int fd_append(struct shared_file *sf, const struct iovec *iov, int iovcnt, off_t *size) {
+    struct iovec pending[COMMIT_MAX_BATCH];
+    struct iovec *v = pending;
+    int ret = 0;
+
+    *size = -1;
+    struct file_ref *ref = shared_file_get(sf, SHARED_FILE_APPEND);
+    if (!ref) return -1;
+    int file_fd = ref->fd;
+
+    // the driver only takes one command per write, keep going after a short write
+    memcpy(pending, iov, iovcnt * sizeof(struct iovec));
+    for (int left = iovcnt; left > 0; ) {
+        ssize_t n = writev(file_fd, v, left);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "Failed to write to file: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+        while (left > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            left--;
+        }
+        if (left > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+
+    *size = lseek(file_fd, 0, SEEK_END);
+    if (ret == -1) {
+        shared_file_failed(sf, ref);
+    } else {
+        shared_file_put(ref);
+    }
+    return ret;
+}
+
+
+// start sending the given range of @param sf from its shared read descriptor
+static int fd_read_range(struct shared_file *sf, struct readback *rb, off_t start, off_t len) {
+    struct file_ref *ref = shared_file_get(sf, SHARED_FILE_READ);
+    if (!ref) return -1;
+    readback_start_ref(rb, ref, start);
+    if (len >= 0) readback_limit(rb, len);
+    return 0;
+}
+
+
+static void fd_rebuild_cache(const char *path) {
+    int file_fd = open(path, O_CREAT | O_RDONLY, S_IRWXU | S_IRGRP | S_IROTH);
+    if (file_fd == -1) {
+        syslog(LOG_ERR, "Failed to open file for cache rebuild: %s", strerror(errno));
+        return;
+    }
+    cache_rebuild(file_fd, NULL, 0);
+    close(file_fd);
+}
+
+
+static int device_open(const struct store_config *cfg) {
+    if (cfg->path) device_path = cfg->path;
+    shared_file_init(&device_file, device_path);
+    return 0;
+}
+
+
+static int device_append(const struct iovec *iov, int iovcnt, off_t *size, size_t *trimmed) {
+    *trimmed = 0;   // evictions are reflected by the size, the cache evicts on its own
+    return fd_append(&device_file, iov, iovcnt, size);
+}
+
+
+static int device_read_range(struct readback *rb, off_t start, off_t len) {
+    return fd_read_range(&device_file, rb, start, len);
+}
+
+
+static off_t device_locate(unsigned int write_cmd, unsigned int write_cmd_offset) {
+    struct file_ref *ref = shared_file_get(&device_file, SHARED_FILE_READ);
+    if (!ref) return -1;
+
+    struct aesd_seekto seekto;
+    seekto.write_cmd = write_cmd;
+    seekto.write_cmd_offset = write_cmd_offset;
+    off_t pos = -1;
+    pthread_mutex_lock(&device_seek_lock);
+    if (ioctl(ref->fd, AESDCHAR_IOCSEEKTO, &seekto) < 0) {
+        // EINVAL is an offset past the end of the command, the caller reports the bad seek
+        if (errno != EINVAL) syslog(LOG_ERR, "Failed to perform ioctl: %s", strerror(errno));
+    } else {
+        // the driver moved the file position to the command
+        pos = lseek(ref->fd, 0, SEEK_CUR);
+    }
+    AESD_PROBE4(ioctl_seek, ref->fd, write_cmd, write_cmd_offset, pos);
+    pthread_mutex_unlock(&device_seek_lock);
+    shared_file_put(ref);
+    return pos;
+}
+
+
+static off_t device_size(void) {
+    struct file_ref *ref = shared_file_get(&device_file, SHARED_FILE_READ);
+    if (!ref) return -1;
+    pthread_mutex_lock(&device_seek_lock);
+    off_t size = lseek(ref->fd, 0, SEEK_END);
+    pthread_mutex_unlock(&device_seek_lock);
+    shared_file_put(ref);
+    return size;
+}
+
+
+// the driver takes command numbers modulo its ring and puts one it does not hold at the
+// end of the data, so the commands held are the ones starting before the end
+static int64_t device_records(void) {
+    struct file_ref *ref = shared_file_get(&device_file, SHARED_FILE_READ);
+    if (!ref) return -1;
+
+    int64_t count = 0;
+    pthread_mutex_lock(&device_seek_lock);
+    off_t size = lseek(ref->fd, 0, SEEK_END);
+    while (size > 0 && count < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        struct aesd_seekto seekto = { .write_cmd = count, .write_cmd_offset = 0 };
+        if (ioctl(ref->fd, AESDCHAR_IOCSEEKTO, &seekto) < 0) {
+            syslog(LOG_ERR, "Failed to perform ioctl: %s", strerror(errno));
+            break;
+        }
+        if (lseek(ref->fd, 0, SEEK_CUR) >= size) break;
+        count++;
+    }
+    pthread_mutex_unlock(&device_seek_lock);
+    shared_file_put(ref);
+    return size < 0 ? -1 : count;
+}
+
+
+static void device_rebuild_cache(void) {
+    fd_rebuild_cache(device_path);
+}
+
+
+static void device_close(int remove_data) {
+    shared_file_close(&device_file);
+}
+
+
+const struct store_backend device_backend = {
+    .name = "device",
+    .max_records = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+    .show_partial = 0,
+    .timestamps = 0,
+    .exclusive = 0,
+    .open = device_open,
+    .append = device_append,
+    .read_range = device_read_range,
+    .locate = device_locate,
+    .records = device_records,
+    .size = device_size,
+    .sync = NULL,
+    .rebuild_cache = device_rebuild_cache,
+    .close = device_close,
+};
+
+
+// index_lock must be held
+static int index_push(off_t start) {
+    if (file_index.count == file_index.cap) {
+        size_t cap = file_index.cap ? file_index.cap * 2 : 1024;
+        off_t *starts = realloc(file_index.starts, cap * sizeof(off_t));
+        if (!starts) {
+            syslog(LOG_ERR, "Failed to grow the file index, seeking scans the file");
+            file_index.failed = 1;
+            return -1;
+        }
+        file_index.starts = starts;
+        file_index.cap = cap;
+    }
+    file_index.starts[file_index.count++] = start;
+    return 0;
+}
+
+
+// record the commands starting in the next @param len bytes of the file, index_lock must be held
+static void index_bytes(const char *buf, size_t len) {
+    uint32_t ends[LINE_STREAM_BATCH];
+    size_t scanned = 0;
+    size_t n;
+
+    if (file_index.failed || len == 0) return;
+    if (file_index.at_boundary && index_push(file_index.size) != 0) return;
+    file_index.at_boundary = 0;
+
+    do {
+        n = line_scan(buf + scanned, len - scanned, ends, LINE_STREAM_BATCH);
+        for (size_t i = 0; i < n; i++) {
+            size_t next = scanned + ends[i];
+            if (next == len) {
+                file_index.at_boundary = 1;
+            } else if (index_push(file_index.size + next) != 0) {
+                return;
+            }
+        }
+        if (n > 0) scanned += ends[n - 1];
+    } while (n == LINE_STREAM_BATCH);
+    file_index.size += len;
+}
+
+
+// index the file from where the index ends, index_lock must be held
+static void index_file(void) {
+    char buf[SCAN_READ_SIZE];
+    ssize_t n;
+
+    struct file_ref *ref = shared_file_get(&data_file, SHARED_FILE_READ);
+    if (!ref) return;
+    while ((n = pread(ref->fd, buf, sizeof(buf), file_index.size)) > 0) {
+        index_bytes(buf, n);
+        if (file_index.failed) break;
+    }
+    shared_file_put(ref);
+}
+
+
+// start over once the data file was replaced, index_lock must be held
+static void index_current(void) {
+    unsigned int generation = shared_file_generation(&data_file);
+    if (generation == file_index.generation) return;
+
+    free(file_index.starts);
+    memset(&file_index, 0, sizeof(file_index));
+    file_index.at_boundary = 1;
+    file_index.generation = generation;
+    index_file();
+}
+
+
+// index_current() for lookups, which also take in what another process appended, such
+// as a server still draining after a hot restart, index_lock must be held
+static void index_latest(void) {
+    unsigned int generation = file_index.generation;
+    index_current();
+    if (file_index.generation == generation && !file_index.failed) index_file();
+}
+
+
+static int file_open(const struct store_config *cfg) {
+    if (cfg->path) file_path = cfg->path;
+    shared_file_init(&data_file, file_path);
+
+    pthread_mutex_lock(&index_lock);
+    index_file();
+    pthread_mutex_unlock(&index_lock);
+    return 0;
+}
+
+
+static int file_append(const struct iovec *iov, int iovcnt, off_t *size, size_t *trimmed) {
+    *trimmed = 0;
+    pthread_mutex_lock(&index_lock);
+    off_t indexed = file_index.size;
+    unsigned int generation = file_index.generation;
+    pthread_mutex_unlock(&index_lock);
+    int ret = fd_append(&data_file, iov, iovcnt, size);
+
+    pthread_mutex_lock(&index_lock);
+    index_current();
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+    if (file_index.generation != generation) {
+        // index_current() indexed the new file, this write included
+    } else if (ret == 0 && *size == indexed + (off_t)len) {
+        // a lookup may have indexed the start of this write already, skip what it covered
+        off_t skip = file_index.size - indexed;
+        for (int i = 0; i < iovcnt; i++) {
+            if (skip >= (off_t)iov[i].iov_len) {
+                skip -= iov[i].iov_len;
+                continue;
+            }
+            index_bytes((const char *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+            skip = 0;
+        }
+    } else {
+        // not everything arrived or someone else wrote to the file, index what is there
+        index_file();
+    }
+    pthread_mutex_unlock(&index_lock);
+    return ret;
+}
+
+
+static int file_read_range(struct readback *rb, off_t start, off_t len) {
+    return fd_read_range(&data_file, rb, start, len);
+}
+
+
+// find where @param write_cmd_offset bytes into command @param write_cmd lies, -1 if outside the file
+static off_t find_command(int fd, unsigned int write_cmd, unsigned int write_cmd_offset) {
+    char buf[SCAN_READ_SIZE];
+    unsigned int newlines = 0;
+    off_t pos = 0;
+    off_t start = write_cmd == 0 ? 0 : -1;
+    ssize_t n;
+
+    while ((n = pread(fd, buf, sizeof(buf), pos)) > 0) {
+        const char *p = buf;
+        const char *end = buf + n;
+
+        while (start < 0) {
+            const char *newline = memchr(p, '\n', end - p);
+            if (!newline) break;
+            p = newline + 1;
+            if (++newlines == write_cmd) start = pos + (p - buf);
+        }
+        if (start >= 0) {
+            // the command must not end before the target byte
+            off_t target = start + write_cmd_offset;
+            const char *from = start > pos ? buf + (start - pos) : buf;
+            if (target < pos + n) {
+                return memchr(from, '\n', buf + (target - pos) - from) ? -1 : target;
+            }
+            if (memchr(from, '\n', end - from)) return -1;
+        }
+        pos += n;
+    }
+    return -1;
+}
+
+
+static off_t file_locate(unsigned int write_cmd, unsigned int write_cmd_offset) {
+    off_t pos = -1;
+
+    pthread_mutex_lock(&index_lock);
+    index_latest();
+    if (file_index.failed) {
+        pthread_mutex_unlock(&index_lock);
+        struct file_ref *ref = shared_file_get(&data_file, SHARED_FILE_READ);
+        if (!ref) return -1;
+        pos = find_command(ref->fd, write_cmd, write_cmd_offset);
+        shared_file_put(ref);
+        return pos;
+    }
+    if (write_cmd < file_index.count) {
+        off_t start = file_index.starts[write_cmd];
+        off_t end = write_cmd + 1 < file_index.count ? file_index.starts[write_cmd + 1] : file_index.size;
+        if (write_cmd_offset < end - start) pos = start + write_cmd_offset;
+    }
+    pthread_mutex_unlock(&index_lock);
+    return pos;
+}
+
+
+static int64_t file_records(void) {
+    pthread_mutex_lock(&index_lock);
+    index_latest();
+    int64_t count = file_index.failed ? -1 : (int64_t)file_index.count;
+    pthread_mutex_unlock(&index_lock);
+    return count;
+}
+
+
+static off_t file_size(void) {
+    struct stat st;
+    if (stat(file_path, &st) == -1) return -1;
+    return st.st_size;
+}
+
+
+static int file_sync(void) {
+    struct file_ref *ref = shared_file_get(&data_file, SHARED_FILE_APPEND);
+    if (!ref) return -1;
+    int ret = fdatasync(ref->fd);
+    if (ret == -1) syslog(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+    shared_file_put(ref);
+    return ret;
+}
+
+
+static void file_rebuild_cache(void) {
+    fd_rebuild_cache(file_path);
+}
+
+
+static void file_close(int remove_data) {
+    shared_file_close(&data_file);
+    if (remove_data) remove(file_path);
+
+    pthread_mutex_lock(&index_lock);
+    free(file_index.starts);
+    memset(&file_index, 0, sizeof(file_index));
+    file_index.at_boundary = 1;
+    pthread_mutex_unlock(&index_lock);
+}
+
+
+const struct store_backend file_backend = {
+    .name = "file",
+    .max_records = 0,
+    .show_partial = 1,
+    .timestamps = 1,
+    .exclusive = 0,
+    .open = file_open,
+    .append = file_append,
+    .read_range = file_read_range,
+    .locate = file_locate,
+    .records = file_records,
+    .size = file_size,
+    .sync = file_sync,
+    .rebuild_cache = file_rebuild_cache,
+    .close = file_close,
+};
+
+
+static int segment_open(const struct store_config *cfg) {
+    return seglog_open(cfg->path ? cfg->path : SEGMENT_PATH, cfg->segment_bytes,
+                       cfg->retain_bytes, cfg->retain_secs);
+}
+
+
+static int segment_append(const struct iovec *iov, int iovcnt, off_t *size, size_t *trimmed) {
+    int ret = seglog_append(iov, iovcnt, trimmed);
+    *size = seglog_size();
+    return ret;
+}
+
+
+static int segment_read_range(struct readback *rb, off_t start, off_t len) {
+    uint64_t cursor;
+    int file_fd = seglog_open_offset(start, &cursor);
+    if (file_fd == -1) return -1;
+    readback_start_chain(rb, file_fd, seglog_open_next, cursor);
+    if (len >= 0) readback_limit(rb, len);
+    return 0;
+}
+
+
+static off_t segment_locate(unsigned int write_cmd, unsigned int write_cmd_offset) {
+    // the index maps the command straight to its segment and offset
+    return seglog_locate(write_cmd, write_cmd_offset);
+}
+
+
+static int64_t segment_records(void) {
+    return seglog_records();
+}
+
+
+static off_t segment_size(void) {
+    return seglog_size();
+}
+
+
+static void segment_rebuild_cache(void) {
+    uint64_t cursor;
+    int file_fd = seglog_open_all(&cursor);
+    if (file_fd == -1) return;
+    cache_rebuild(file_fd, seglog_open_next, cursor);
+    close(file_fd);
+}
+
+
+const struct store_backend segment_backend = {
+    .name = "segments",
+    .max_records = 0,
+    .show_partial = 1,
+    .timestamps = 1,
+    .exclusive = 1,
+    .open = segment_open,
+    .append = segment_append,
+    .read_range = segment_read_range,
+    .locate = segment_locate,
+    .records = segment_records,
+    .size = segment_size,
+    .sync = seglog_sync,
+    .rebuild_cache = segment_rebuild_cache,
+    .close = seglog_close,
+};
+
+
+static int memory_open(const struct store_config *cfg) {
+    // the cache chain with the driver's ring rules is the whole store
+    cache_init(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, 0);
+    cache_reset();
+    return 0;
+}
+
+
+static int memory_append(const struct iovec *iov, int iovcnt, off_t *size, size_t *trimmed) {
+    *size = -1;
+    *trimmed = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (cache_append(iov[i].iov_base, iov[i].iov_len, -1) == -1) {
+            syslog(LOG_ERR, "Memory store lost its contents");
+            cache_reset();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int memory_read_range(struct readback *rb, off_t start, off_t len) {
+    struct cache_snapshot snap;
+    if (cache_snapshot_from(&snap, start) != 0) return -1;
+    readback_start_snapshot(rb, &snap);
+    if (len >= 0) readback_limit(rb, len);
+    return 0;
+}
+
+
+static off_t memory_locate(unsigned int write_cmd, unsigned int write_cmd_offset) {
+    return cache_locate(write_cmd, write_cmd_offset);
+}
+
+
+static int64_t memory_records(void) {
+    return cache_records();
+}
+
+
+static off_t memory_size(void) {
+    return cache_size();
+}
+
+
+static void memory_close(int remove_data) {
+    cache_destroy();
+}
+
+
+const struct store_backend memory_backend = {
+    .name = "memory",
+    .max_records = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+    .show_partial = 0,
+    .timestamps = 0,
+    .in_cache = 1,
+    .exclusive = 0,
+    .open = memory_open,
+    .append = memory_append,
+    .read_range = memory_read_range,
+    .locate = memory_locate,
+    .records = memory_records,
+    .size = memory_size,
+    .sync = NULL,
+    .rebuild_cache = NULL,
+    .close = memory_close,
+};
+
+
+const struct store_backend *store_backend_find(const char *name) {
+    static const struct store_backend *const backends[] = {
+        &device_backend, &file_backend, &segment_backend, &memory_backend,
+    };
+
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i]->name, name) == 0) return backends[i];
+    }
+    return NULL;
+}
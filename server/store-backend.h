@@ -0,0 +1,115 @@
+/**
+ * @file store-backend.h
+ * @brief Storage backends for the aesdsocket data store
+ *
+ * The server reaches its data store only through a backend, picked at startup:
+ * the aesdchar device, a regular file, the segmented log, or a ring kept purely in
+ * memory that follows the driver's eviction rules.  All calls except read_range(),
+ * locate() and size() must be serialized by the caller's writer lock.
+ */
+
+#ifndef AESDSOCKET_STORE_BACKEND_H
+#define AESDSOCKET_STORE_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct readback;
+
+struct store_config {
+    /**
+     * Where the backend keeps its data, NULL for the backend's default
+     */
+    const char *path;
+    /**
+     * For the segmented log, see seglog_open()
+     */
+    size_t segment_bytes;
+    size_t retain_bytes;
+    long retain_secs;
+};
+
+struct store_backend {
+    const char *name;
+    /**
+     * Records the store keeps before evicting the oldest, 0 if unbounded
+     */
+    unsigned int max_records;
+    /**
+     * Nonzero if data not terminated by a newline yet is readable
+     */
+    int show_partial;
+    /**
+     * Nonzero if the periodic timestamp records are appended to this store
+     */
+    int timestamps;
+    /**
+     * Nonzero if the store already lives in the store cache, so there is nothing to mirror
+     */
+    int in_cache;
+    /**
+     * Nonzero if only one process may have the store open, a server taking over from
+     * another waits for it to close the store
+     */
+    int exclusive;
+
+    /**
+     * @return 0 on success, -1 on error
+     */
+    int (*open)(const struct store_config *cfg);
+    /**
+     * Append the buffers, retrying short writes.
+     * @param size set to the size of the store afterwards, -1 if unknown
+     * @param trimmed set to the number of bytes retention removed from the start of the store
+     * @return 0 on success, -1 on error
+     */
+    int (*append)(const struct iovec *iov, int iovcnt, off_t *size, size_t *trimmed);
+    /**
+     * Start sending @param len bytes from byte @param start of the store through @param rb,
+     * @param len -1 for everything up to the end.
+     * @return 0 on success, -1 on error
+     */
+    int (*read_range)(struct readback *rb, off_t start, off_t len);
+    /**
+     * Find the byte @param write_cmd_offset bytes into command @param write_cmd, counted from
+     * the oldest command, like the AESDCHAR_IOCSEEKTO ioctl.
+     * @return the byte offset for read_range(), -1 if the position does not exist or on error
+     */
+    off_t (*locate)(unsigned int write_cmd, unsigned int write_cmd_offset);
+    /**
+     * @return the number of commands locate() can find, -1 on error.  NULL if the backend
+     *      has no count and it has to be found through locate().
+     */
+    int64_t (*records)(void);
+    /**
+     * @return the number of readable bytes, -1 on error
+     */
+    off_t (*size)(void);
+    /**
+     * Make everything appended so far durable, NULL if the backend has nothing to sync.
+     * @return 0 on success, -1 on error
+     */
+    int (*sync)(void);
+    /**
+     * Replace the store cache contents with the store, NULL if in_cache is set
+     */
+    void (*rebuild_cache)(void);
+    /**
+     * @param remove_data nonzero to delete the stored data
+     */
+    void (*close)(int remove_data);
+};
+
+extern const struct store_backend device_backend;
+extern const struct store_backend file_backend;
+extern const struct store_backend segment_backend;
+extern const struct store_backend memory_backend;
+
+/**
+ * @return the backend called @param name, NULL if there is none
+ */
+const struct store_backend *store_backend_find(const char *name);
+
+#endif /* AESDSOCKET_STORE_BACKEND_H */
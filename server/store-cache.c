@@ -0,0 +1,375 @@
+/**
+ * @file store-cache.c
+ * @brief In-memory mirror of the aesdsocket data store
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include "store-cache.h"
+
+#define REBUILD_READ_SIZE (64 * 1024)
+
+// cache_lock protects the chain against concurrent snapshots, writers are serialized by the store
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int enabled;
+static int valid;
+static unsigned int max_records;
+static int show_partial;
+static struct cache_chunk *head;    // the cache owns one reference on the oldest chunk
+static struct cache_chunk *tail;
+static unsigned int nrecords;
+static size_t total;
+static uint64_t version;
+
+// data written to a store that hides partial records, waiting for its newline
+static char *pending;
+static size_t pending_len;
+
+
+void cache_chunk_get(struct cache_chunk *chunk) {
+    __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+void cache_chunk_put(struct cache_chunk *chunk) {
+    while (chunk && __atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct cache_chunk *next = cache_chunk_next(chunk);
+        free(chunk);
+        chunk = next;   // the freed chunk owned a reference on its successor
+    }
+}
+
+
+static struct cache_chunk *chunk_new(const char *a, size_t alen, const char *b, size_t blen) {
+    struct cache_chunk *chunk = malloc(sizeof(struct cache_chunk) + alen + blen);
+    if (!chunk) return NULL;
+    chunk->next = NULL;
+    chunk->refs = 1;    // owned by the predecessor's next link, or by the cache as head
+    chunk->len = alen + blen;
+    if (alen) memcpy(chunk->data, a, alen);
+    if (blen) memcpy(chunk->data + alen, b, blen);
+    return chunk;
+}
+
+
+// cache_lock must be held
+static void chain_append(struct cache_chunk *chunk) {
+    chunk->version = ++version;
+    if (tail) {
+        __atomic_store_n(&tail->next, chunk, __ATOMIC_RELEASE);
+    } else {
+        head = chunk;
+    }
+    tail = chunk;
+    total += chunk->len;
+    nrecords++;
+}
+
+
+// cache_lock must be held
+static void chain_drop_head(void) {
+    struct cache_chunk *old = head;
+
+    head = cache_chunk_next(old);
+    if (head) {
+        cache_chunk_get(head);
+    } else {
+        tail = NULL;
+    }
+    total -= old->len;
+    nrecords--;
+    version++;
+    cache_chunk_put(old);
+}
+
+
+// cache_lock must be held
+static void chain_clear(void) {
+    if (head) cache_chunk_put(head);
+    head = tail = NULL;
+    total = 0;
+    nrecords = 0;
+    version++;
+}
+
+
+void cache_init(unsigned int records, int partial) {
+    pthread_mutex_lock(&cache_lock);
+    max_records = records;
+    show_partial = partial;
+    enabled = 1;
+    valid = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+int cache_enabled(void) {
+    return enabled;
+}
+
+
+static int append_record(const char *buf, size_t len) {
+    struct cache_chunk *chunk = chunk_new(pending, pending_len, buf, len);
+    if (!chunk) return -1;
+
+    free(pending);
+    pending = NULL;
+    pending_len = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    chain_append(chunk);
+    while (max_records && nrecords > max_records) {
+        chain_drop_head();
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+
+static int append_pending(const char *buf, size_t len) {
+    char *p = realloc(pending, pending_len + len);
+    if (!p) return -1;
+    memcpy(p + pending_len, buf, len);
+    pending = p;
+    pending_len += len;
+    return 0;
+}
+
+
+int cache_append(const char *buf, size_t len, off_t store_size) {
+    int ret = 0;
+
+    if (!valid) return -1;
+
+    if (show_partial) {
+        ret = append_record(buf, len);
+    } else {
+        const char *newline;
+        while (ret == 0 && (newline = memchr(buf, '\n', len)) != NULL) {
+            size_t n = newline - buf + 1;
+            ret = append_record(buf, n);
+            buf += n;
+            len -= n;
+        }
+        if (ret == 0 && len) ret = append_pending(buf, len);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (ret == -1) {
+        syslog(LOG_ERR, "Failed to allocate memory for cache, invalidating it");
+        valid = 0;
+    } else if (store_size >= 0 && (size_t)store_size != total) {
+        // someone else wrote to the store or it evicted differently than we expected
+        syslog(LOG_INFO, "Cache out of sync with store (%zu != %lld bytes), rebuilding",
+               total, (long long)store_size);
+        valid = 0;
+        ret = -1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+
+void cache_reset(void) {
+    pthread_mutex_lock(&cache_lock);
+    chain_clear();
+    valid = 1;
+    pthread_mutex_unlock(&cache_lock);
+
+    free(pending);
+    pending = NULL;
+    pending_len = 0;
+}
+
+
+void cache_trim(size_t bytes) {
+    pthread_mutex_lock(&cache_lock);
+    while (valid && bytes > 0 && head) {
+        if (head->len > bytes) {
+            syslog(LOG_INFO, "Store trimmed inside a cached record, rebuilding cache");
+            valid = 0;
+            break;
+        }
+        bytes -= head->len;
+        chain_drop_head();
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+// append everything readable from @param fd to the rebuild buffer
+static int read_store(int fd, char **data, size_t *len, size_t *cap) {
+    ssize_t n;
+
+    do {
+        if (*len == *cap) {
+            size_t new_cap = *cap + REBUILD_READ_SIZE;
+            char *p = realloc(*data, new_cap);
+            if (!p) {
+                syslog(LOG_ERR, "Failed to allocate memory for cache rebuild");
+                return -1;
+            }
+            *data = p;
+            *cap = new_cap;
+        }
+        n = read(fd, *data + *len, *cap - *len);
+        if (n > 0) *len += n;
+    } while (n > 0 || (n < 0 && errno == EINTR));
+
+    if (n < 0) {
+        syslog(LOG_ERR, "Failed to read store for cache rebuild: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+int cache_rebuild(int fd, store_next_fn next, uint64_t cursor) {
+    char *data = NULL;
+    size_t len = 0, cap = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    valid = 0;
+    chain_clear();
+    pthread_mutex_unlock(&cache_lock);
+
+    int ret = read_store(fd, &data, &len, &cap);
+    while (ret == 0 && next && (fd = next(&cursor)) != -1) {
+        ret = read_store(fd, &data, &len, &cap);
+        close(fd);
+    }
+    if (ret != 0) {
+        free(data);
+        return -1;
+    }
+
+    // pending data stays, a store hiding partial records does not return it on read either
+    size_t off = 0;
+    while (ret == 0 && off < len) {
+        const char *newline = memchr(data + off, '\n', len - off);
+        size_t rec_len = newline ? (size_t)(newline - (data + off)) + 1 : len - off;
+        if (!newline && !show_partial) break;
+        struct cache_chunk *chunk = chunk_new(data + off, rec_len, NULL, 0);
+        if (!chunk) {
+            syslog(LOG_ERR, "Failed to allocate memory for cache rebuild");
+            ret = -1;
+            break;
+        }
+        pthread_mutex_lock(&cache_lock);
+        chain_append(chunk);
+        pthread_mutex_unlock(&cache_lock);
+        off += rec_len;
+    }
+    free(data);
+
+    pthread_mutex_lock(&cache_lock);
+    if (ret == 0) {
+        valid = 1;
+    } else {
+        chain_clear();
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+
+int cache_snapshot(struct cache_snapshot *snap) {
+    pthread_mutex_lock(&cache_lock);
+    if (!valid) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    snap->first = head;
+    if (head) cache_chunk_get(head);
+    snap->last = tail;
+    snap->skip = 0;
+    snap->version = version;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+
+int cache_snapshot_from(struct cache_snapshot *snap, size_t start) {
+    int ret = -1;
+
+    pthread_mutex_lock(&cache_lock);
+    if (!valid || start > total) goto out;
+
+    struct cache_chunk *chunk = head;
+    while (chunk && start >= chunk->len) {
+        start -= chunk->len;
+        chunk = chunk == tail ? NULL : cache_chunk_next(chunk);
+    }
+
+    snap->first = chunk;
+    if (chunk) cache_chunk_get(chunk);
+    snap->last = chunk ? tail : NULL;
+    snap->skip = start;
+    snap->version = version;
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+
+off_t cache_size(void) {
+    pthread_mutex_lock(&cache_lock);
+    off_t size = valid ? (off_t)total : -1;
+    pthread_mutex_unlock(&cache_lock);
+    return size;
+}
+
+
+off_t cache_locate(unsigned int write_cmd, unsigned int write_cmd_offset) {
+    off_t pos = -1;
+
+    pthread_mutex_lock(&cache_lock);
+    // only a ring of records like the aesdchar driver keeps one chunk per command
+    if (!valid || max_records == 0 || write_cmd >= max_records) goto out;
+
+    struct cache_chunk *chunk = head;
+    off_t start = 0;
+    for (unsigned int i = 0; chunk && i < write_cmd; i++) {
+        start += chunk->len;
+        chunk = chunk == tail ? NULL : cache_chunk_next(chunk);
+    }
+    if (chunk && write_cmd_offset < chunk->len) pos = start + write_cmd_offset;
+
+out:
+    pthread_mutex_unlock(&cache_lock);
+    return pos;
+}
+
+
+int64_t cache_records(void) {
+    int64_t count = -1;
+
+    pthread_mutex_lock(&cache_lock);
+    if (valid && max_records != 0) {
+        count = 0;
+        for (struct cache_chunk *chunk = head; chunk; chunk = chunk == tail ? NULL : cache_chunk_next(chunk)) {
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return count;
+}
+
+
+void cache_destroy(void) {
+    pthread_mutex_lock(&cache_lock);
+    chain_clear();
+    enabled = 0;
+    valid = 0;
+    pthread_mutex_unlock(&cache_lock);
+
+    free(pending);
+    pending = NULL;
+    pending_len = 0;
+}
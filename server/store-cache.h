@@ -0,0 +1,146 @@
+/**
+ * @file store-cache.h
+ * @brief In-memory mirror of the aesdsocket data store
+ *
+ * Every committed write becomes an immutable, reference counted chunk appended to a
+ * singly linked chain.  Each chunk holds a reference on its successor and the cache
+ * holds one on the oldest chunk, so a reader pins everything it is going to send by
+ * taking a single reference on the first chunk of its snapshot.  Dropping old records
+ * only moves the head of the chain; chunks are freed once no snapshot uses them.
+ */
+
+#ifndef AESDSOCKET_STORE_CACHE_H
+#define AESDSOCKET_STORE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "aesdsocket.h"
+
+struct cache_chunk {
+    /**
+     * The following chunk, published once it is appended
+     */
+    struct cache_chunk *next;
+    /**
+     * The cache version that appended this chunk
+     */
+    uint64_t version;
+    int refs;
+    size_t len;
+    char data[];
+};
+
+/**
+ * A consistent view of a byte range of the store.  Holds a reference on @param first.
+ */
+struct cache_snapshot {
+    struct cache_chunk *first;
+    struct cache_chunk *last;
+    /**
+     * Bytes of @param first that are not part of the snapshot
+     */
+    size_t skip;
+    uint64_t version;
+};
+
+/**
+ * Enable the cache.
+ * @param max_records the number of complete records the store keeps before evicting the oldest,
+ *      0 if the store never evicts
+ * @param show_partial nonzero if data not terminated by a newline is visible to readers right away,
+ *      as for a regular file.  Otherwise it is held back until the newline arrives, like the
+ *      working entry of the aesdchar driver.
+ */
+void cache_init(unsigned int max_records, int show_partial);
+
+/**
+ * @return nonzero if cache_init() was called
+ */
+int cache_enabled(void);
+
+/**
+ * Mirror a write that was just committed to the store.  Must be called with the store
+ * writer lock held, in commit order.
+ * @param store_size the size of the store reported after the write, or -1 if unknown
+ * @return 0 on success, -1 if the mirror no longer matches the store and cache_rebuild() must be called
+ */
+int cache_append(const char *buf, size_t len, off_t store_size);
+
+/**
+ * Empty the cache and mark it valid, for a store that is empty as well.  Must be called with
+ * the store writer lock held.
+ */
+void cache_reset(void);
+
+/**
+ * Drop the oldest @param bytes bytes, removed from the start of the store.  Must be called
+ * with the store writer lock held.  A cut that does not fall between two records
+ * invalidates the cache.
+ */
+void cache_trim(size_t bytes);
+
+/**
+ * Replace the contents of the cache with everything readable from @param fd, split into
+ * newline terminated records.  Must be called with the store writer lock held.
+ * @param next if set, the store continues with every descriptor it returns for @param cursor.
+ *      Those are closed again, @param fd is left to the caller.
+ * @return 0 on success, -1 on error, in which case the cache stays invalid until the next rebuild
+ */
+int cache_rebuild(int fd, store_next_fn next, uint64_t cursor);
+
+/**
+ * Take a snapshot of the whole store.
+ * @return 0 on success, -1 if the cache is currently invalid.  An empty store gives a snapshot
+ *      with @param snap first set to NULL.
+ */
+int cache_snapshot(struct cache_snapshot *snap);
+
+/**
+ * Take a snapshot starting @param start bytes into the store.
+ * @return 0 on success, -1 if the cache is invalid or @param start is past the end
+ */
+int cache_snapshot_from(struct cache_snapshot *snap, size_t start);
+
+/**
+ * @return the number of readable bytes in the cache, -1 if it is currently invalid
+ */
+off_t cache_size(void);
+
+/**
+ * Find the byte @param write_cmd_offset bytes into record @param write_cmd, following the
+ * rules of the AESDCHAR_IOCSEEKTO ioctl.
+ * @return the byte offset for cache_snapshot_from(), -1 if the cache is invalid or the
+ *      position does not exist
+ */
+off_t cache_locate(unsigned int write_cmd, unsigned int write_cmd_offset);
+
+/**
+ * @return the number of records in the cache, -1 if the cache is invalid or does not keep
+ *      one chunk per record
+ */
+int64_t cache_records(void);
+
+/**
+ * Take an additional reference on @param chunk.
+ */
+void cache_chunk_get(struct cache_chunk *chunk);
+
+/**
+ * Drop a reference on @param chunk, freeing it and any successors nobody else uses.
+ */
+void cache_chunk_put(struct cache_chunk *chunk);
+
+/**
+ * @return the chunk following @param chunk, or NULL if it is the newest one
+ */
+static inline struct cache_chunk *cache_chunk_next(struct cache_chunk *chunk) {
+    return __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Release the cache contents.  Outstanding snapshots stay valid.
+ */
+void cache_destroy(void);
+
+#endif /* AESDSOCKET_STORE_CACHE_H */
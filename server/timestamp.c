@@ -0,0 +1,184 @@
+/**
+ * @file timestamp.c
+ * @brief Periodic timestamp records for the aesdsocket data store
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "aesdsocket.h"
+#include "commit-queue.h"
+#include "timestamp.h"
+
+static int timer_fd = -1;
+static const char *ts_format;
+
+// the record last formatted and the second it was formatted for
+static char record[TS_BUFFER_SIZE];
+static size_t record_len;
+static time_t record_time = -1;
+static int too_long_logged;
+
+// the record queued for the commit thread, not reused until it completed
+static struct commit_req ts_req;
+static int ts_pending;
+
+static int stop_fd = -1;
+static pthread_t ts_thread;
+
+
+// @return the record for @param now, formatting it only when the second changed, NULL if
+// it does not fit the buffer
+static const char *format_record(time_t now, size_t *len) {
+    if (now != record_time) {
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        record_len = strftime(record, sizeof(record) - 1, ts_format, &tm_info);
+        // 0 is also an empty expansion, skipped all the same
+        if (record_len > 0) record[record_len++] = '\n';
+        record_time = now;
+    }
+    if (record_len == 0) {
+        if (!too_long_logged) {
+            syslog(LOG_ERR, "Timestamp format does not expand to 1 to %d characters, skipping records",
+                   TS_BUFFER_SIZE - 2);
+            too_long_logged = 1;
+        }
+        return NULL;
+    }
+    *len = record_len;
+    return record;
+}
+
+
+// runs on the commit thread
+static void ts_committed(struct commit_req *req) {
+    if (req->status != 0) syslog(LOG_ERR, "Failed to append timestamp");
+    ts_pending = 0;
+}
+
+
+int timestamp_init(long interval_s, const char *format) {
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        syslog(LOG_ERR, "Failed to create timerfd: %s", strerror(errno));
+        return -1;
+    }
+
+    // periodic from the start, a late tick does not push the following ones back
+    struct itimerspec spec = {
+        .it_value = { .tv_sec = interval_s },
+        .it_interval = { .tv_sec = interval_s },
+    };
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) == -1) {
+        syslog(LOG_ERR, "Failed to arm timerfd: %s", strerror(errno));
+        close(timer_fd);
+        timer_fd = -1;
+        return -1;
+    }
+    ts_format = format;
+    ts_req.done = ts_committed;
+    return 0;
+}
+
+
+int timestamp_fd(void) {
+    return timer_fd;
+}
+
+
+void timestamp_tick(void) {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) == -1) {
+        if (errno != EAGAIN) syslog(LOG_ERR, "Failed to read timerfd: %s", strerror(errno));
+        return;
+    }
+
+    // ticks missed while busy are not made up for, one record marks the current time
+    if (!commit_queue_enabled()) {
+        size_t len;
+        const char *buf = format_record(time(NULL), &len);
+        if (buf && store_append(buf, len) == -1) syslog(LOG_ERR, "Failed to append timestamp");
+        return;
+    }
+
+    if (ts_pending) {
+        syslog(LOG_ERR, "Previous timestamp not committed yet, skipping one");
+        return;
+    }
+    ts_req.buf = format_record(time(NULL), &ts_req.len);
+    if (!ts_req.buf) return;
+    ts_pending = 1;
+    commit_queue_submit(&ts_req);
+}
+
+
+static void *timestamp_thread(void *arg) {
+    struct pollfd fds[2] = {
+        { .fd = timer_fd, .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "poll failed: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents & POLLIN) break;
+        if (fds[0].revents & POLLIN) timestamp_tick();
+    }
+    return NULL;
+}
+
+
+int timestamp_start_thread(void) {
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_fd == -1) {
+        syslog(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    // the timestamp thread never handles SIGINT/SIGTERM, the accept loop in main has to see them
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int rc = pthread_create(&ts_thread, NULL, timestamp_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0) {
+        syslog(LOG_ERR, "Failed to create thread for timer");
+        close(stop_fd);
+        stop_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+void timestamp_stop(void) {
+    if (stop_fd != -1) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) == -1) {
+            syslog(LOG_ERR, "Failed to stop timestamp thread: %s", strerror(errno));
+        }
+        pthread_join(ts_thread, NULL);
+        close(stop_fd);
+        stop_fd = -1;
+    }
+    if (timer_fd != -1) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+}
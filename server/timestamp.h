@@ -0,0 +1,50 @@
+/**
+ * @file timestamp.h
+ * @brief Periodic timestamp records for the aesdsocket data store
+ *
+ * A timerfd fires every interval without drifting.  With group commit the commit thread
+ * watches the timerfd next to its queue and the record is queued like any other packet,
+ * so it is written in the same batch as the packets around it.  Otherwise a small thread
+ * waits for the timerfd and a stop eventfd, so shutting down never waits for a tick.
+ *
+ * The record is formatted with strftime() at most once per second.
+ */
+
+#ifndef AESDSOCKET_TIMESTAMP_H
+#define AESDSOCKET_TIMESTAMP_H
+
+#define TS_DEFAULT_INTERVAL_S 10
+#define TS_DEFAULT_FORMAT "timestamp:%a, %d %b %Y %T %z"
+#define TS_BUFFER_SIZE 128
+
+/**
+ * Arm the timer to add a record every @param interval_s seconds.
+ * @param format strftime() format of the record, a newline is appended
+ * @return 0 on success, -1 on error
+ */
+int timestamp_init(long interval_s, const char *format);
+
+/**
+ * @return the timerfd to watch for POLLIN, then call timestamp_tick(); -1 if not armed
+ */
+int timestamp_fd(void);
+
+/**
+ * Consume the expirations of the timer and add a timestamp record.  With the commit
+ * queue running it must be called on the commit thread and never blocks.
+ */
+void timestamp_tick(void);
+
+/**
+ * Start a thread ticking the timer, for when no commit thread watches it.
+ * @return 0 on success, -1 on error
+ */
+int timestamp_start_thread(void);
+
+/**
+ * Stop the timestamp thread if there is one and disarm the timer.  Call once nothing
+ * else watches timestamp_fd() any more.
+ */
+void timestamp_stop(void);
+
+#endif /* AESDSOCKET_TIMESTAMP_H */
@@ -0,0 +1,275 @@
+/**
+ * @file uring.c
+ * @brief Minimal io_uring ring for the event loops, on the raw system calls
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int sys_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+static int sys_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+// @return nonzero if the kernel implements every operation the event loops queue
+static int probe_ops(int fd) {
+    static const int needed[] = { IORING_OP_RECV, IORING_OP_POLL_ADD };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int ok = 0;
+
+    if (probe && sys_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        ok = 1;
+        for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+            if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) ok = 0;
+        }
+    }
+    free(probe);
+    return ok;
+}
+
+
+// set up a sparse fixed file table, a ring without one just does not use fixed files
+static void register_files(struct uring *ring, unsigned int nfiles) {
+    ring->files = malloc(nfiles * sizeof(int));
+    if (!ring->files) return;
+    for (unsigned int i = 0; i < nfiles; i++) ring->files[i] = -1;
+    if (sys_register(ring->fd, IORING_REGISTER_FILES, ring->files, nfiles) == -1) {
+        free(ring->files);
+        ring->files = NULL;
+        return;
+    }
+    ring->nfiles = nfiles;
+}
+
+
+int uring_init(struct uring *ring, unsigned int entries, unsigned int nfiles) {
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = sys_setup(entries, &p);
+    if (ring->fd == -1) return -1;
+
+    // without NODROP completions of a busy loop could be lost when the queue overflows
+    if (!(p.features & IORING_FEAT_NODROP) || !probe_ops(ring->fd)) {
+        close(ring->fd);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto fail_ring;
+    ring->cq_ring = ring->sq_ring;
+    if (ring->cq_ring_size) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) goto fail_sq;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail_cq;
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if (nfiles > 0) register_files(ring, nfiles);
+    return 0;
+
+fail_cq:
+    if (ring->cq_ring_size) munmap(ring->cq_ring, ring->cq_ring_size);
+fail_sq:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+fail_ring:
+    close(ring->fd);
+    return -1;
+}
+
+
+void uring_exit(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring->files);
+}
+
+
+// @return a cleared submission queue entry, NULL if the queue is full and could not be flushed
+static struct io_uring_sqe *get_sqe(struct uring *ring) {
+    unsigned int tail = *ring->sq_tail;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask) {
+        if (uring_submit_and_wait(ring, 0) == -1) return NULL;
+        if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask) return NULL;
+    }
+
+    unsigned int index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_queued++;
+    return sqe;
+}
+
+
+int uring_recv(struct uring *ring, int fd, int fixed, void *buf, size_t len, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = fixed ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+
+int uring_poll(struct uring *ring, int fd, int fixed, unsigned int events, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->flags = fixed ? IOSQE_FIXED_FILE : 0;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    events = (events << 16) | (events >> 16);   // the kernel reads the 16 bit halves swapped
+#endif
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+
+int uring_submit_and_wait(struct uring *ring, unsigned int wait_nr) {
+    int ret = sys_enter(ring->fd, ring->sq_queued, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    if (ret == -1) return -1;
+    ring->sq_queued -= ret;
+    return 0;
+}
+
+
+int uring_next_completion(struct uring *ring, uint64_t *user_data, int *res) {
+    unsigned int head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+static int update_file(struct uring *ring, unsigned int slot, int fd) {
+    struct io_uring_files_update update = { .offset = slot, .fds = (uintptr_t)&fd };
+    return sys_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1 ? 0 : -1;
+}
+
+
+int uring_file_add(struct uring *ring, int fd) {
+    for (unsigned int i = 0; i < ring->nfiles; i++) {
+        unsigned int slot = (ring->next_file + i) % ring->nfiles;
+        if (ring->files[slot] != -1) continue;
+        if (update_file(ring, slot, fd) == -1) return -1;
+        ring->files[slot] = fd;
+        ring->next_file = slot + 1;
+        return slot;
+    }
+    return -1;
+}
+
+
+void uring_file_remove(struct uring *ring, int slot) {
+    update_file(ring, slot, -1);
+    ring->files[slot] = -1;
+}
+
+#else /* !HAVE_IO_URING */
+
+int uring_init(struct uring *ring, unsigned int entries, unsigned int nfiles) {
+    memset(ring, 0, sizeof(*ring));
+    errno = ENOSYS;
+    return -1;
+}
+
+
+void uring_exit(struct uring *ring) {
+}
+
+
+int uring_recv(struct uring *ring, int fd, int fixed, void *buf, size_t len, uint64_t user_data) {
+    return -1;
+}
+
+
+int uring_poll(struct uring *ring, int fd, int fixed, unsigned int events, uint64_t user_data) {
+    return -1;
+}
+
+
+int uring_submit_and_wait(struct uring *ring, unsigned int wait_nr) {
+    errno = ENOSYS;
+    return -1;
+}
+
+
+int uring_next_completion(struct uring *ring, uint64_t *user_data, int *res) {
+    return 0;
+}
+
+
+int uring_file_add(struct uring *ring, int fd) {
+    return -1;
+}
+
+
+void uring_file_remove(struct uring *ring, int slot) {
+}
+
+#endif /* HAVE_IO_URING */
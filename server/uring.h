@@ -0,0 +1,90 @@
+/**
+ * @file uring.h
+ * @brief Minimal io_uring ring for the event loops, on the raw system calls
+ *
+ * Only what the event loops need: queueing receives and polls, registering the client
+ * sockets as fixed files and reaping completions.  Submission and completion queues are
+ * touched by a single thread, the one owning the ring.
+ *
+ * Built without <linux/io_uring.h> every call fails with ENOSYS, so callers fall back
+ * to epoll the same way they do on kernels without io_uring.
+ */
+
+#ifndef AESDSOCKET_URING_H
+#define AESDSOCKET_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct uring {
+    int fd;
+    // submission queue, shared with the kernel
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_queued;     // entries filled in since the last submit
+    // completion queue, shared with the kernel
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    // mappings
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    // fixed file table, slot i is free if files[i] == -1
+    int *files;
+    unsigned int nfiles;
+    unsigned int next_file;
+};
+
+/**
+ * Set up a ring of @param entries submissions with a sparse table of @param nfiles fixed
+ * files, failing unless the kernel supports every operation the event loops use.
+ * @return 0 on success, -1 with errno set on error
+ */
+int uring_init(struct uring *ring, unsigned int entries, unsigned int nfiles);
+
+void uring_exit(struct uring *ring);
+
+/**
+ * Queue a receive of up to @param len bytes into @param buf from @param fd, a fixed
+ * file slot if @param fixed.
+ * @return 0 on success, -1 if the submission queue could not be flushed
+ */
+int uring_recv(struct uring *ring, int fd, int fixed, void *buf, size_t len, uint64_t user_data);
+
+/**
+ * Queue a one shot poll of @param fd for @param events, a fixed file slot if @param fixed.
+ * @return 0 on success, -1 if the submission queue could not be flushed
+ */
+int uring_poll(struct uring *ring, int fd, int fixed, unsigned int events, uint64_t user_data);
+
+/**
+ * Submit everything queued and wait until at least @param wait_nr completions are ready.
+ * @return 0 on success, -1 with errno set on error
+ */
+int uring_submit_and_wait(struct uring *ring, unsigned int wait_nr);
+
+/**
+ * Take the oldest completion.
+ * @return 1 with @param user_data and @param res set, 0 if no completion is ready
+ */
+int uring_next_completion(struct uring *ring, uint64_t *user_data, int *res);
+
+/**
+ * Register @param fd in a free fixed file slot.
+ * @return the slot, -1 if the table is full or the kernel refused
+ */
+int uring_file_add(struct uring *ring, int fd);
+
+void uring_file_remove(struct uring *ring, int slot);
+
+#endif /* AESDSOCKET_URING_H */
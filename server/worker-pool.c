@@ -0,0 +1,196 @@
+/**
+ * @file worker-pool.c
+ * @brief Fixed size worker pool with work stealing for aesdsocket packet processing
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include "worker-pool.h"
+
+#define DEQUE_INITIAL_SIZE 64
+
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;       // protects the deque below
+    struct work_item **items;   // ring buffer, owner pops at tail, thieves take from head
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
+
+static struct worker *workers;
+static int num_workers;
+static unsigned int next_worker;
+static __thread int self = -1; // index of the calling worker, -1 outside the pool
+
+// idle workers sleep until there is pending work
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int pending;
+static int stopping;
+
+
+static int deque_push(struct worker *w, struct work_item *item) {
+    pthread_mutex_lock(&w->lock);
+    if (w->tail - w->head == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : DEQUE_INITIAL_SIZE;
+        struct work_item **items = malloc(cap * sizeof(*items));
+        if (!items) {
+            pthread_mutex_unlock(&w->lock);
+            return -1;
+        }
+        for (size_t i = w->head; i != w->tail; i++) {
+            items[i - w->head] = w->items[i % w->cap];
+        }
+        free(w->items);
+        w->items = items;
+        w->tail -= w->head;
+        w->head = 0;
+        w->cap = cap;
+    }
+    w->items[w->tail++ % w->cap] = item;
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+
+static struct work_item *deque_pop(struct worker *w) {
+    struct work_item *item = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail != w->head) item = w->items[--w->tail % w->cap];
+    pthread_mutex_unlock(&w->lock);
+    return item;
+}
+
+
+static struct work_item *deque_steal(struct worker *w) {
+    struct work_item *item = NULL;
+    if (pthread_mutex_trylock(&w->lock) != 0) return NULL;  // owner or another thief is busy, try elsewhere
+    if (w->tail != w->head) item = w->items[w->head++ % w->cap];
+    pthread_mutex_unlock(&w->lock);
+    return item;
+}
+
+
+static struct work_item *find_work(void) {
+    struct work_item *item = deque_pop(&workers[self]);
+    for (int i = 1; !item && i < num_workers; i++) {
+        item = deque_steal(&workers[(self + i) % num_workers]);
+    }
+    return item;
+}
+
+
+static void *worker_thread(void *arg) {
+    self = (int)(long)arg;
+
+    for (;;) {
+        struct work_item *item = find_work();
+        if (item) {
+            __atomic_sub_fetch(&pending, 1, __ATOMIC_RELAXED);
+            item->fn(item);
+            continue;
+        }
+
+        pthread_mutex_lock(&idle_lock);
+        while (__atomic_load_n(&pending, __ATOMIC_RELAXED) <= 0 && !stopping) {
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        }
+        int done = stopping && __atomic_load_n(&pending, __ATOMIC_RELAXED) <= 0;
+        pthread_mutex_unlock(&idle_lock);
+        if (done) break;
+    }
+    return NULL;
+}
+
+
+int worker_pool_start(int nworkers) {
+    if (nworkers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = cpus > 0 ? (int)cpus : 1;
+    }
+
+    workers = calloc(nworkers, sizeof(struct worker));
+    if (!workers) {
+        syslog(LOG_ERR, "Failed to allocate memory for worker pool");
+        return -1;
+    }
+
+    // workers never handle SIGINT/SIGTERM, the accept loop in main has to see them
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    // publish the full count first, a started worker may already try to steal from the others
+    num_workers = nworkers;
+    for (int i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+    }
+
+    int started;
+    for (started = 0; started < nworkers; started++) {
+        if (pthread_create(&workers[started].thread, NULL, worker_thread, (void *)(long)started) != 0) {
+            syslog(LOG_ERR, "Failed to create worker thread");
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (started < nworkers) {
+        // nothing was submitted yet, so the started workers only look at their own empty deques
+        num_workers = started;
+        worker_pool_stop();
+        return -1;
+    }
+    syslog(LOG_INFO, "Started %d packet workers", nworkers);
+    return 0;
+}
+
+
+int worker_pool_enabled(void) {
+    return num_workers > 0;
+}
+
+
+int worker_pool_submit(struct work_item *item) {
+    int target = self;
+    if (target < 0) target = __atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % num_workers;
+
+    if (deque_push(&workers[target], item) == -1) {
+        syslog(LOG_ERR, "Failed to queue work item");
+        return -1;
+    }
+
+    pthread_mutex_lock(&idle_lock);
+    __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+    return 0;
+}
+
+
+void worker_pool_stop(void) {
+    pthread_mutex_lock(&idle_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_mutex_destroy(&workers[i].lock);
+        free(workers[i].items);
+    }
+    free(workers);
+    workers = NULL;
+    num_workers = 0;
+    stopping = 0;
+}
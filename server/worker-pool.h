@@ -0,0 +1,43 @@
+/**
+ * @file worker-pool.h
+ * @brief Fixed size worker pool with work stealing for aesdsocket packet processing
+ *
+ * Every worker owns a deque.  Work submitted by a worker lands on its own deque and is
+ * popped LIFO, work submitted from other threads is spread round-robin over the workers.
+ * Idle workers steal the oldest item from the other deques before going to sleep.
+ */
+
+#ifndef AESDSOCKET_WORKER_POOL_H
+#define AESDSOCKET_WORKER_POOL_H
+
+/**
+ * A unit of work.  Embed it as the first member of a larger structure and cast back
+ * to that structure in @param fn.  The item must stay valid until fn has been called.
+ */
+struct work_item {
+    void (*fn)(struct work_item *item);
+};
+
+/**
+ * Start @param nworkers worker threads, or one per online CPU if @param nworkers is 0.
+ * @return 0 on success, -1 on error
+ */
+int worker_pool_start(int nworkers);
+
+/**
+ * @return nonzero if worker_pool_start() succeeded and packets should be handed to the pool
+ */
+int worker_pool_enabled(void);
+
+/**
+ * Queue @param item to be run by one of the workers.
+ * @return 0 on success, -1 on error
+ */
+int worker_pool_submit(struct work_item *item);
+
+/**
+ * Run all queued work, then stop and join the worker threads.
+ */
+void worker_pool_stop(void);
+
+#endif /* AESDSOCKET_WORKER_POOL_H */